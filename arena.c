@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS	64
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disass.h"
+#include "khook.h"
+#include "arena.h"
+#include "emit.h"
+#include "registry.h"
+#include "stw.h"
+
+
+/**
+ * Max. number of W^X arenas.
+ */
+#define ARENA_MAXWX		16
+
+
+/**
+ * Hook to move.
+ */
+typedef struct _hot {
+	uint64_t	 calls;		/**< Observed calls		*/
+	int		 i;		/**< Index of the hook		*/
+} HOT;
+
+/**
+ * W^X arena.
+ */
+typedef struct _wx {
+	uint8_t		*base;		/**< Executable view		*/
+	uint8_t		*wbase;		/**< Writable view		*/
+	size_t		 size;		/**< Size			*/
+} WX;
+
+
+/**
+ * W^X arenas (never removed, published by <code>_nwx</code>).
+ */
+static WX _wx[ARENA_MAXWX];
+static int _nwx;
+
+/**
+ * <code>/proc/self/mem</code>, open once a W^X arena exists.
+ */
+static int _memfd = -1;
+
+
+/**
+ * Map executable memory aligned to a huge page.
+ * Explicit huge pages (<code>MAP_HUGETLB</code>) are tried first, then
+ * the kernel is asked to back the aligned region with transparent huge
+ * pages.
+ * @param size Size (multiple of <code>KHOOK_SIZEOF_HUGEPAGE</code>);
+ * @param huge Set to <code>1</code> if explicit huge pages are used.
+ * @return The region; <code>NULL</code> on error.
+ */
+static uint8_t *
+_map(size_t size, int *huge)
+{
+	uint8_t *p, *aligned;
+	size_t head;
+
+	*huge = 0;
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+	    MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		*huge = 1;
+		return (p);
+	}
+#endif
+
+	p = mmap(NULL, size + KHOOK_SIZEOF_HUGEPAGE,
+	    PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED) {
+		return (NULL);
+	}
+	aligned = (uint8_t *)(((uintptr_t)p + KHOOK_SIZEOF_HUGEPAGE - 1) &
+	    ~(uintptr_t)(KHOOK_SIZEOF_HUGEPAGE - 1));
+	head = aligned - p;
+	if (head != 0) {
+		munmap(p, head);
+	}
+	munmap(aligned + size, KHOOK_SIZEOF_HUGEPAGE - head);
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return (aligned);
+}
+
+
+/**
+ * Create a trampoline arena.
+ * The arena is backed by 2 MB pages where available, so that all the
+ * hooking code shares a single iTLB entry.
+ * @param arena Arena;
+ * @param size Minimum size (rounded up to a multiple of
+ * <code>KHOOK_SIZEOF_HUGEPAGE</code>).
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ * @see khook_arena_repack()
+ */
+int
+khook_arena_init(KHOOK_ARENA *arena, size_t size)
+{
+
+	bzero(arena, sizeof(KHOOK_ARENA));
+	size = (size + KHOOK_SIZEOF_HUGEPAGE - 1) &
+	    ~(size_t)(KHOOK_SIZEOF_HUGEPAGE - 1);
+	if (size == 0) {
+		size = KHOOK_SIZEOF_HUGEPAGE;
+	}
+	arena->base = _map(size, &arena->huge);
+	if (arena->base == NULL) {
+		return (-1);
+	}
+	arena->size = size;
+	arena->hcode = arena->base;
+	arena->hsize = size;
+	return (0);
+}
+
+
+#ifdef MFD_CLOEXEC
+/**
+ * Map a new memory file twice.
+ * @param size Size;
+ * @param flags Extra <code>memfd_create()</code> flags;
+ * @param rx Set to the executable view;
+ * @param rw Set to the writable view.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_map_wx(size_t size, unsigned int flags, uint8_t **rx, uint8_t **rw)
+{
+	int fd;
+
+	fd = memfd_create("khook", MFD_CLOEXEC | flags);
+	if (fd < 0) {
+		return (-1);
+	}
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return (-1);
+	}
+	*rx = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	*rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (*rx == MAP_FAILED || *rw == MAP_FAILED) {
+		if (*rx != MAP_FAILED) {
+			munmap(*rx, size);
+		}
+		if (*rw != MAP_FAILED) {
+			munmap(*rw, size);
+		}
+		*rx = *rw = NULL;
+		return (-1);
+	}
+	return (0);
+}
+#endif
+
+
+/**
+ * Create a W^X trampoline arena.
+ * The arena is a memory file mapped twice: the hooking code is
+ * generated through a writable view and executed from a read-only
+ * view, so no page is ever writable and executable.<br>
+ * From then on the hooked addresses are patched through
+ * <code>/proc/self/mem</code>: hooks are installed without changing
+ * the protection of the code.
+ * @param arena Arena (<code>hcode</code> is in the executable view);
+ * @param size Minimum size (rounded up to a multiple of
+ * <code>KHOOK_SIZEOF_HUGEPAGE</code>).
+ * @return <code>0</code> on success; <code>-1</code> on error or if
+ * the OS is not supported.
+ * @see khook_arena_init()
+ */
+int
+khook_arena_init_wx(KHOOK_ARENA *arena, size_t size)
+{
+#ifdef MFD_CLOEXEC
+	uint8_t *rx, *rw;
+	int n, mem, none;
+
+	bzero(arena, sizeof(KHOOK_ARENA));
+	size = (size + KHOOK_SIZEOF_HUGEPAGE - 1) &
+	    ~(size_t)(KHOOK_SIZEOF_HUGEPAGE - 1);
+	if (size == 0) {
+		size = KHOOK_SIZEOF_HUGEPAGE;
+	}
+	if (__atomic_load_n(&_nwx, __ATOMIC_ACQUIRE) == ARENA_MAXWX) {
+		return (-1);
+	}
+	if (__atomic_load_n(&_memfd, __ATOMIC_ACQUIRE) < 0) {
+		if ((mem = open("/proc/self/mem", O_RDWR | O_CLOEXEC)) < 0) {
+			return (-1);
+		}
+		none = -1;
+		if (!__atomic_compare_exchange_n(&_memfd, &none, mem, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			close(mem);
+		}
+	}
+
+	rx = rw = NULL;
+#ifdef MFD_HUGETLB
+	if (_map_wx(size, MFD_HUGETLB, &rx, &rw) == 0) {
+		arena->huge = 1;
+	}
+#endif
+	if (rx == NULL && _map_wx(size, 0, &rx, &rw) < 0) {
+		return (-1);
+	}
+
+	/*
+	 * Publish the views (the slot is reserved first).
+	 */
+	n = __atomic_load_n(&_nwx, __ATOMIC_ACQUIRE);
+	do {
+		if (n == ARENA_MAXWX) {
+			munmap(rx, size);
+			munmap(rw, size);
+			arena->huge = 0;
+			return (-1);
+		}
+	} while (!__atomic_compare_exchange_n(&_nwx, &n, n + 1, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	_wx[n].wbase = rw;
+	_wx[n].size = size;
+	__atomic_store_n(&_wx[n].base, rx, __ATOMIC_RELEASE);
+
+	arena->base = rx;
+	arena->wbase = rw;
+	arena->size = size;
+	arena->hcode = rx;
+	arena->hsize = size;
+	return (0);
+#else
+	bzero(arena, sizeof(KHOOK_ARENA));
+	return (-1);
+#endif
+}
+
+
+/**
+ * Get the writable address of the hooking code.
+ * @param hcode Address where the code is executed.
+ * @return The address of <code>hcode</code> in the writable view of
+ * its W^X arena; <code>hcode</code> itself if it is not in one.
+ */
+uint8_t *
+arena_wptr(const void *hcode)
+{
+	uint8_t *base;
+	int i, n;
+
+	n = __atomic_load_n(&_nwx, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		base = __atomic_load_n(&_wx[i].base, __ATOMIC_ACQUIRE);
+		if (base != NULL && (uint8_t *)hcode >= base &&
+		    (uint8_t *)hcode < base + _wx[i].size) {
+			return (_wx[i].wbase + ((uint8_t *)hcode - base));
+		}
+	}
+	return ((uint8_t *)hcode);
+}
+
+
+/**
+ * Write into the code of the process.
+ * Once a W^X arena exists the write goes through
+ * <code>/proc/self/mem</code>, which ignores the protection of the
+ * pages; otherwise <code>dst</code> must be writable.
+ * @param dst Destination address;
+ * @param src Source buffer;
+ * @param len Number of bytes.
+ * @return <code>0</code> on success; <code>-1</code> if
+ * <code>/proc/self/mem</code> can't be written (the code is not
+ * writable either: it is not written).
+ */
+int
+arena_poke(void *dst, const void *src, size_t len)
+{
+	int fd;
+
+	fd = __atomic_load_n(&_memfd, __ATOMIC_ACQUIRE);
+	if (fd >= 0) {
+		return (pwrite(fd, src, len, (off_t)(uintptr_t)dst) ==
+		    (ssize_t)len ? 0 : -1);
+	}
+	memcpy(dst, src, len);
+	return (0);
+}
+
+
+/**
+ * Get the short form of a branch.
+ * @param ins Instruction.
+ * @return <code>OPCODE_CALL32</code>, <code>OPCODE_JMP8</code> or a
+ * <code>jxx rel8</code> opcode; <code>0</code> if <code>ins</code> is not
+ * a branch the emitter can generate.
+ */
+static uint8_t
+_branch_op(const INS *ins)
+{
+
+	if (ins->prefixes != 0) {
+		return (0);
+	}
+	if (ins->opcodes == 1) {
+		switch (ins->opcode[0]) {
+		case OPCODE_CALL32:
+			return (OPCODE_CALL32);
+		case OPCODE_JMP32:
+		case OPCODE_JMP8:
+			return (OPCODE_JMP8);
+		default:;
+		}
+		if (ins->opcode[0] >= OPCODE_J8 &&
+		    ins->opcode[0] <= OPCODE_J8 + 0x0F) {
+			return (ins->opcode[0]);
+		}
+	} else if (ins->opcodes == 2 && ins->opcode[0] == OPCODE_ESCAPE &&
+	    ins->opcode[1] >= OPCODE_J32 && ins->opcode[1] <= OPCODE_J32 + 0x0F) {
+		return (ins->opcode[1] - OPCODE_J32 + OPCODE_J8);
+	}
+	return (0);
+}
+
+
+/**
+ * Move the hooking code of a hook.
+ * The code is decoded and emitted again: branches within the code
+ * follow it, the others keep their targets.
+ * @param e Code buffer (at the new address);
+ * @param old Hook record;
+ * @param info Updated with the moved hook record.
+ * @return <code>0</code> on success; <code>-1</code> if the code can't
+ * be moved.
+ */
+static int
+_move(EMIT *e, const KHOOK_INFO *old, KHOOK_INFO *info)
+{
+	const uint8_t *at[EMIT_MAXLABELS], *target, *end;
+	int label[EMIT_MAXLABELS], i, k, nlabels;
+	uint8_t *src, op;
+	INS ins;
+
+	/*
+	 * A label for every re-encoded instruction (see khook_fixup()).
+	 */
+	nlabels = 0;
+	for (k = 0; k < old->nins; k++) {
+		at[nlabels] = (uint8_t *)old->hcode + old->recoff[k];
+		label[nlabels++] = emit_label(e);
+	}
+
+	src = old->hcode;
+	end = src + old->hsize;
+	while (src < end) {
+		for (i = 0; i < nlabels; i++) {
+			if (at[i] == src) {
+				emit_bind(e, label[i]);
+			}
+		}
+		if (disass_fetch_end(&ins, &src, end) <= 0) {
+			return (-1);
+		}
+		target = disass_target(&ins, src);
+		if (target == NULL) {
+			emit_ins(e, &ins);
+			continue;
+		}
+		if ((op = _branch_op(&ins)) == 0) {
+			return (-1);
+		}
+		if (target < (uint8_t *)old->hcode || target >= end) {
+			emit_branch_to(e, op, target);
+			continue;
+		}
+
+		/*
+		 * Forward branch within the hooking code.
+		 */
+		if (target < src) {
+			return (-1);
+		}
+		for (i = 0; i < nlabels && at[i] != target; i++)
+			;
+		if (i == nlabels) {
+			if (nlabels == EMIT_MAXLABELS) {
+				return (-1);
+			}
+			at[nlabels] = target;
+			label[nlabels++] = emit_label(e);
+		}
+		emit_branch(e, op, label[i]);
+	}
+	if (emit_end(e) == 0) {
+		return (-1);
+	}
+
+	memcpy(info, old, sizeof(KHOOK_INFO));
+	info->hcode = e->at;
+	info->hsize = e->len;
+	for (k = 0; k < old->nins; k++) {
+		info->recoff[k] = e->label[label[k]];
+	}
+	return (0);
+}
+
+
+/**
+ * Sort hooks by decreasing number of calls.
+ */
+static int
+_cmp(const void *a, const void *b)
+{
+	const HOT *ha = a, *hb = b;
+
+	if (ha->calls != hb->calls) {
+		return (ha->calls > hb->calls ? -1 : 1);
+	}
+	return (ha->i - hb->i);
+}
+
+
+/**
+ * Move the hooking code of installed hooks to an arena, hottest first.
+ * The code of the most called hooks ends up packed in the first cache
+ * lines of the free space of <code>arena</code>. The old hooking code
+ * is left untouched: threads still running it (or returning to it from
+ * a callback) go on safely, and it can be reused once no thread can
+ * be there anymore.<br>
+ * The hooked addresses must be writable, as for <code>khook()</code>.
+ * @param arena Destination arena;
+ * @param fn Hooked addresses (the addresses not hooked, and the hooks
+ * whose code can't be moved, are skipped: they keep their old code);
+ * @param calls Calls observed for every hook (e.g.
+ * <code>khook_count_get()</code>);
+ * @param n Number of hooks;
+ * @param stw If not <code>NULL</code> it receives the pause: the other
+ * threads are always stopped while patching (see
+ * <code>khook_txn_commit_stw()</code>), the jumps being rewritten are
+ * the ones of the hottest functions and a thread running a partly
+ * written one would jump anywhere.
+ * @return The number of hooks moved; <code>-1</code> on error (no hook
+ * is moved).
+ */
+int
+khook_arena_repack(KHOOK_ARENA *arena, void *const *fn,
+    const uint64_t *calls, int n, KHOOK_STW *stw)
+{
+	struct timespec t0, t1;
+	const KHOOK_INFO *old;
+	KHOOK_INFO *moved, *prev;
+	uint8_t *hcode, jmp[SIZEOF_JMP32];
+	size_t hsize;
+	HOT *hot;
+	EMIT e;
+	int i, m, nthreads;
+
+	hot = malloc(n * sizeof(HOT));
+	moved = malloc(n * sizeof(KHOOK_INFO));
+	prev = malloc(n * sizeof(KHOOK_INFO));
+	if (hot == NULL || moved == NULL || prev == NULL) {
+		free(hot);
+		free(moved);
+		free(prev);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		hot[i].calls = calls[i];
+		hot[i].i = i;
+	}
+	qsort(hot, n, sizeof(HOT), _cmp);
+
+	/*
+	 * Generate the code in order of hotness.
+	 */
+	hcode = arena->hcode;
+	hsize = arena->hsize;
+	for (i = m = 0; i < n; i++) {
+		if ((old = khook_lookup(fn[hot[i].i])) == NULL) {
+			continue;
+		}
+		emit_init(&e, arena_wptr(hcode), hsize, hcode);
+		if (_move(&e, old, &moved[m]) < 0) {
+			continue;
+		}
+		memcpy(&prev[m], old, sizeof(KHOOK_INFO));
+		hcode += e.len;
+		hsize -= e.len;
+		m++;
+	}
+	free(hot);
+
+	/*
+	 * Update the registry before stopping: a stopped thread could
+	 * hold the allocator's lock.
+	 */
+	for (i = 0; i < m; i++) {
+		if (registry_set(&moved[i]) == NULL) {
+			while (--i >= 0) {
+				registry_set(&prev[i]);
+			}
+			free(moved);
+			free(prev);
+			return (-1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((nthreads = stw_stop()) < 0) {
+		for (i = 0; i < m; i++) {
+			registry_set(&prev[i]);
+		}
+		free(moved);
+		free(prev);
+		return (-1);
+	}
+	for (i = 0; i < m; i++) {
+		khook_patch_gen(&moved[i], jmp);
+		if (arena_poke(moved[i].fn, jmp, sizeof(jmp)) < 0) {
+			break;
+		}
+	}
+	if (i < m) {
+		/*
+		 * Back to the old code.
+		 */
+		while (--i >= 0) {
+			khook_patch_gen(&prev[i], jmp);
+			arena_poke(prev[i].fn, jmp, sizeof(jmp));
+		}
+		stw_resume();
+		for (i = 0; i < m; i++) {
+			registry_set(&prev[i]);
+		}
+		free(moved);
+		free(prev);
+		return (-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stw_resume();
+	if (stw != NULL) {
+		stw->pause = (t1.tv_sec - t0.tv_sec) * 1000000000L +
+		    t1.tv_nsec - t0.tv_nsec;
+		stw->threads = nthreads;
+		stw->moved = 0;
+	}
+
+	arena->hcode = hcode;
+	arena->hsize = hsize;
+	free(moved);
+	free(prev);
+	return (m);
+}
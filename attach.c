@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * khook-attach: count the calls of functions of a running process.
+ *
+ * The target is stopped with ptrace(2) only while the hooks are
+ * installed: the prologues are read and re-encoded locally, the
+ * hooking code and the counters are written with one
+ * process_vm_writev(2) call and the jumps through /proc/<pid>/mem
+ * (process_vm_writev(2) can't write read-only text).
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS	64
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disass.h"
+#include "khook.h"
+
+
+/**
+ * Max. number of hooked functions.
+ */
+#define ATTACH_MAXHOOKS		64
+
+/**
+ * Max. number of threads of the target.
+ */
+#define ATTACH_MAXTHREADS	1024
+
+/**
+ * Default report interval (seconds).
+ */
+#define ATTACH_INTERVAL		1
+
+/**
+ * int 0x80.
+ */
+#define ATTACH_SYSCALL		0x80cd
+
+
+/**
+ * Target process.
+ */
+typedef struct _target {
+	pid_t		 pid;				/**< Process	*/
+	int		 mem;				/**< /proc/<pid>/mem */
+	int		 ntids;				/**< Threads	*/
+	pid_t		 tid[ATTACH_MAXTHREADS];	/**< Thread ids	*/
+} TARGET;
+
+
+static volatile sig_atomic_t _quit;
+
+
+/**
+ * Signal handler: stop reporting.
+ * @param sig Signal number.
+ */
+static void
+_onsig(int sig)
+{
+
+	_quit = 1;
+}
+
+
+/**
+ * Read the memory of the target.
+ * @param ctx Target;
+ * @param dst Destination buffer;
+ * @param addr Address in the target;
+ * @param len Number of bytes.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_peek(void *ctx, void *dst, const void *addr, size_t len)
+{
+	struct iovec local, remote;
+	TARGET *t = ctx;
+
+	local.iov_base = dst;
+	local.iov_len = len;
+	remote.iov_base = (void *)addr;
+	remote.iov_len = len;
+	if (process_vm_readv(t->pid, &local, 1, &remote, 1, 0) !=
+	    (ssize_t)len) {
+		return (-1);
+	}
+	return (0);
+}
+
+
+/**
+ * Write the memory of the target, ignoring the page protection.
+ * @param t Target;
+ * @param addr Address in the target;
+ * @param src Source buffer;
+ * @param len Number of bytes.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_poke(TARGET *t, void *addr, const void *src, size_t len)
+{
+
+	if (pwrite(t->mem, src, len, (off_t)(uintptr_t)addr) !=
+	    (ssize_t)len) {
+		return (-1);
+	}
+	return (0);
+}
+
+
+/**
+ * Resume all the threads of the target.
+ * @param t Target.
+ */
+static void
+_resume(TARGET *t)
+{
+	int i;
+
+	for (i = 0; i < t->ntids; i++) {
+		ptrace(PTRACE_DETACH, t->tid[i], NULL, NULL);
+	}
+	t->ntids = 0;
+}
+
+
+/**
+ * Stop a thread of the target.
+ * @param tid Thread.
+ * @return <code>1</code> if the thread is stopped; <code>0</code> if it
+ * has exited; <code>-1</code> on error (it is not traced).
+ */
+static int
+_stop_thread(pid_t tid)
+{
+	int status;
+
+	if (ptrace(PTRACE_SEIZE, tid, NULL, NULL) < 0) {
+		return (errno == ESRCH ? 0 : -1);
+	}
+	if (ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) < 0) {
+		if (errno == ESRCH) {
+			return (0);
+		}
+		ptrace(PTRACE_DETACH, tid, NULL, NULL);
+		return (-1);
+	}
+	if (waitpid(tid, &status, __WALL) < 0) {
+		ptrace(PTRACE_DETACH, tid, NULL, NULL);
+		return (-1);
+	}
+	return (WIFEXITED(status) || WIFSIGNALED(status) ? 0 : 1);
+}
+
+
+/**
+ * Stop all the threads of the target.
+ * Threads created while scanning are found by the next scan.
+ * @param t Target.
+ * @return <code>0</code> on success; <code>-1</code> on error (no
+ * thread is left stopped).
+ */
+static int
+_stop(TARGET *t)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *dir;
+	pid_t tid;
+	int i, r, found;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)t->pid);
+	t->ntids = 0;
+	do {
+		if ((dir = opendir(path)) == NULL) {
+			_resume(t);
+			return (-1);
+		}
+		found = 0;
+		while ((de = readdir(dir)) != NULL) {
+			tid = (pid_t)strtol(de->d_name, NULL, 10);
+			if (tid <= 0) {
+				continue;
+			}
+			for (i = 0; i < t->ntids && t->tid[i] != tid; i++)
+				;
+			if (i < t->ntids) {
+				continue;
+			}
+			if (t->ntids == ATTACH_MAXTHREADS) {
+				warnx("more than %d threads", ATTACH_MAXTHREADS);
+				errno = ENOSPC;
+				r = -1;
+			} else {
+				r = _stop_thread(tid);
+			}
+			if (r < 0) {
+				closedir(dir);
+				_resume(t);
+				return (-1);
+			}
+			if (r > 0) {
+				t->tid[t->ntids++] = tid;
+				found++;
+			}
+		}
+		closedir(dir);
+	} while (found > 0);
+	return (t->ntids > 0 ? 0 : -1);
+}
+
+
+/**
+ * Allocate executable memory in the target.
+ * The first thread executes an injected mmap2(2) system call.
+ * @param t Target (stopped);
+ * @param len Number of bytes.
+ * @return The address of the memory in the target; <code>NULL</code>
+ * on error.
+ */
+static void *
+_alloc(TARGET *t, size_t len)
+{
+	struct user_regs_struct saved, regs;
+	uint16_t insn, code;
+	pid_t tid;
+	int status;
+
+	tid = t->tid[0];
+	if (ptrace(PTRACE_GETREGS, tid, NULL, &saved) < 0 ||
+	    _peek(t, &code, (void *)saved.eip, sizeof(code)) < 0) {
+		return (NULL);
+	}
+
+	insn = ATTACH_SYSCALL;
+	regs = saved;
+	regs.eax = SYS_mmap2;
+	regs.ebx = 0;
+	regs.ecx = len;
+	regs.edx = PROT_READ | PROT_WRITE | PROT_EXEC;
+	regs.esi = MAP_PRIVATE | MAP_ANONYMOUS;
+	regs.edi = -1;
+	regs.ebp = 0;
+	regs.orig_eax = -1;	/* Don't restart an interrupted call */
+	if (_poke(t, (void *)saved.eip, &insn, sizeof(insn)) < 0) {
+		return (NULL);
+	}
+	if (ptrace(PTRACE_SETREGS, tid, NULL, &regs) < 0 ||
+	    ptrace(PTRACE_SINGLESTEP, tid, NULL, NULL) < 0 ||
+	    waitpid(tid, &status, __WALL) < 0 ||
+	    ptrace(PTRACE_GETREGS, tid, NULL, &regs) < 0) {
+		regs.eax = -1;
+	}
+	_poke(t, (void *)saved.eip, &code, sizeof(code));
+	ptrace(PTRACE_SETREGS, tid, NULL, &saved);
+
+	if ((unsigned long)regs.eax >= (unsigned long)-4096) {
+		return (NULL);
+	}
+	return ((void *)regs.eax);
+}
+
+
+/**
+ * Move the stopped threads out of the bytes replaced by the hooks.
+ * @param t Target;
+ * @param info Hook records;
+ * @param n Number of hooks.
+ */
+static void
+_fixup(TARGET *t, const KHOOK_INFO *info, int n)
+{
+	struct user_regs_struct regs;
+	uint32_t ip;
+	int i, k;
+
+	for (i = 0; i < t->ntids; i++) {
+		if (ptrace(PTRACE_GETREGS, t->tid[i], NULL, &regs) < 0) {
+			continue;
+		}
+		ip = regs.eip;
+		for (k = 0; k < n && ip == (uint32_t)regs.eip; k++) {
+			ip = khook_fixup(&info[k], ip);
+		}
+		if (ip != (uint32_t)regs.eip) {
+			regs.eip = ip;
+			ptrace(PTRACE_SETREGS, t->tid[i], NULL, &regs);
+		}
+	}
+}
+
+
+/**
+ * Print the number of calls of every hooked function.
+ * @param t Target;
+ * @param info Hook records;
+ * @param counter Counters in the target;
+ * @param n Number of hooks.
+ * @return <code>0</code> on success; <code>-1</code> if the target
+ * can't be read (it has exited).
+ */
+static int
+_report(TARGET *t, const KHOOK_INFO *info, KHOOK_COUNTER *counter, int n)
+{
+	static KHOOK_COUNTER local[ATTACH_MAXHOOKS];
+	int i;
+
+	if (_peek(t, local, counter, n * sizeof(*local)) < 0) {
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		printf("%p %llu\n", info[i].fn,
+		    (unsigned long long)khook_count_get(&local[i]));
+	}
+	printf("\n");
+	fflush(stdout);
+	return (0);
+}
+
+
+static void
+_usage(void)
+{
+
+	fprintf(stderr, "usage: khook-attach -p pid [-i interval] "
+	    "addr ...\n");
+	exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	static KHOOK_INFO info[ATTACH_MAXHOOKS];
+	static uint8_t buf[ATTACH_MAXHOOKS * KHOOK_SIZEOF_MAXCODE];
+	uint8_t code[KHOOK_SIZEOF_MAXPATCH], jmp[SIZEOF_JMP32];
+	struct iovec local, remote;
+	struct timespec t0, t1;
+	KHOOK_COUNTER *counter;
+	TARGET t;
+	char path[64];
+	uint8_t *remmem;
+	size_t bsize, csize, len;
+	int ch, i, n, interval;
+
+	bzero(&t, sizeof(t));
+	interval = ATTACH_INTERVAL;
+	while ((ch = getopt(argc, argv, "i:p:")) != -1) {
+		switch (ch) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'p':
+			t.pid = (pid_t)atoi(optarg);
+			break;
+		default:
+			_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (t.pid <= 0 || interval <= 0 || argc == 0 ||
+	    argc > ATTACH_MAXHOOKS) {
+		_usage();
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/mem", (int)t.pid);
+	if ((t.mem = open(path, O_RDWR)) < 0) {
+		err(1, "%s", path);
+	}
+
+	/*
+	 * Counters first (they are cache line aligned), then the code.
+	 */
+	n = argc;
+	csize = n * sizeof(KHOOK_COUNTER);
+	len = csize + n * KHOOK_SIZEOF_MAXCODE;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (_stop(&t) < 0) {
+		err(1, "can't stop %d", (int)t.pid);
+	}
+	if ((remmem = _alloc(&t, len)) == NULL) {
+		_resume(&t);
+		errx(1, "can't allocate memory in %d", (int)t.pid);
+	}
+	counter = (KHOOK_COUNTER *)remmem;
+
+	bsize = sizeof(buf);
+	for (i = 0; i < n; i++) {
+		info[i].fn = (void *)strtoul(argv[i], NULL, 0);
+		info[i].hcode = remmem + csize + (sizeof(buf) - bsize);
+		if (_peek(&t, code, info[i].fn, sizeof(code)) < 0 ||
+		    khook_count_gen(&info[i], buf + (sizeof(buf) - bsize),
+		    &bsize, code, &counter[i], _peek, &t) == 0) {
+			_resume(&t);
+			errx(1, "%s: can't hook", argv[i]);
+		}
+	}
+
+	/*
+	 * The counters are zero in the fresh mapping: write the code only.
+	 */
+	local.iov_base = buf;
+	local.iov_len = sizeof(buf) - bsize;
+	remote.iov_base = remmem + csize;
+	remote.iov_len = local.iov_len;
+	if (process_vm_writev(t.pid, &local, 1, &remote, 1, 0) !=
+	    (ssize_t)local.iov_len) {
+		_resume(&t);
+		err(1, "can't write the hooking code");
+	}
+	for (i = 0; i < n; i++) {
+		khook_patch_gen(&info[i], jmp);
+		if (_poke(&t, info[i].fn, jmp, sizeof(jmp)) < 0) {
+			warn("%s: can't patch", argv[i]);
+			/*
+			 * Restore the hooks already patched.
+			 */
+			while (--i >= 0) {
+				_poke(&t, info[i].fn, info[i].orig,
+				    SIZEOF_JMP32);
+			}
+			_resume(&t);
+			return (1);
+		}
+	}
+	_fixup(&t, info, n);
+	_resume(&t);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "khook-attach: %d hooks installed in %ld us\n", n,
+	    (long)(t1.tv_sec - t0.tv_sec) * 1000000 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000);
+
+	signal(SIGINT, _onsig);
+	signal(SIGTERM, _onsig);
+	while (!_quit) {
+		sleep(interval);
+		if (_report(&t, info, counter, n) < 0) {
+			errx(1, "%d has exited", (int)t.pid);
+		}
+	}
+
+	/*
+	 * Restore the original code; the hooking code stays mapped for
+	 * the threads still running it.
+	 */
+	if (_stop(&t) < 0) {
+		err(1, "can't stop %d", (int)t.pid);
+	}
+	for (i = 0; i < n; i++) {
+		_poke(&t, info[i].fn, info[i].orig, SIZEOF_JMP32);
+	}
+	_resume(&t);
+	close(t.mem);
+	return (0);
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "khook.h"
+#include "callers.h"
+#include "shadow.h"
+
+
+/**
+ * Max. number of nested intercepted calls per thread.
+ */
+#define CALLERS_DEPTH	64
+
+
+/**
+ * Intercepted call waiting for its return.
+ */
+typedef struct _call {
+	SHADOW		 s;		/**< Shadow stack entry		*/
+	KHOOK_CALLERS	*callers;	/**< Caller table		*/
+	uint64_t	 tsc;		/**< Time stamp at the call	*/
+} CALL;
+
+
+static __thread CALL _shadow[CALLERS_DEPTH];
+static __thread int _depth;
+static __thread uint32_t _rnd;
+
+
+/*
+ * Return trampoline.
+ * The return address of an intercepted call is replaced with
+ * callers_ret: it preserves the return value (EAX:EDX, ST0 is never
+ * touched by callers_exit()) and jumps to the original return address.
+ *
+ *    push eax                ;Slot for the original return address
+ *    push eax
+ *    push edx
+ *    lea  ecx, [esp + 12]    ;ESP at the return
+ *    push ecx
+ *    call callers_exit
+ *    add  esp, 4
+ *    mov  [esp + 8], eax
+ *    pop  edx
+ *    pop  eax
+ *    ret
+ */
+__asm__(
+	"	.text\n"
+	"	.globl	callers_ret\n"
+	"	.hidden	callers_ret\n"
+	"	.type	callers_ret, @function\n"
+	"callers_ret:\n"
+	"	pushl	%eax\n"
+	"	pushl	%eax\n"
+	"	pushl	%edx\n"
+	"	leal	12(%esp), %ecx\n"
+	"	pushl	%ecx\n"
+	"	call	callers_exit\n"
+	"	addl	$4, %esp\n"
+	"	movl	%eax, 8(%esp)\n"
+	"	popl	%edx\n"
+	"	popl	%eax\n"
+	"	ret\n"
+	"	.size	callers_ret, .-callers_ret\n"
+);
+
+
+/**
+ * Hash a caller address.
+ * @param ra Return address.
+ * @return Slot index.
+ */
+static inline uint32_t
+_hash(const void *ra)
+{
+	return (((uint32_t)(uintptr_t)ra * 0x9E3779B1U) >>
+	    (32 - KHOOK_CALLERS_BITS));
+}
+
+
+/**
+ * Draw a pseudo-random number (xorshift, one sequence per thread).
+ * @return Random number.
+ */
+static inline uint32_t
+_random(void)
+{
+	uint32_t x;
+
+	if ((x = _rnd) == 0) {
+		x = (uint32_t)__builtin_ia32_rdtsc() | 1;
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (_rnd = x);
+}
+
+
+/**
+ * Account a call.
+ * The shard is selected from the stack page of the calling thread;
+ * a slot changes only once, from empty to a caller, so inserts need
+ * just a compare and swap.
+ * @param callers Caller table;
+ * @param sp Stack address of the calling thread;
+ * @param ra Return address;
+ * @param cycles Cycles spent in the call.
+ */
+static void
+_account(KHOOK_CALLERS *callers, uintptr_t sp, const void *ra,
+    uint64_t cycles)
+{
+	KHOOK_CALLER *shard, *slot;
+	const void *key;
+	uint32_t i, n;
+
+	shard = callers->slot[(sp >> 12) & (KHOOK_CALLERS_SHARDS - 1)];
+	i = _hash(ra);
+	for (n = 0; n < (1U << KHOOK_CALLERS_BITS); n++) {
+		slot = &shard[i];
+		key = __atomic_load_n(&slot->ra, __ATOMIC_ACQUIRE);
+		if (key == NULL) {
+			if (__atomic_compare_exchange_n(&slot->ra, &key, ra,
+			    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				key = ra;
+			}
+		}
+		if (key == ra) {
+			__atomic_fetch_add(&slot->calls, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&slot->cycles, cycles,
+			    __ATOMIC_RELAXED);
+			return;
+		}
+		i = (i + 1) & ((1U << KHOOK_CALLERS_BITS) - 1);
+	}
+
+	/*
+	 * Shard full.
+	 */
+	__atomic_fetch_add(&callers->dropped, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Intercept the return of a call.
+ * It is called by the hooking code on entry to the hooked function.
+ * @param callers Caller table;
+ * @param ret Address of the return address.
+ */
+void
+callers_enter(KHOOK_CALLERS *callers, void **ret)
+{
+	CALL *c;
+	void *ra;
+	int i;
+
+	_depth = shadow_trim(_shadow, sizeof(CALL), _depth, (uintptr_t)ret);
+	i = shadow_find(_shadow, sizeof(CALL), _depth, (uintptr_t)ret);
+	if (*ret == (void *)callers_ret) {
+		/*
+		 * Tail call from an intercepted call: its return is
+		 * intercepted already. Count the call, from the original
+		 * caller, without timing it.
+		 */
+		ra = i >= 0 ? _shadow[i].s.ret : *ret;
+		_account(callers, (uintptr_t)ret, ra, 0);
+		return;
+	}
+	if (i >= 0) {
+		/*
+		 * Stale: the return address has been overwritten.
+		 */
+		_depth = shadow_drop(_shadow, sizeof(CALL), _depth, i);
+	}
+
+	if (callers->rate > 1 && _random() % callers->rate != 0) {
+		/*
+		 * Not sampled: count the call without timing it.
+		 */
+		_account(callers, (uintptr_t)ret, *ret, 0);
+		return;
+	}
+
+	if (_depth == CALLERS_DEPTH) {
+		/*
+		 * Too deep: count the call without timing it.
+		 */
+		_account(callers, (uintptr_t)ret, *ret, 0);
+		return;
+	}
+
+	c = &_shadow[_depth++];
+	c->s.sp = (uintptr_t)ret;
+	c->s.ret = *ret;
+	c->callers = callers;
+	c->tsc = __builtin_ia32_rdtsc();
+	*ret = (void *)callers_ret;
+}
+
+
+/**
+ * Account an intercepted call on its return.
+ * It is called by callers_ret.
+ * @param sp Value of ESP after the return.
+ * @return The original return address.
+ */
+void *
+callers_exit(uintptr_t sp)
+{
+	uint64_t cycles;
+	CALL c;
+	int i;
+
+	cycles = __builtin_ia32_rdtsc();
+	sp -= sizeof(void *);
+	_depth = shadow_trim(_shadow, sizeof(CALL), _depth, sp);
+	i = shadow_find(_shadow, sizeof(CALL), _depth, sp);
+	if (i < 0) {
+		/*
+		 * The original return address is lost.
+		 */
+		abort();
+	}
+	c = _shadow[i];
+	_depth = shadow_drop(_shadow, sizeof(CALL), _depth, i);
+	cycles -= c.tsc;
+
+	/*
+	 * A sampled call stands for rate calls.
+	 */
+	if (c.callers->rate > 1) {
+		cycles *= c.callers->rate;
+	}
+	_account(c.callers, sp, c.s.ret, cycles);
+	return (c.s.ret);
+}
+
+
+/**
+ * Find a caller in a shard.
+ * @param shard Shard;
+ * @param ra Return address.
+ * @return The slot of <code>ra</code>; <code>NULL</code> if not found.
+ */
+static const KHOOK_CALLER *
+_find(const KHOOK_CALLER *shard, const void *ra)
+{
+	const void *key;
+	uint32_t i, n;
+
+	i = _hash(ra);
+	for (n = 0; n < (1U << KHOOK_CALLERS_BITS); n++) {
+		key = __atomic_load_n(&shard[i].ra, __ATOMIC_ACQUIRE);
+		if (key == ra) {
+			return (&shard[i]);
+		}
+		if (key == NULL) {
+			break;
+		}
+		i = (i + 1) & ((1U << KHOOK_CALLERS_BITS) - 1);
+	}
+	return (NULL);
+}
+
+
+/**
+ * Take a snapshot of a caller table.
+ * The shards are merged, so every caller appears once.
+ * @param callers Caller table;
+ * @param dst Destination array;
+ * @param n Number of elements of <code>dst</code>.
+ * @return The number of distinct callers (if it is larger than
+ * <code>n</code> only the first <code>n</code> are stored).
+ * @see khook_callers()
+ */
+size_t
+khook_callers_snapshot(const KHOOK_CALLERS *callers, KHOOK_CALLER *dst,
+    size_t n)
+{
+	const KHOOK_CALLER *slot;
+	const void *ra;
+	size_t count;
+	int i, j, k;
+
+	count = 0;
+	for (i = 0; i < KHOOK_CALLERS_SHARDS; i++) {
+		for (j = 0; j < (1 << KHOOK_CALLERS_BITS); j++) {
+			ra = __atomic_load_n(&callers->slot[i][j].ra,
+			    __ATOMIC_ACQUIRE);
+			if (ra == NULL) {
+				continue;
+			}
+
+			/*
+			 * Already merged from a previous shard?
+			 */
+			for (k = 0; k < i; k++) {
+				if (_find(callers->slot[k], ra) != NULL) {
+					break;
+				}
+			}
+			if (k < i) {
+				continue;
+			}
+
+			if (count < n) {
+				dst[count].ra = ra;
+				dst[count].calls = 0;
+				dst[count].cycles = 0;
+				for (k = i; k < KHOOK_CALLERS_SHARDS; k++) {
+					slot = _find(callers->slot[k], ra);
+					if (slot == NULL) {
+						continue;
+					}
+					dst[count].calls += __atomic_load_n(
+					    &slot->calls, __ATOMIC_RELAXED);
+					dst[count].cycles += __atomic_load_n(
+					    &slot->cycles, __ATOMIC_RELAXED);
+				}
+			}
+			count++;
+		}
+	}
+	return (count);
+}
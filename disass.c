@@ -28,38 +28,28 @@
 #include <string.h>
 #include <stdint.h>
 
-#include "opcodes.h"
 #include "disass.h"
+#include "tables.h"
 
 typedef struct _ins INS;
 
 
 /**
- * Detect whether a given byte is an x86 instruction prefix.
- * @param byte Byte to analyze.
- * @return A non-zero value if the specified byte is an x86 instruction
- * prefix.
+ * Immediate data and displacement types indexed by their length.
+ * @see OPMAP_IMM()
+ * @see MODRM_DISP()
  */
-static int
-_isprefix(uint8_t byte)
-{
-	switch (byte) {
-	case PREFIX1_LOCK:
-	case PREFIX1_REPNZ:
-	case PREFIX1_REPZ:
-	case PREFIX2_CSSEG:
-	case PREFIX2_SSSEG:
-	case PREFIX2_DSSEG:
-	case PREFIX2_ESSEG:
-	case PREFIX2_FSSEG:
-	case PREFIX2_GSSEG:
-	case PREFIX3_OPSIZ:
-	case PREFIX3_ADSIZ:
-		return (1);
-	default:;
-	}
-	return (0);
-}
+static const int8_t _param_type[9] = {
+	INS_PARAM_TYPE_NONE,
+	INS_PARAM_TYPE_BYTE,
+	INS_PARAM_TYPE_WORD,
+	INS_PARAM_TYPE_D24,
+	INS_PARAM_TYPE_DWORD,
+	INS_PARAM_TYPE_NONE,
+	INS_PARAM_TYPE_OFFSEL,
+	INS_PARAM_TYPE_NONE,
+	INS_PARAM_TYPE_QWORD
+};
 
 
 /**
@@ -67,13 +57,14 @@ _isprefix(uint8_t byte)
  * @param ins Updated with the detected prefixes;
  * @param code Instruction address; at exit it is uptaded with
  * the address of the actual opcode.
- * @see _isprefix()
+ * @see opmap1
  */
 static void
 _detect_prefix(INS *ins, uint8_t **code)
 {
 	for (ins->prefixes = 0;
-	    ins->prefixes < PREFIX_MAX && _isprefix(**code);
+	    ins->prefixes < PREFIX_MAX &&
+	    OPMAP_KIND(opmap1[**code]) == OPMAP_KIND_PREFIX;
 	    ins->prefixes++, (*code)++) {
 		ins->prefix[ins->prefixes] = **code;
 		if (**code == PREFIX3_OPSIZ) {
@@ -85,13 +76,132 @@ _detect_prefix(INS *ins, uint8_t **code)
 }
 
 
+/**
+ * Validate a coprocessor (x87) instruction.
+ * The escape opcodes D8-DF are always followed by a MODRM: when its mod
+ * field is 11 the reg and rm fields select an instruction that operates
+ * on the register stack, otherwise the reg field selects an instruction
+ * with a memory operand (addressed as any other MODRM operand).
+ * @param ins Instruction with the escape opcode already detected; its
+ * flags are set to <code>OPMAP_KIND_UNDEF</code> if the encoding is not
+ * valid;
+ * @param code Address of the MODRM that follows the escape opcode.
+ * @see copro_map
+ */
+static void
+_detect_copro(INS *ins, const uint8_t *code)
+{
+	const uint8_t *valid;
+	uint8_t modrm, reg;
+
+	modrm = *code;
+	valid = copro_map[ins->opcode[0] - OPCODE_COPRO];
+	reg = (modrm >> 3) & 0x07;
+	if ((modrm & 0xC0) == 0xC0) {
+		valid += 1 + reg;
+		reg = modrm & 0x07;
+	}
+	ins->flags = (*valid & (1 << reg)) ?
+	    OPMAP_MODRM : (OPMAP_KIND_UNDEF << 2);
+}
+
+
+/**
+ * Detect a VEX/EVEX prefixed instruction.
+ * In 32 bits mode C4, C5 and 62 are LES, LDS and BOUND unless the byte
+ * that follows has the two most significant bits set (that would be an
+ * invalid register operand for them); in that case they start a VEX
+ * (C4: 3 bytes, C5: 2 bytes) or EVEX (62: 4 bytes) prefix that selects
+ * the opcode map of the single byte opcode that follows:
+ * <pre>
+ *  C5 | R vvvv L pp |
+ *  C4 | R X B mmmmm | W vvvv L pp |
+ *  62 | R X B R' 0 mmm | W vvvv 1 pp | z L'L b V' aaa |
+ * </pre>
+ * @param ins Updated with the VEX/EVEX prefix and the opcode; its flags
+ * are set to <code>OPMAP_KIND_UNDEF</code> if the encoding is not valid;
+ * @param code Address that follows the VEX/EVEX first byte; at exit it
+ * is updated with the address that follows the opcode.
+ * @see opmap2
+ * @see opmap38
+ * @see opmap3a
+ */
+static void
+_detect_vex(INS *ins, uint8_t **code)
+{
+	int i, size, map;
+
+	ins->vex[0] = ins->opcode[0];
+	switch (ins->vex[0]) {
+	case OPCODE_VEX2:
+		size = 2;
+		map = 1;
+		break;
+	case OPCODE_VEX3:
+		size = 3;
+		map = **code & 0x1F;
+		break;
+	default: /* OPCODE_EVEX */
+		size = 4;
+		map = **code & 0x07;
+	}
+	for (ins->vexes = 1; ins->vexes < size; ins->vexes++, (*code)++) {
+		ins->vex[ins->vexes] = **code;
+	}
+	ins->opcode[0] = **code;
+	(*code)++;
+
+	switch (map) {
+	case 1:
+		ins->flags = opmap2[ins->opcode[0]];
+		break;
+	case 2:
+		ins->flags = opmap38[ins->opcode[0]];
+		break;
+	case 3:
+		ins->flags = opmap3a[ins->opcode[0]];
+		break;
+	case 5:
+	case 6:
+		/*
+		 * EVEX only maps (AVX512-FP16): no immediate data.
+		 */
+		ins->flags = (size == 4) ?
+		    OPMAP_MODRM : (OPMAP_KIND_UNDEF << 2);
+		break;
+	default:
+		ins->flags = OPMAP_KIND_UNDEF << 2;
+	}
+
+	/*
+	 * There are no VEX encoded escapes and branches, and the
+	 * LOCK, REP and operand size prefixes are not allowed.
+	 */
+	if (OPMAP_KIND(ins->flags) != OPMAP_KIND_INS ||
+	    (ins->flags & OPMAP_REL)) {
+		ins->flags = OPMAP_KIND_UNDEF << 2;
+	}
+	for (i = 0; i < ins->prefixes; i++) {
+		switch (ins->prefix[i]) {
+		case PREFIX1_LOCK:
+		case PREFIX1_REPNZ:
+		case PREFIX1_REPZ:
+		case PREFIX3_OPSIZ:
+			ins->flags = OPMAP_KIND_UNDEF << 2;
+		default:;
+		}
+	}
+}
+
+
 /**
  * Detect the opcode of an x86 instruction.
- * @param ins Updated with the detected opcode;
+ * @param ins Updated with the detected opcode and its packed opcode map
+ * entry (<code>OPMAP_KIND_UNDEF</code> if the opcode is not valid);
  * @param code Address with the opcode to detect; at exit it is updated
  * with the address that follows the detected opcode.
- * @todo Coprocessor opcodes (If a coporcessor opcode is detected a trap
- * interrupt is generated)
+ * @see _detect_copro()
+ * @see _detect_vex()
  */
 static void
 _detect_opcode(INS *ins, uint8_t **code)
@@ -99,31 +209,42 @@ _detect_opcode(INS *ins, uint8_t **code)
 	/*
 	 * Get flags and store the first opcode byte.
 	 */
-	ins->flags = opcode1_map[**code];
+	ins->flags = opmap1[**code];
 	ins->opcode[0] = **code;
 	ins->opcodes = 1;
 	(*code)++;
-	if (ins->flags & _E) {
+	switch (OPMAP_KIND(ins->flags)) {
+	case OPMAP_KIND_ESCAPE:
 		/*
 		 * The opcode has 2 bytes.
 		 */
-		ins->flags = opcode2_map[**code];
+		ins->flags = opmap2[**code];
 		ins->opcode[ins->opcodes++] = **code;
 		(*code)++;
-	} else if (ins->flags & _C) {
+		if (OPMAP_KIND(ins->flags) == OPMAP_KIND_ESCAPE) {
+			/*
+			 * The opcode has 3 bytes.
+			 */
+			ins->flags = (ins->opcode[1] == OPCODE_ESC38) ?
+			    opmap38[**code] : opmap3a[**code];
+			ins->opcode[ins->opcodes++] = **code;
+			(*code)++;
+		}
+		break;
+	case OPMAP_KIND_VEX:
+		/*
+		 * VEX/EVEX prefix.
+		 */
+		if ((**code & 0xC0) == 0xC0) {
+			_detect_vex(ins, code);
+		}
+		break;
+	case OPMAP_KIND_COPRO:
 		/*
 		 * Coprocessor instruction.
-		 * TODO
 		 */
-#ifdef WIN32
-		_asm int 3
-		_asm push 0xC0C0CACA
-		_asm pop eax
-#else
-		asm("int $3\n"
-		    "pushl $0xC0C0CACA\n"
-		    "popl %eax\n");
-#endif
+		_detect_copro(ins, *code);
+	default:;
 	}
 }
 
@@ -137,7 +258,7 @@ _detect_opcode(INS *ins, uint8_t **code)
 static void
 _detect_modrm(INS *ins, uint8_t **code)
 {
-	if (ins->flags & _M) {
+	if (ins->flags & OPMAP_MODRM) {
 		ins->modrm = **code;
 		(*code)++;
 	}
@@ -149,6 +270,7 @@ _detect_modrm(INS *ins, uint8_t **code)
  * @param ins Updated with the SIB;
  * @param code Address containing the instruction arguments; at exit
  * it is updated with the address that follows to the detected SIB.
+ * @see modrm_map
  */
 static void
 _detect_sib(INS *ins, uint8_t **code)
@@ -156,28 +278,11 @@ _detect_sib(INS *ins, uint8_t **code)
 	/*
 	 * The SIB could be there only if MODRM is present.
 	 */
-	if ((ins->flags & _M) == 0) {
-		return;
-	}
-
-	/*
-	 * The SIB is only present on 32 bits operand only when the
-	 * MODRM contains:
-	 *	00xxx100
-	 *	01xxx100
-	 *	10xxx100
-	 */
-	if (ins->opsiz) {
-		return;
-	}
-	switch (ins->modrm & 0xC7) {
-	case 0x04:
-	case 0x44:
-	case 0x84:
+	if ((ins->flags & OPMAP_MODRM) &&
+	    (modrm_map[ins->adsiz][ins->modrm] & MODRM_SIB)) {
 		ins->has_sib = 1;
 		ins->sib = **code;
 		(*code)++;
-	default:;
 	}
 }
 
@@ -187,65 +292,32 @@ _detect_sib(INS *ins, uint8_t **code)
  * @param ins Updated with the displacement value;
  * @param code Address that potentially contains the displacement; at exit
  * it is updated with the address that follows the displacement.
+ * @see modrm_map
  */
 static void
 _detect_disp(INS *ins, uint8_t **code)
 {
-	int type;
+	uint8_t e;
+	int size;
 
 	/*
 	 * The displacement could be there only if there is a MODRM.
 	 */
-	if ((ins->flags & _M) == 0) {
+	if ((ins->flags & OPMAP_MODRM) == 0) {
 		return;
 	}
-	if (ins->adsiz) {
-		/*
-		 * On 16 bits there is a displacement if the MODRM contains:
-		 *	00xxx110 -> 16 bits displacement
-		 *	01xxxxxx -> 8 bits displacement
-		 *	10xxxxxx -> 16 bits displacement
-		 */
-		switch (ins->modrm & 0xC0) {
-		case 0x00:
-			if ((ins->modrm & 0x07) == 0x06) {
-				type = INS_PARAM_TYPE_WORD;
-			}
-			break;
-		case 0x40:
-			type = INS_PARAM_TYPE_BYTE;
-			break;
-		case 0x80:
-			type = INS_PARAM_TYPE_WORD;
-			break;
-		default:
-			return;
-		}
-	} else {
+	e = modrm_map[ins->adsiz][ins->modrm];
+	size = MODRM_DISP(e);
+	if ((e & MODRM_SIBDISP) && (ins->sib & 0x07) == 0x05) {
 		/*
-		 * On 32 bits there is a displacement if the MODRM contains:
-		 *	00xxx101 -> 32 bits displacement
-		 *	01xxxxxx -> 8 bits displacement
-		 *	10xxxxxx -> 32 bits displacement
+		 * SIB without base register.
 		 */
-		switch (ins->modrm & 0xC0) {
-		case 0x00:
-			if ((ins->modrm & 0x07) == 0x05) {
-				type = INS_PARAM_TYPE_DWORD;
-			}
-			break;
-		case 0x40:
-			type = INS_PARAM_TYPE_BYTE;
-			break;
-		case 0x80:
-			type = INS_PARAM_TYPE_DWORD;
-			break;
-		default:
-			return;
-		}
+		size = 4;
+	}
+	if (size != 0) {
+		ins->has_disp = 1;
+		(*code) += insparam_set(&ins->disp, _param_type[size], *code);
 	}
-	ins->has_disp = 1;
-	(*code) += insparam_set(&ins->disp, type, *code);
 }
 
 
@@ -254,41 +326,25 @@ _detect_disp(INS *ins, uint8_t **code)
  * @param ins Updated with the immediate data;
  * @param code Address containing the immediate data; at exit
  * it is updated with the address that follows the immediate data.
+ * @see OPMAP_IMM()
  */
 static void
 _detect_immd(INS *ins, uint8_t **code)
 {
-	int type;
+	int size;
 
-	switch (ins->flags & (_b | _w | _d | _q | _v | _p | _s)) {
-	case _b: /* BYTE */
-		type = INS_PARAM_TYPE_BYTE;
-		break;
-	case _w: /* WORD */
-		type = INS_PARAM_TYPE_WORD;
-		break;
-	case _d: /* DWORD */
-		type = INS_PARAM_TYPE_DWORD;
-		break;
-	case _q: /* QWORD */
-		type = INS_PARAM_TYPE_QWORD;
-		break;
-	case _v: /* WORD o DWORD */
-		type = ins->opsiz ?
-		    INS_PARAM_TYPE_WORD : INS_PARAM_TYPE_DWORD;
-		break;
-	case _p: /* DWORD u OFFSET:SELECTOR */
-		type = ins->adsiz ?
-		    INS_PARAM_TYPE_DWORD : INS_PARAM_TYPE_OFFSEL;
-		break;
-	case _s: /* WORD:BYTE */
-		type = INS_PARAM_TYPE_D24;
-		break;
-	default:
-		return;
+	size = OPMAP_IMM(ins->flags, (ins->flags & OPMAP_IMMADDR) ?
+	    ins->adsiz : ins->opsiz);
+	if ((ins->flags & OPMAP_IMMGROUP) && (ins->modrm & 0x30) != 0) {
+		/*
+		 * Only TEST (MODRM reg 0 and 1) of group 3 has an immediate.
+		 */
+		size = 0;
+	}
+	if (size != 0) {
+		ins->has_immd = 1;
+		(*code) += insparam_set(&ins->immd, _param_type[size], *code);
 	}
-	ins->has_immd = 1;
-	(*code) += insparam_set(&ins->immd, type, *code);
 }
 
 
@@ -382,7 +438,10 @@ insparam_copy(uint8_t *dst, const INS_PARAM *param)
  * @param ins Updated with the detected instruction;
  * @param code Address with the instruction; at exit it is updated with the
  * address of the next instruction.
- * @return The length of the detected instruction.
+ * @return The length of the detected instruction; <code>0</code> if the
+ * opcode is not valid or the instruction is longer than
+ * <code>INS_MAX</code> bytes (in this case <code>code</code> is not
+ * updated).
  * @see _detect_disp()
  * @see _detect_immd()
  * @see _detect_modrm()
@@ -401,15 +460,75 @@ disass_fetch(INS *ins, uint8_t **code)
 	bzero(ins, sizeof(INS));
 	_detect_prefix(ins, code);
 	_detect_opcode(ins, code);
+	if (OPMAP_KIND(ins->flags) == OPMAP_KIND_UNDEF) {
+		/*
+		 * Undefined opcode.
+		 */
+		*code = start;
+		return (0);
+	}
 	_detect_modrm(ins, code);
 	_detect_sib(ins, code);
 	_detect_disp(ins, code);
 	_detect_immd(ins, code);
+	if (*code - start > INS_MAX) {
+		/*
+		 * Longer than the architectural limit: invalid.
+		 */
+		*code = start;
+		return (0);
+	}
 	ins->size = *code - start;
 	return (ins->size);
 }
 
 
+/**
+ * Fetch an x86 instruction from a buffer of known size.
+ * Unlike <code>disass_fetch()</code> no byte at or past <code>end</code>
+ * is read, so a whole file mapping can be swept in place: the bytes are
+ * decoded where they are unless the instruction could cross
+ * <code>end</code>, only then they are copied to a padded buffer.
+ * @param ins Updated with the detected instruction;
+ * @param code Address with the instruction; at exit it is updated with the
+ * address of the next instruction;
+ * @param end Address that follows the last byte of the buffer.
+ * @return The length of the detected instruction; <code>0</code> if the
+ * opcode is not valid; <code>-1</code> if the instruction is truncated
+ * by <code>end</code> (in both cases <code>code</code> is not updated).
+ * @see disass_fetch()
+ */
+int
+disass_fetch_end(INS *ins, uint8_t **code, const uint8_t *end)
+{
+	uint8_t buf[FETCH_MAX], *p;
+	size_t avail;
+
+	if (*code >= end) {
+		return (-1);
+	}
+	avail = end - *code;
+	if (avail >= FETCH_MAX) {
+		return (disass_fetch(ins, code));
+	}
+
+	/*
+	 * Near the end: decode a zero padded copy.
+	 */
+	bzero(buf, sizeof(buf));
+	memcpy(buf, *code, avail);
+	p = buf;
+	if (disass_fetch(ins, &p) == 0) {
+		return (0);
+	}
+	if (ins->size > avail) {
+		return (-1);
+	}
+	*code += ins->size;
+	return (ins->size);
+}
+
+
 /**
  * Write an x86 instruction as is in the holding structure.
  * @param dst Destination address;
@@ -426,10 +545,13 @@ disass_put(uint8_t *dst, const INS *src)
 	for (i = 0; i < src->prefixes; i++, dst++) {
 		*dst = src->prefix[i];
 	}
+	for (i = 0; i < src->vexes; i++, dst++) {
+		*dst = src->vex[i];
+	}
 	for (i = 0; i < src->opcodes; i++, dst++) {
 		*dst = src->opcode[i];
 	}
-	if (src->flags & _M) {
+	if (src->flags & OPMAP_MODRM) {
 		*dst = src->modrm;
 		dst++;
 	}
@@ -448,143 +570,299 @@ disass_put(uint8_t *dst, const INS *src)
 
 
 /**
- * Recode and write an x86 instruction.
- * Recode an instruction in order to make it valid in the new destination
- * address.
+ * Detect a PIC thunk.
+ * The i386 position independent code gets the address of the next
+ * instruction calling a function like <code>__x86.get_pc_thunk.bx</code>:
+ * <pre>
+ *	mov reg, [esp]
+ *	ret
+ * </pre>
+ * @param code Address of the called function.
+ * @return The register loaded by the thunk (0 for EAX to 7 for EDI);
+ * <code>-1</code> if <code>code</code> is not a PIC thunk.
+ */
+static int
+_ispcthunk(const uint8_t *code)
+{
+	/*
+	 * 8B xx 24 C3 where the MODRM xx is 00reg100 (SIB, no
+	 * displacement) and the SIB 24 is [ESP].
+	 */
+	if (code[0] == OPCODE_MOVRM && (code[1] & 0xC7) == 0x04 &&
+	    code[2] == 0x24 && code[3] == OPCODE_RET &&
+	    (code[1] & 0x38) != 0x20) {
+		return ((code[1] >> 3) & 0x07);
+	}
+	return (-1);
+}
+
+
+/**
+ * Write a branch using its shortest encoding.
+ * @param dst Destination address;
+ * @param at Address where the branch is executed;
+ * @param op Branch opcode: <code>OPCODE_CALL32</code>,
+ * <code>OPCODE_JMP8</code> (JMP) or <code>OPCODE_J8</code> + condition;
+ * @param target Branch target.
+ * @return The length of the written instruction.
+ * @see INS_ISREL8()
+ */
+static int
+_put_branch(uint8_t *dst, const uint8_t *at, uint8_t op,
+    const uint8_t *target)
+{
+	INS ni;
+	uint32_t rel;
+	uint8_t rel8;
+
+	bzero(&ni, sizeof(ni));
+	ni.flags = OPMAP_REL;
+	ni.opcodes = 1;
+	ni.has_immd = 1;
+	if (op != OPCODE_CALL32 &&
+	    INS_ISREL8(INS_ABS2REL(at + SIZEOF_J8, target))) {
+		/*
+		 * JMP rel8 or Jxx rel8.
+		 */
+		ni.opcode[0] = op;
+		rel8 = (uint8_t)INS_ABS2REL(at + SIZEOF_J8, target);
+		insparam_set(&ni.immd, INS_PARAM_TYPE_BYTE, &rel8);
+		ni.size = SIZEOF_J8;
+	} else if (op == OPCODE_CALL32 || op == OPCODE_JMP8) {
+		/*
+		 * CALL rel32 or JMP rel32.
+		 */
+		ni.opcode[0] = (op == OPCODE_JMP8) ? OPCODE_JMP32 : op;
+		rel = (uint32_t)INS_ABS2REL(at + SIZEOF_JMP32, target);
+		insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &rel);
+		ni.size = SIZEOF_JMP32;
+	} else {
+		/*
+		 * Jxx rel32.
+		 */
+		ni.opcodes = 2;
+		ni.opcode[0] = OPCODE_ESCAPE;
+		ni.opcode[1] = op - OPCODE_J8 + OPCODE_J32;
+		rel = (uint32_t)INS_ABS2REL(at + SIZEOF_J32, target);
+		insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &rel);
+		ni.size = SIZEOF_J32;
+	}
+	return (disass_put(dst, &ni));
+}
+
+
+/**
+ * Get the target of a relative instruction.
+ * @param ins Instruction;
+ * @param next Address of the instruction that follows <code>ins</code>
+ * (as updated by <code>disass_fetch()</code>).
+ * @return The target address; <code>NULL</code> if <code>ins</code>
+ * has no relative value.
+ */
+const uint8_t *
+disass_target(const INS *ins, const uint8_t *next)
+{
+
+	if ((ins->flags & OPMAP_REL) == 0) {
+		return (NULL);
+	}
+	switch (ins->immd.type) {
+	case INS_PARAM_TYPE_BYTE:
+		return (next + (int8_t)ins->immd.data.byte);
+	case INS_PARAM_TYPE_WORD:
+		return (next + (int16_t)ins->immd.data.word);
+	default:
+		return (next + (int32_t)ins->immd.data.dword);
+	}
+}
+
+
+/**
+ * Detect whether an instruction never continues to the next one.
+ * @param ins Instruction.
+ * @return A non-zero value if <code>ins</code> is an unconditional jump
+ * or a return.
+ */
+int
+disass_isterm(const INS *ins)
+{
+	if (ins->opcodes != 1 || ins->vexes != 0) {
+		return (0);
+	}
+	switch (ins->opcode[0]) {
+	case OPCODE_JMP32:
+	case OPCODE_JMP8:
+	case OPCODE_JMPFAR:
+	case OPCODE_RET:
+	case OPCODE_RETW:
+	case OPCODE_RETF:
+	case OPCODE_RETFW:
+	case OPCODE_IRET:
+		return (1);
+	case OPCODE_GROUP5:
+		/*
+		 * JMP Ev (reg 4) and JMP Mp (reg 5).
+		 */
+		return ((ins->modrm & 0x38) == 0x20 ||
+		    (ins->modrm & 0x38) == 0x28);
+	default:;
+	}
+	return (0);
+}
+
+
+/**
+ * Recode and write an x86 instruction that is executed at an address
+ * other than the one where it is written (for instance in another
+ * process).
  * @param dstaddr Destination address where the instruction should be written;
+ * @param at Address where the instruction is executed;
  * @param src Instruction to recode and write;
- * @param srcaddr Address from where the instruction was fetched.
+ * @param srcaddr Original address of the instruction that follows the
+ * one to recode;
+ * @param callee Copy of the first 4 bytes at the target of a
+ * <code>call</code> (needed to recognize the PIC thunks);
+ * <code>NULL</code> to read them at the target itself.
  * @return On success the length of the new written instruction;
  * <code>0</code> on error.
- * @see disass_fetch()
- * @see disass_put()
+ * @see disass_recode()
+ * @see disass_target()
  */
 int
-disass_recode(uint8_t *dstaddr, const INS *src, const uint8_t *srcaddr)
+disass_recode_at(uint8_t *dstaddr, const uint8_t *at, const INS *src,
+    const uint8_t *srcaddr, const uint8_t *callee)
 {
-	static uint8_t ncode[] = {
-		0x00,		0x02,
-		OPCODE_JMP8,	0x05,
-		OPCODE_JMP32,	0x00, 0x00, 0x00, 0x00
-	};
 	INS ni;
-	uint32_t reladdr, i;
+	const uint8_t *target;
+	uint8_t *dst;
+	uint32_t i;
+	int reg;
+
+	/*
+	 * The instruction has no relative values. Store it normally.
+	 */
+	if ((src->flags & OPMAP_REL) == 0) {
+		return (disass_put(dstaddr, src));
+	}
 
 	/*
 	 * An instruction with a relative value from srcaddr
-	 * must be recoded to make it relative from dstaddr.
+	 * must be recoded to make it relative from at.
 	 */
-	if (src->flags & _R) {
-		bzero(&ni, sizeof(ni));
+	target = disass_target(src, srcaddr);
 
+	if (src->opcodes == 1 && src->opcode[0] == OPCODE_CALL32) {
 		/*
-		 * Recode CALL32, CALL16, JMP32 and JMP16:
-		 * If it is a 16 bits instruction change it with its 32 bits
-		 * counterpart.
+		 * Recode PIC prologs:
+		 *	call __x86.get_pc_thunk.reg	-> mov  reg, srcaddr
+		 *	call $+5 (followed by pop reg)	-> push srcaddr
+		 * The address of the next instruction is loaded directly:
+		 * the PIC code computes its GOT address from the original
+		 * code and not from the hooking code.
 		 */
-		if (src->opcodes == 1 &&
-		    (src->opcode[0] == OPCODE_CALL32 ||
-		    src->opcode[0] == OPCODE_JMP32)) {
-			ni.opcodes = 1;
-			ni.flags = _R | _v;
-			ni.opcode[0] = src->opcode[0];
-			i = (uint32_t)((src->opsiz) ?
-			    src->immd.data.word : src->immd.data.dword);
-			reladdr = (uint32_t)
-			    INS_ABS2REL(dstaddr + SIZEOF_CALL32, srcaddr + i);
-			insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &reladdr);
-			ni.has_immd = 1;
-			ni.size = SIZEOF_CALL32;
-			return (disass_put(dstaddr, &ni));
+		bzero(&ni, sizeof(ni));
+		if (target == srcaddr) {
+			ni.opcode[0] = OPCODE_PUSH32;
+		} else if ((reg = _ispcthunk(callee != NULL ? callee :
+		    target)) >= 0) {
+			ni.opcode[0] = OPCODE_MOVEAX32 + reg;
 		}
-
-		/*
-		 * Recode JMP8: Change it with a JMP32.
-		 */
-		if (src->opcodes == 1 && src->opcode[0] == OPCODE_JMP8) {
+		if (ni.opcode[0] != 0) {
 			ni.opcodes = 1;
-			ni.flags = _R | _v;
-			ni.opcode[0] = OPCODE_JMP32;
-			reladdr = (uint32_t)
-			    INS_ABS2REL(dstaddr + SIZEOF_JMP32,
-			    srcaddr + src->immd.data.byte);
-			insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &reladdr);
+			i = (uint32_t)srcaddr;
+			insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &i);
 			ni.has_immd = 1;
-			ni.size = SIZEOF_JMP32;
+			ni.size = SIZEOF_MOVEAX32;
 			return (disass_put(dstaddr, &ni));
 		}
 
 		/*
-		 * Recode 8 bits conditions:
-		 * Change the condition with its 32 bits counterpart.
+		 * Recode CALL32 and CALL16 as CALL32.
 		 */
-		if (src->opcodes == 1 &&
-		    (src->opcode[0] >= 0x70 && src->opcode[0] < 0x7F)) {
-			ni.opcodes = 2;
-			ni.opcode[0] = OPCODE_ESCAPE;
-			ni.opcode[1] = src->opcode[0] + 0x10;
-			ni.flags = _R | _v;
-			reladdr = (uint32_t)
-			    INS_ABS2REL(dstaddr + SIZEOF_J32,
-			    srcaddr + src->immd.data.byte);
-			insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &reladdr);
-			ni.has_immd = 1;
-			ni.size = SIZEOF_J32;
-			return (disass_put(dstaddr, &ni));
-		}
+		return (_put_branch(dstaddr, at, OPCODE_CALL32, target));
+	}
 
-		/*
-		 * Recode 16/32 bits conditions:
-		 * Change the condition with its 32 bits counterpart.
-		 */
-		if (src->opcodes == 2 &&
-		    (src->opcode[0] == OPCODE_ESCAPE &&
-		    (src->opcode[1] >= 0x80 && src->opcode[1] <= 0x8F))) {
-			ni.opcodes = 2;
-			ni.opcode[0] = src->opcode[0];
-			ni.opcode[1] = src->opcode[1];
-			ni.flags = _R | _v;
-			i = (uint32_t)((src->opsiz) ?
-			    src->immd.data.word : src->immd.data.dword);
-			reladdr = (uint32_t)
-			    INS_ABS2REL(dstaddr + SIZEOF_J32, srcaddr + i);
-			insparam_set(&ni.immd, INS_PARAM_TYPE_DWORD, &reladdr);
-			ni.has_immd = 1;
-			ni.size = SIZEOF_J32;
-			return (disass_put(dstaddr, &ni));
-		}
+	/*
+	 * Recode JMP32, JMP16 and JMP8 as JMP8 or JMP32.
+	 */
+	if (src->opcodes == 1 &&
+	    (src->opcode[0] == OPCODE_JMP32 || src->opcode[0] == OPCODE_JMP8)) {
+		return (_put_branch(dstaddr, at, OPCODE_JMP8, target));
+	}
 
-		/*
-		 * Recode LOOPN, LOOPE, LOOP, and JCXZ:
-		 * Change the instruction:
-		 *	srcaddr:	loop/loopn/loope/jcxz caddr
-		 *
-		 * using the following sequence:
-		 *	dstaddr:	loop/loopn/loope/jcxz dstaddr+4
-		 *			jmp8  dstaddr+7
-		 *	dstaddr+4:	jmp32 caddr
-		 *	dstaddr+7:	...
-		 */
-		if (src->opcodes == 1 &&
-		    (src->opcode[0] >= 0xE0 && src->opcode[0] <= 0xE3)) {
-			memcpy(dstaddr, ncode, sizeof(ncode));
-			*dstaddr = src->opcode[0];
-			reladdr = (uint32_t)
-			    INS_ABS2REL(dstaddr + sizeof(ncode),
-			    srcaddr + src->immd.data.byte);
-			*(uint32_t *)(dstaddr + 5) = reladdr;
-			return (sizeof(ncode));
-		}
+	/*
+	 * Recode 8, 16 and 32 bits conditions as 8 or 32 bits conditions.
+	 */
+	if (src->opcodes == 1 &&
+	    (src->opcode[0] >= OPCODE_J8 && src->opcode[0] <= OPCODE_J8 + 0x0F)) {
+		return (_put_branch(dstaddr, at, src->opcode[0], target));
+	}
+	if (src->opcodes == 2 && src->opcode[0] == OPCODE_ESCAPE &&
+	    (src->opcode[1] >= OPCODE_J32 && src->opcode[1] <= OPCODE_J32 + 0x0F)) {
+		return (_put_branch(dstaddr, at,
+		    src->opcode[1] - OPCODE_J32 + OPCODE_J8, target));
+	}
 
-		/*
-		 * Relative instruction not recognized. Error.
-		 */
-		return (0);
+	/*
+	 * Recode LOOPN, LOOPE, LOOP, and JCXZ (they have no 32 bits
+	 * counterpart).
+	 * If the target is still reachable write the instruction as is
+	 * (prefixes included), otherwise change the instruction:
+	 *	srcaddr:	loop/loopn/loope/jcxz caddr
+	 *
+	 * using the following sequence:
+	 *	at:		loop/loopn/loope/jcxz at+4
+	 *			jmp8  at+9
+	 *	at+4:		jmp32 caddr
+	 *	at+9:		...
+	 */
+	if (src->opcodes == 1 &&
+	    (src->opcode[0] >= OPCODE_LOOPNZ && src->opcode[0] <= OPCODE_JCXZ)) {
+		dst = dstaddr;
+		for (i = 0; i < (uint32_t)src->prefixes; i++) {
+			*dst++ = src->prefix[i];
+		}
+		*dst = src->opcode[0];
+		at += dst - dstaddr;
+		if (INS_ISREL8(INS_ABS2REL(at + SIZEOF_J8, target))) {
+			dst[1] = (uint8_t)INS_ABS2REL(at + SIZEOF_J8, target);
+			return (dst + SIZEOF_J8 - dstaddr);
+		}
+		dst[1] = SIZEOF_JMP8;
+		dst[2] = OPCODE_JMP8;
+		dst[3] = SIZEOF_JMP32;
+		dst[4] = OPCODE_JMP32;
+		dst += SIZEOF_J8 + SIZEOF_JMP8 + SIZEOF_JMP32;
+		at += SIZEOF_J8 + SIZEOF_JMP8 + SIZEOF_JMP32;
+		*(uint32_t *)(dst - 4) = (uint32_t)INS_ABS2REL(at, target);
+		return (dst - dstaddr);
 	}
 
 	/*
-	 * The instruction has no relative values. Store it normally.
+	 * Relative instruction not recognized. Error.
 	 */
-	return (disass_put(dstaddr, src));
+	return (0);
 }
 
+
+/**
+ * Recode and write an x86 instruction.
+ * Recode an instruction in order to make it valid in the new destination
+ * address. Relative branches are written with their shortest encoding
+ * given the destination address.
+ * @param dstaddr Destination address where the instruction should be written;
+ * @param src Instruction to recode and write;
+ * @param srcaddr Address of the instruction that follows the one
+ * to recode (as updated by <code>disass_fetch()</code>).
+ * @return On success the length of the new written instruction;
+ * <code>0</code> on error.
+ * @see disass_fetch()
+ * @see disass_put()
+ * @see disass_recode_at()
+ */
+int
+disass_recode(uint8_t *dstaddr, const INS *src, const uint8_t *srcaddr)
+{
+
+	return (disass_recode_at(dstaddr, dstaddr, src, srcaddr, NULL));
+}
@@ -29,8 +29,8 @@
 
 
 #define PREFIX1_LOCK	0xF0	/**< Prefix LOCK			*/
-#define PREFIX1_REPNZ	0xF1	/**< Prefix REPNE/REPNZ			*/
-#define PREFIX1_REPZ	0xF2	/**< Prefix REP/REPE/REPZ		*/
+#define PREFIX1_REPNZ	0xF2	/**< Prefix REPNE/REPNZ			*/
+#define PREFIX1_REPZ	0xF3	/**< Prefix REP/REPE/REPZ		*/
 #define PREFIX2_CSSEG	0x2E	/**< Prefix CS Override			*/
 #define PREFIX2_SSSEG	0x36	/**< Prefix SS Override			*/
 #define PREFIX2_DSSEG	0x3E	/**< Prefix DS Override			*/
@@ -41,7 +41,10 @@
 #define PREFIX3_ADSIZ	0x67	/**< Prefix Address Size Override	*/
 
 #define PREFIX_MAX	4	/**< Max number of prefixes		*/
-#define OPCODE_MAX	2	/**< Max number of opcodes		*/
+#define OPCODE_MAX	3	/**< Max number of opcodes		*/
+#define VEX_MAX		4	/**< Max number of VEX/EVEX bytes	*/
+#define FETCH_MAX	23	/**< Max number of bytes read by a fetch */
+#define INS_MAX		15	/**< Max length of an instruction	*/
 
 #define OPCODE_CALL32	0xE8	/**< CALL rel32 opcode			*/
 #define OPCODE_JMP32	0xE9	/**< JMP rel32 opcode			*/
@@ -49,19 +52,141 @@
 #define OPCODE_NOP	0x90	/**< NOP opcode				*/
 #define OPCODE_PUSH32	0x68	/**< PUSH data32 opcode			*/
 #define OPCODE_ESCAPE	0x0F	/**< Escape to 2 bytes opcode		*/
+#define OPCODE_COPRO	0xD8	/**< First coprocessor escape opcode	*/
+#define OPCODE_ESC38	0x38	/**< Escape to 0F 38 3 bytes opcode	*/
+#define OPCODE_ESC3A	0x3A	/**< Escape to 0F 3A 3 bytes opcode	*/
+#define OPCODE_VEX2	0xC5	/**< 2 bytes VEX prefix			*/
+#define OPCODE_VEX3	0xC4	/**< 3 bytes VEX prefix			*/
+#define OPCODE_EVEX	0x62	/**< 4 bytes EVEX prefix		*/
 #define OPCODE_PUSHEAX	0x50	/**< PUSH EAX opcode			*/
 #define OPCODE_POPEAX	0x58	/**< POP EAX opcode			*/
 #define OPCODE_ADDEAX32	0x05	/**< ADD EAX, data32 opcode		*/
+#define OPCODE_MOVEAX32	0xB8	/**< MOV EAX, data32 opcode		*/
+#define OPCODE_MOVRM	0x8B	/**< MOV Gv, Ev opcode			*/
+#define OPCODE_RET	0xC3	/**< RET near opcode			*/
+#define OPCODE_RETW	0xC2	/**< RET near data16 opcode		*/
+#define OPCODE_RETF	0xCB	/**< RET far opcode			*/
+#define OPCODE_RETFW	0xCA	/**< RET far data16 opcode		*/
+#define OPCODE_IRET	0xCF	/**< IRET opcode			*/
+#define OPCODE_JMPFAR	0xEA	/**< JMP ptr16:32 opcode		*/
+#define OPCODE_GROUP5	0xFF	/**< INC/DEC/CALL/JMP/PUSH Ev opcode	*/
+#define OPCODE_PUSH8	0x6A	/**< PUSH data8 opcode			*/
+#define OPCODE_J8	0x70	/**< First Jxx rel8 opcode		*/
+#define OPCODE_J32	0x80	/**< First Jxx rel32 opcode (escaped)	*/
+#define OPCODE_LOOPNZ	0xE0	/**< LOOPNZ rel8 opcode			*/
+#define OPCODE_JCXZ	0xE3	/**< JCXZ/JECXZ rel8 opcode		*/
+#define OPCODE_CMPEAX32	0x3D	/**< CMP EAX, data32 opcode		*/
+#define OPCODE_GROUP1I8	0x83	/**< ADD/../CMP Ev, data8 opcode	*/
+#define OPCODE_TESTAL8	0xA8	/**< TEST AL, data8 opcode		*/
+#define OPCODE_TESTEAX32 0xA9	/**< TEST EAX, data32 opcode		*/
+#define OPCODE_MOVRMR	0x89	/**< MOV Ev, Gv opcode			*/
+#define OPCODE_GROUP2I8	0xC1	/**< ROL/../SAR Ev, data8 opcode	*/
+#define OPCODE_ANDEAX32	0x25	/**< AND EAX, data32 opcode		*/
+#define OPCODE_PUSHFD	0x9C	/**< PUSHFD opcode			*/
+#define OPCODE_POPFD	0x9D	/**< POPFD opcode			*/
+#define OPCODE_PUSHAD	0x60	/**< PUSHAD opcode			*/
+#define OPCODE_POPAD	0x61	/**< POPAD opcode			*/
+#define OPCODE_PUSHEBX	0x53	/**< PUSH EBX opcode			*/
+#define OPCODE_CLD	0xFC	/**< CLD opcode				*/
+#define OPCODE_PUSHECX	0x51	/**< PUSH ECX opcode			*/
+#define OPCODE_POPEDX	0x5A	/**< POP EDX opcode			*/
+#define OPCODE_TESTRMR	0x85	/**< TEST Ev, Gv opcode			*/
 
 #define SIZEOF_CALL32	5	/**< Length of CALL rel32		*/
 #define SIZEOF_JMP32	5	/**< Length of JMP rel32		*/
+#define SIZEOF_JMP8	2	/**< Length of JMP rel8			*/
 
-#define SIZEOF_J32	5	/**< Length of Jxx rel32		*/
+#define SIZEOF_J32	6	/**< Length of Jxx rel32		*/
+#define SIZEOF_J8	2	/**< Length of Jxx rel8			*/
 
 #define SIZEOF_PUSH32	5	/**< Length of PUSH data32		*/
+#define SIZEOF_PUSH8	2	/**< Length of PUSH data8		*/
 #define SIZEOF_PUSHEAX	1	/**< Length of PUSH EAX			*/
 #define SIZEOF_POPEAX	1	/**< Length of POP EAX			*/
 #define SIZEOF_ADDEAX32	5	/**< Length of ADD EAX, data32		*/
+#define SIZEOF_MOVEAX32	5	/**< Length of MOV EAX, data32		*/
+#define SIZEOF_CMPEAX32	5	/**< Length of CMP EAX, data32		*/
+#define SIZEOF_CMPEAX8	3	/**< Length of CMP EAX, data8		*/
+#define SIZEOF_TESTAL8	2	/**< Length of TEST AL, data8		*/
+#define SIZEOF_TESTEAX32 5	/**< Length of TEST EAX, data32		*/
+#define SIZEOF_MOVRMR	2	/**< Length of MOV Ev, Gv (registers)	*/
+#define SIZEOF_SHREAX8	3	/**< Length of SHR EAX, data8		*/
+#define SIZEOF_ANDEAX32	5	/**< Length of AND EAX, data32		*/
+#define SIZEOF_LOCKADD8	8	/**< Length of LOCK ADD [EAX+disp32], data8 */
+#define SIZEOF_ADDESP8	5	/**< Length of ADD [ESP + disp8], data8	*/
+#define SIZEOF_PUSHFD	1	/**< Length of PUSHFD			*/
+#define SIZEOF_POPFD	1	/**< Length of POPFD			*/
+#define SIZEOF_PUSHAD	1	/**< Length of PUSHAD			*/
+#define SIZEOF_POPAD	1	/**< Length of POPAD			*/
+#define SIZEOF_PUSHEBX	1	/**< Length of PUSH EBX			*/
+#define SIZEOF_CLD	1	/**< Length of CLD			*/
+#define SIZEOF_ALUR8	3	/**< Length of ADD/../CMP reg, data8	*/
+#define SIZEOF_PUSHECX	1	/**< Length of PUSH ECX			*/
+#define SIZEOF_POPEDX	1	/**< Length of POP EDX			*/
+#define SIZEOF_TESTRMR	2	/**< Length of TEST Ev, Gv (registers)	*/
+#define SIZEOF_RET	1	/**< Length of RET			*/
+
+#define MODRM_EAXSIB8	0x44	/**< MODRM for EAX, [SIB + disp8]	*/
+#define MODRM_EAXSIB32	0x84	/**< MODRM for EAX, [SIB + disp32]	*/
+#define MODRM_CMPEAX	0xF8	/**< MODRM for CMP EAX (group 1 /7)	*/
+#define MODRM_ESPEAX	0xE0	/**< MODRM for EAX, ESP (MOV Ev, Gv)	*/
+#define MODRM_SHREAX	0xE8	/**< MODRM for SHR EAX (group 2 /5)	*/
+#define MODRM_ADDEAX32	0x80	/**< MODRM for ADD [EAX + disp32] (/0)	*/
+#define MODRM_ADCEAX32	0x90	/**< MODRM for ADC [EAX + disp32] (/2)	*/
+#define MODRM_ADDSIB8	0x44	/**< MODRM for ADD [SIB + disp8] (/0)	*/
+#define MODRM_ESPEBX	0xE3	/**< MODRM for EBX, ESP (MOV Ev, Gv)	*/
+#define MODRM_EBXESP	0xDC	/**< MODRM for ESP, EBX (MOV Ev, Gv)	*/
+#define MODRM_ANDESP	0xE4	/**< MODRM for AND ESP (group 1 /4)	*/
+#define MODRM_SUBESP	0xEC	/**< MODRM for SUB ESP (group 1 /5)	*/
+#define MODRM_ADDESP	0xC4	/**< MODRM for ADD ESP (group 1 /0)	*/
+#define MODRM_ESPECX	0xE1	/**< MODRM for ECX, ESP (MOV Ev, Gv)	*/
+#define MODRM_EAXEAX	0xC0	/**< MODRM for EAX, EAX (registers)	*/
+#define SIB_ESP		0x24	/**< SIB for [ESP]			*/
+
+#define CC_B		0x2	/**< Jxx condition: below		*/
+#define CC_AE		0x3	/**< Jxx condition: above or equal	*/
+#define CC_E		0x4	/**< Jxx condition: equal		*/
+#define CC_NE		0x5	/**< Jxx condition: not equal		*/
+#define CC_BE		0x6	/**< Jxx condition: below or equal	*/
+#define CC_A		0x7	/**< Jxx condition: above		*/
+#define CC_L		0xC	/**< Jxx condition: less		*/
+#define CC_GE		0xD	/**< Jxx condition: greater or equal	*/
+#define CC_LE		0xE	/**< Jxx condition: less or equal	*/
+#define CC_G		0xF	/**< Jxx condition: greater		*/
+#define CC_NOT(cc)	((cc) ^ 1)	/**< Negated condition		*/
+
+
+/*
+ * Packed opcode map entries (generated by mktables from opcodes.h).
+ * Each entry holds the whole length recipe of an opcode:
+ * <pre>
+ *  15       12 11        8  7   6   5   4   2   1   0
+ *  +----------+-----------+---+---+---+-------+---+---+
+ *  | immd ovr | immd size | - | A | G | kind  | R | M |
+ *  +----------+-----------+---+---+---+-------+---+---+
+ * </pre>
+ * immd size is the length of the immediate data, immd ovr is its length
+ * when the operand size (or the address size if A is set) is overridden.
+ */
+#define OPMAP_MODRM		0x0001	/**< Instruction with MODRM	*/
+#define OPMAP_REL		0x0002	/**< Relative immediate data	*/
+#define OPMAP_KIND(e)		(((e) >> 2) & 0x07)
+#define OPMAP_KIND_INS		0	/**< Instruction		*/
+#define OPMAP_KIND_PREFIX	1	/**< Instruction prefix		*/
+#define OPMAP_KIND_ESCAPE	2	/**< Escape to the next map	*/
+#define OPMAP_KIND_COPRO	3	/**< Coprocessor escape		*/
+#define OPMAP_KIND_VEX		4	/**< VEX/EVEX escape		*/
+#define OPMAP_KIND_UNDEF	7	/**< Undefined opcode		*/
+#define OPMAP_IMMGROUP		0x0020	/**< Immd only if MODRM reg < 2	*/
+#define OPMAP_IMMADDR		0x0040	/**< Immd size by address size	*/
+#define OPMAP_IMM(e, ovr)	(((e) >> ((ovr) ? 12 : 8)) & 0x0F)
+
+/*
+ * Packed MODRM map entries (generated by mktables).
+ */
+#define MODRM_DISP(e)		((e) & 0x07)	/**< Displacement size	*/
+#define MODRM_SIB		0x08	/**< SIB follows the MODRM	*/
+#define MODRM_SIBDISP		0x10	/**< disp32 if SIB base is 101	*/
 
 
 /**
@@ -116,17 +241,20 @@ typedef struct _ins_param {
  * Contains detailed information about an x86 instruction.
  * An instruction is coded as follows:
  * <pre>
- *  +--------+--------+-------+-----+--------------------+-----------------+
- *  | prefix | opcode | modrm | sib | addr. displacement | immediate const |
- *  +--------+--------+-------+-----+--------------------+-----------------+
+ *  +--------+-----+--------+-------+-----+--------------+-----------------+
+ *  | prefix | vex | opcode | modrm | sib | displacement | immediate const |
+ *  +--------+-----+--------+-------+-----+--------------+-----------------+
  * </pre>
  * The length of an isntruction is variable from 1 byte to 16 bytes.
+ * When a VEX/EVEX prefix is present the opcode is a single byte taken
+ * from the opcode map selected by the prefix.
  * @see INS_PARAM
  */
 struct _ins {
 	int	 size;			/**< Instruction length		*/
-	uint32_t flags;			/**< Flags			*/
+	uint32_t flags;			/**< Packed opcode map entry	*/
 	int	 prefixes;		/**< No. of prefixes		*/
+	int	 vexes;			/**< No. of VEX/EVEX bytes	*/
 	int	 opcodes;		/**< No. of opcodes		*/
 	int	 has_sib;		/**< Have SIB			*/
 	int	 has_disp;		/**< Have displacement		*/
@@ -135,6 +263,7 @@ struct _ins {
 	int	 adsiz;			/**< Prefix address size	*/
 	int	 rel;			/**< Have relative value	*/
 	uint8_t	 prefix[PREFIX_MAX];	/**< Prefixes			*/
+	uint8_t	 vex[VEX_MAX];		/**< VEX/EVEX prefix		*/
 	uint8_t	 opcode[OPCODE_MAX];	/**< Opcodes			*/
 	uint8_t	 modrm;			/**< MODRM			*/
 	uint8_t	 sib;			/**< SIB			*/
@@ -151,6 +280,13 @@ struct _ins {
  */
 #define INS_ABS2REL(base, abs)	((uint8_t *)(abs) - (uint8_t *)(base))
 
+/**
+ * @def INS_ISREL8(rel)
+ * Detect whether a relative address fits in a signed byte.
+ * @param rel Relative address.
+ */
+#define INS_ISREL8(rel)		((rel) >= -128 && (rel) <= 127)
+
 int	insparam_set(INS_PARAM *, int, void *);
 int	insparam_copy(uint8_t *, const INS_PARAM *);
 
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "disass.h"
+#include "khook.h"
+#include "emit.h"
+
+
+/**
+ * Max. size of a re-encoded instruction.
+ */
+#define EMIT_SIZEOF_MAXINS	16
+
+
+/**
+ * Reserve space in the buffer.
+ * @param e Code buffer;
+ * @param n Number of bytes.
+ * @return The address of the reserved space; <code>NULL</code> if the
+ * buffer is exhausted (the error is recorded in <code>e</code>).
+ */
+static uint8_t *
+_reserve(EMIT *e, size_t n)
+{
+	uint8_t *p;
+
+	if (e->error || e->len + n > e->size) {
+		e->error = 1;
+		return (NULL);
+	}
+	p = e->buf + e->len;
+	e->len += n;
+	return (p);
+}
+
+
+/**
+ * Compute the address targeted by a relative value.
+ * @param e Code buffer;
+ * @param r Relative value.
+ * @return The execution address of the target; <code>NULL</code> if
+ * the target label is not bound yet.
+ */
+static const uint8_t *
+_target(const EMIT *e, const EMIT_RELOC *r)
+{
+
+	if (r->label < 0) {
+		return (r->target);
+	}
+	if (e->label[r->label] < 0) {
+		return (NULL);
+	}
+	return (e->at + e->label[r->label]);
+}
+
+
+/**
+ * Turn a short branch into its 32 bits form.
+ * The code that follows the branch is moved, the labels and the
+ * relative values beyond it are updated.
+ * @param e Code buffer;
+ * @param r Branch (<code>jmp rel8</code> or <code>jxx rel8</code>).
+ * @return <code>0</code> on success; <code>-1</code> if the code can't
+ * be moved.
+ */
+static int
+_grow(EMIT *e, EMIT_RELOC *r)
+{
+	uint8_t *p, op;
+	size_t size, extra, tail;
+	int i;
+
+	p = e->buf + r->pos;
+	op = *p;
+	size = (op == OPCODE_JMP8) ? SIZEOF_JMP32 : SIZEOF_J32;
+	extra = size - r->size;
+	tail = r->pos + r->size;
+	if (e->pinned > tail || e->len + extra > e->size) {
+		return (-1);
+	}
+	memmove(p + size, p + r->size, e->len - tail);
+	e->len += extra;
+	if (op == OPCODE_JMP8) {
+		*p = OPCODE_JMP32;
+	} else {
+		*p = OPCODE_ESCAPE;
+		*(p + 1) = op - OPCODE_J8 + OPCODE_J32;
+	}
+
+	for (i = 0; i < e->nlabels; i++) {
+		if (e->label[i] >= (int)tail) {
+			e->label[i] += extra;
+		}
+	}
+	for (i = 0; i < e->nrelocs; i++) {
+		if (e->reloc[i].pos >= tail) {
+			e->reloc[i].pos += extra;
+		}
+	}
+	r->size = size;
+	r->rel = 4;
+	return (0);
+}
+
+
+/**
+ * Grow the short branches whose target is out of reach.
+ * Growing a branch moves the code that follows it, so the branches are
+ * checked again until none of them changes.
+ * @param e Code buffer.
+ */
+static void
+_relax(EMIT *e)
+{
+	const uint8_t *target;
+	EMIT_RELOC *r;
+	int i, changed;
+
+	do {
+		changed = 0;
+		for (i = 0; i < e->nrelocs && !e->error; i++) {
+			r = &e->reloc[i];
+			if (r->rel != 1 || (target = _target(e, r)) == NULL ||
+			    INS_ISREL8(INS_ABS2REL(e->at + r->pos + r->size,
+			    target))) {
+				continue;
+			}
+			if (_grow(e, r) < 0) {
+				e->error = 1;
+			}
+			changed = 1;
+		}
+	} while (changed && !e->error);
+}
+
+
+/**
+ * Add a branch.
+ * @param e Code buffer;
+ * @param op Opcode: <code>OPCODE_CALL32</code>,
+ * <code>OPCODE_JMP8</code> or a <code>jxx rel8</code> opcode (the short
+ * forms are turned into the 32 bits forms if needed);
+ * @param label Target label (<code>-1</code> for <code>target</code>);
+ * @param target Absolute target.
+ */
+static void
+_branch(EMIT *e, uint8_t op, int label, const void *target)
+{
+	EMIT_RELOC *r;
+	uint8_t *p;
+	size_t size;
+
+	size = (op == OPCODE_CALL32) ? SIZEOF_CALL32 : SIZEOF_J8;
+	if (e->nrelocs == EMIT_MAXRELOCS ||
+	    (p = _reserve(e, size)) == NULL) {
+		e->error = 1;
+		return;
+	}
+	*p = op;
+	r = &e->reloc[e->nrelocs++];
+	r->pos = p - e->buf;
+	r->size = size;
+	r->rel = size - 1;
+	r->label = label;
+	r->target = target;
+	_relax(e);
+}
+
+
+/**
+ * Initialize a code buffer.
+ * @param e Code buffer;
+ * @param buf Local buffer;
+ * @param size Size of <code>buf</code>;
+ * @param at Address where <code>buf</code> is executed (usually
+ * <code>buf</code> itself).
+ */
+void
+emit_init(EMIT *e, uint8_t *buf, size_t size, uint8_t *at)
+{
+
+	bzero(e, sizeof(*e));
+	e->buf = buf;
+	e->at = at;
+	e->size = size;
+}
+
+
+/**
+ * Emit a byte.
+ * @param e Code buffer;
+ * @param v Value.
+ */
+void
+emit_u8(EMIT *e, uint8_t v)
+{
+	uint8_t *p;
+
+	if ((p = _reserve(e, 1)) != NULL) {
+		*p = v;
+	}
+}
+
+
+/**
+ * Emit a double word.
+ * @param e Code buffer;
+ * @param v Value.
+ */
+void
+emit_u32(EMIT *e, uint32_t v)
+{
+	uint8_t *p;
+
+	if ((p = _reserve(e, 4)) != NULL) {
+		*(uint32_t *)p = v;
+	}
+}
+
+
+/**
+ * Emit <code>push v</code> in its shortest form.
+ * @param e Code buffer;
+ * @param v Value.
+ */
+void
+emit_push(EMIT *e, long v)
+{
+
+	if (INS_ISREL8(v)) {
+		emit_u8(e, OPCODE_PUSH8);
+		emit_u8(e, (uint8_t)v);
+	} else {
+		emit_u8(e, OPCODE_PUSH32);
+		emit_u32(e, (uint32_t)v);
+	}
+}
+
+
+/**
+ * Emit an instruction without relative values.
+ * @param e Code buffer;
+ * @param ins Instruction.
+ * @see disass_put()
+ */
+void
+emit_ins(EMIT *e, const INS *ins)
+{
+	uint8_t *p;
+
+	if ((p = _reserve(e, ins->size)) != NULL) {
+		disass_put(p, ins);
+	}
+}
+
+
+/**
+ * Emit an instruction fetched from another address.
+ * The re-encoded instruction depends on its address: the code emitted
+ * so far can't be moved anymore (short branches already emitted can't
+ * grow).
+ * @param e Code buffer;
+ * @param ins Instruction;
+ * @param addr Address that follows the instruction in the original code;
+ * @param callee Copy of the first bytes at the target of a call
+ * (<code>NULL</code> to read them from the target).
+ * @return The number of bytes emitted; <code>0</code> if the
+ * instruction can't be re-encoded.
+ * @see disass_recode_at()
+ */
+int
+emit_recode(EMIT *e, const INS *ins, const uint8_t *addr,
+    const uint8_t *callee)
+{
+	int n;
+
+	if (e->error || e->len + EMIT_SIZEOF_MAXINS > e->size) {
+		e->error = 1;
+		return (0);
+	}
+	n = disass_recode_at(e->buf + e->len, e->at + e->len, ins, addr,
+	    callee);
+	e->len += n;
+	e->pinned = e->len;
+	return (n);
+}
+
+
+/**
+ * Create a label.
+ * @param e Code buffer.
+ * @return The label (to be bound by <code>emit_bind()</code>).
+ */
+int
+emit_label(EMIT *e)
+{
+
+	if (e->nlabels == EMIT_MAXLABELS) {
+		e->error = 1;
+		return (0);
+	}
+	e->label[e->nlabels] = -1;
+	return (e->nlabels++);
+}
+
+
+/**
+ * Bind a label to the current address.
+ * The short branches to the label that can't reach it are turned into
+ * their 32 bits forms.
+ * @param e Code buffer;
+ * @param label Label.
+ */
+void
+emit_bind(EMIT *e, int label)
+{
+
+	e->label[label] = e->len;
+	_relax(e);
+}
+
+
+/**
+ * Emit a branch to a label.
+ * @param e Code buffer;
+ * @param op Opcode (<code>OPCODE_CALL32</code>, <code>OPCODE_JMP8</code>
+ * or <code>jxx rel8</code>);
+ * @param label Label (bound or not).
+ */
+void
+emit_branch(EMIT *e, uint8_t op, int label)
+{
+
+	_branch(e, op, label, NULL);
+}
+
+
+/**
+ * Emit a branch to an absolute address.
+ * @param e Code buffer;
+ * @param op Opcode (<code>OPCODE_CALL32</code>, <code>OPCODE_JMP8</code>
+ * or <code>jxx rel8</code>);
+ * @param target Target address.
+ */
+void
+emit_branch_to(EMIT *e, uint8_t op, const void *target)
+{
+
+	_branch(e, op, -1, target);
+}
+
+
+/**
+ * Resolve the relative values.
+ * @param e Code buffer.
+ * @return The size of the generated code; <code>0</code> if the buffer
+ * is exhausted or a label is not bound.
+ */
+size_t
+emit_end(EMIT *e)
+{
+	const uint8_t *target;
+	EMIT_RELOC *r;
+	uint8_t *p;
+	int i;
+
+	for (i = 0; i < e->nrelocs && !e->error; i++) {
+		r = &e->reloc[i];
+		if ((target = _target(e, r)) == NULL) {
+			e->error = 1;
+			break;
+		}
+		p = e->buf + r->pos + r->size;
+		if (r->rel == 1) {
+			*(p - 1) = (uint8_t)INS_ABS2REL(e->at + r->pos +
+			    r->size, target);
+		} else {
+			*(uint32_t *)(p - 4) = (uint32_t)INS_ABS2REL(e->at +
+			    r->pos + r->size, target);
+		}
+	}
+	return (e->error ? 0 : e->len);
+}
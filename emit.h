@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef EMIT_H
+#define EMIT_H
+
+
+/**
+ * Max. number of labels of a code buffer.
+ */
+#define EMIT_MAXLABELS		8
+
+/**
+ * Max. number of relative values of a code buffer.
+ */
+#define EMIT_MAXRELOCS		16
+
+
+/**
+ * Relative value resolved by <code>emit_end()</code>.
+ */
+typedef struct _emit_reloc {
+	uint16_t	 pos;		/**< Offset of the instruction	*/
+	uint8_t		 size;		/**< Size of the instruction	*/
+	uint8_t		 rel;		/**< Size of the value (1 or 4)	*/
+	int		 label;		/**< Target label (-1: target)	*/
+	const uint8_t	*target;	/**< Absolute target		*/
+} EMIT_RELOC;
+
+/**
+ * Code buffer.
+ */
+typedef struct _emit {
+	uint8_t		*buf;		/**< Local buffer		*/
+	uint8_t		*at;		/**< Execution address of buf	*/
+	size_t		 size;		/**< Size of buf		*/
+	size_t		 len;		/**< Bytes emitted		*/
+	size_t		 pinned;	/**< End of the code not movable */
+	int		 error;		/**< Buffer or tables exhausted	*/
+	int		 nlabels;	/**< Labels			*/
+	int		 nrelocs;	/**< Relative values		*/
+	int		 label[EMIT_MAXLABELS];	/**< Offsets (-1: unbound) */
+	EMIT_RELOC	 reloc[EMIT_MAXRELOCS];	/**< Relative values	*/
+} EMIT;
+
+
+/*
+ * Prototypes.
+ */
+void	emit_init(EMIT *, uint8_t *, size_t, uint8_t *);
+void	emit_u8(EMIT *, uint8_t);
+void	emit_u32(EMIT *, uint32_t);
+void	emit_push(EMIT *, long);
+void	emit_ins(EMIT *, const INS *);
+int	emit_recode(EMIT *, const INS *, const uint8_t *, const uint8_t *);
+int	emit_label(EMIT *);
+void	emit_bind(EMIT *, int);
+void	emit_branch(EMIT *, uint8_t, int);
+void	emit_branch_to(EMIT *, uint8_t, const void *);
+size_t	emit_end(EMIT *);
+
+
+#endif	/* EMIT_H */
@@ -69,6 +69,26 @@ my_printf(long id, long ra, const char *fmt, ...)
 }
 
 
+#ifdef USE_WX
+static void
+hook_printf()
+{
+	KHOOK_ARENA arena;
+
+	/*
+	 * W^X: the hooking code is never writable and executable and
+	 * printf is patched without changing the protection of its page.
+	 */
+	if (khook_arena_init_wx(&arena, HCODE_MAXSIZ) < 0) {
+		err(-1, "Can't create the arena");
+	}
+	hcode = arena.hcode;
+
+	if (khook(printf, hcode, &arena.hsize, 0, (void *)my_printf) == 0) {
+		errx(-1, "Can't hook printf");
+	}
+}
+#else
 static void
 hook_printf()
 {
@@ -103,6 +123,7 @@ hook_printf()
 		err(-1, "Can't make pages unwritable");
 	}
 }
+#endif
 
 
 static void
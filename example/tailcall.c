@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of his contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Tail calls between hooked functions: tail_entry() jumps to
+ * tail_leaf(), which then runs with the return of tail_entry()
+ * already intercepted; tail_self() jumps to itself.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#ifdef USE_SYSCALL
+#include <sys/syscall.h>
+#endif
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <khook.h>
+
+
+#define HCODE_MAXSIZ	0x1000
+
+
+int	tail_leaf(int);
+int	tail_entry(int);
+int	tail_self(int);
+void	tail_end(void);
+
+/*
+ *    tail_leaf:   mov  eax, [esp + 4]     ;Return x + 1
+ *                 add  eax, 1
+ *                 ret
+ *    tail_entry:  mov  eax, [esp + 4]
+ *                 mov  [esp + 4], eax
+ *                 jmp  tail_leaf
+ *    tail_self:   mov  eax, [esp + 4]     ;Return 0 after x tail calls
+ *                 test eax, eax
+ *                 jz   1f
+ *                 dec  eax
+ *                 mov  [esp + 4], eax
+ *                 jmp  tail_self
+ *    1:           ret
+ */
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"tail_leaf:\n"
+	"	movl	4(%esp), %eax\n"
+	"	addl	$1, %eax\n"
+	"	ret\n"
+	"	.p2align 4\n"
+	"tail_entry:\n"
+	"	movl	4(%esp), %eax\n"
+	"	movl	%eax, 4(%esp)\n"
+	"	jmp	tail_leaf\n"
+	"	.p2align 4\n"
+	"tail_self:\n"
+	"	movl	4(%esp), %eax\n"
+	"	testl	%eax, %eax\n"
+	"	jz	1f\n"
+	"	decl	%eax\n"
+	"	movl	%eax, 4(%esp)\n"
+	"	jmp	tail_self\n"
+	"1:	ret\n"
+	"	.p2align 4\n"
+	"tail_end:\n"
+);
+
+
+static KHOOK_CALLERS leaf_callers, entry_callers, self_callers;
+
+
+#ifdef USE_WX
+static void *
+hcode_alloc(size_t *hsize)
+{
+	static KHOOK_ARENA arena;
+
+	if (khook_arena_init_wx(&arena, HCODE_MAXSIZ) < 0) {
+		err(-1, "Can't create the arena");
+	}
+	*hsize = arena.hsize;
+	return (arena.hcode);
+}
+
+
+static void
+text_protect(int prot)
+{
+}
+#else
+static void *
+hcode_alloc(size_t *hsize)
+{
+	void *hcode;
+
+#ifndef USE_SYSCALL
+	hcode = mmap(NULL, HCODE_MAXSIZ, PROT_READ | PROT_WRITE | PROT_EXEC,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+#else
+	hcode = (void *)syscall(SYS_mmap, NULL, HCODE_MAXSIZ,
+	    PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+#endif
+
+	if (hcode == MAP_FAILED) {
+		err(-1, "Can't mmap");
+	}
+	*hsize = HCODE_MAXSIZ;
+	return (hcode);
+}
+
+
+static void
+text_protect(int prot)
+{
+	unsigned long start;
+
+	start = ((unsigned long)tail_leaf) & 0xfffff000;
+	if (mprotect((void *)start, (unsigned long)tail_end - start,
+	    prot) < 0) {
+		err(-1, "Can't change the protection of the text");
+	}
+}
+#endif
+
+
+/**
+ * Get the calls counted in a caller table.
+ * @param callers Caller table;
+ * @param ra Receives the call site;
+ * @param cycles Receives the cycles.
+ * @return The number of calls (<code>-1</code> if there is not a
+ * single call site).
+ */
+static long
+calls(const KHOOK_CALLERS *callers, const void **ra, uint64_t *cycles)
+{
+	KHOOK_CALLER site;
+
+	if (khook_callers_snapshot(callers, &site, 1) != 1) {
+		return (-1);
+	}
+	*ra = site.ra;
+	*cycles = site.cycles;
+	return ((long)site.calls);
+}
+
+
+static void
+hook()
+{
+	size_t hsize, n;
+	uint8_t *hcode;
+
+	hcode = hcode_alloc(&hsize);
+	text_protect(PROT_READ | PROT_WRITE | PROT_EXEC);
+	if ((n = khook_callers(tail_leaf, hcode, &hsize,
+	    &leaf_callers)) == 0) {
+		errx(-1, "Can't hook tail_leaf");
+	}
+	hcode += n;
+	if ((n = khook_callers(tail_entry, hcode, &hsize,
+	    &entry_callers)) == 0) {
+		errx(-1, "Can't hook tail_entry");
+	}
+	hcode += n;
+	if (khook_callers(tail_self, hcode, &hsize, &self_callers) == 0) {
+		errx(-1, "Can't hook tail_self");
+	}
+	text_protect(PROT_READ | PROT_EXEC);
+}
+
+
+static void
+run()
+{
+	const void *entry_ra, *leaf_ra, *ra;
+	uint64_t entry_cycles, leaf_cycles, cycles;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		if (tail_entry(i) != i + 1) {
+			errx(-1, "tail_entry(%d) returned a wrong value", i);
+		}
+		if (tail_self(3) != 0) {
+			errx(-1, "tail_self(3) returned a wrong value");
+		}
+	}
+
+	/*
+	 * tail_leaf() is counted from the caller of tail_entry(), the
+	 * time is accounted to tail_entry() only.
+	 */
+	if (calls(&entry_callers, &entry_ra, &entry_cycles) != 100 ||
+	    calls(&leaf_callers, &leaf_ra, &leaf_cycles) != 100 ||
+	    leaf_ra != entry_ra || leaf_cycles != 0) {
+		errx(-1, "Wrong tail_entry/tail_leaf calls");
+	}
+	if (calls(&self_callers, &ra, &cycles) != 400) {
+		errx(-1, "Wrong tail_self calls");
+	}
+	printf("tail_entry: 100 calls from %p, %llu cycles\n", entry_ra,
+	    (unsigned long long)entry_cycles);
+	printf("tail_leaf:  100 calls from %p (tail called)\n", leaf_ra);
+	printf("tail_self:  400 calls from %p\n", ra);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	hook();
+	run();
+	return 0;
+}
@@ -0,0 +1,627 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "khook.h"
+
+
+/**
+ * Max. length of a symbol name.
+ */
+#define EXPORT_MAXNAME		256
+
+/**
+ * Max. size of an encoded pprof message (without its strings).
+ */
+#define EXPORT_MAXMSG		64
+
+
+/*
+ * pprof (profile.proto) field numbers.
+ */
+#define PB_PROFILE_SAMPLE_TYPE	1
+#define PB_PROFILE_SAMPLE	2
+#define PB_PROFILE_LOCATION	4
+#define PB_PROFILE_FUNCTION	5
+#define PB_PROFILE_STRING	6
+#define PB_VALUETYPE_TYPE	1
+#define PB_VALUETYPE_UNIT	2
+#define PB_SAMPLE_LOCATION	1
+#define PB_SAMPLE_VALUE		2
+#define PB_LOCATION_ID		1
+#define PB_LOCATION_ADDRESS	3
+#define PB_LOCATION_LINE	4
+#define PB_LINE_FUNCTION	1
+#define PB_FUNCTION_ID		1
+#define PB_FUNCTION_NAME	2
+#define PB_FUNCTION_SYSNAME	3
+
+/*
+ * Wire types.
+ */
+#define PB_VARINT		0
+#define PB_BYTES		2
+
+/*
+ * Strings every pprof profile starts with; their indices.
+ */
+#define PB_STR_CALLS		1
+#define PB_STR_COUNT		2
+#define PB_STR_CYCLES		3
+
+
+/**
+ * Write the buffered output.
+ * @param x Exporter.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_flush(KHOOK_EXPORT *x)
+{
+	size_t off;
+	ssize_t r;
+
+	for (off = 0; off < x->len && !x->error; off += r) {
+		r = write(x->fd, x->buf + off, x->len - off);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+		} else if (r <= 0) {
+			x->error = 1;
+		}
+	}
+	x->len = 0;
+	return (x->error ? -1 : 0);
+}
+
+
+/**
+ * Append bytes to the output.
+ * @param x Exporter;
+ * @param p Bytes;
+ * @param len Number of bytes.
+ */
+static void
+_put(KHOOK_EXPORT *x, const void *p, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (x->len == sizeof(x->buf)) {
+			_flush(x);
+		}
+		n = sizeof(x->buf) - x->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(x->buf + x->len, p, n);
+		x->len += n;
+		p = (const uint8_t *)p + n;
+		len -= n;
+	}
+}
+
+
+/**
+ * Append formatted text to the output.
+ * The text is formatted in place; it is truncated if it is longer
+ * than the output buffer.
+ * @param x Exporter;
+ * @param fmt Format.
+ */
+static void
+_printf(KHOOK_EXPORT *x, const char *fmt, ...)
+{
+	va_list ap;
+	size_t n;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf((char *)x->buf + x->len, sizeof(x->buf) - x->len, fmt,
+	    ap);
+	va_end(ap);
+	if (r >= 0 && (size_t)r >= sizeof(x->buf) - x->len) {
+		_flush(x);
+		va_start(ap, fmt);
+		r = vsnprintf((char *)x->buf, sizeof(x->buf), fmt, ap);
+		va_end(ap);
+	}
+	if (r < 0) {
+		return;
+	}
+	n = (size_t)r < sizeof(x->buf) - x->len ? (size_t)r :
+	    sizeof(x->buf) - x->len - 1;
+	x->len += n;
+}
+
+
+/**
+ * Append a string quoted as a JSON string to the output.
+ * @param x Exporter;
+ * @param s String.
+ */
+static void
+_json(KHOOK_EXPORT *x, const char *s)
+{
+	_put(x, "\"", 1);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			_put(x, "\\", 1);
+			_put(x, s, 1);
+		} else if ((unsigned char)*s < 0x20) {
+			_printf(x, "\\u%04x", (unsigned char)*s);
+		} else {
+			_put(x, s, 1);
+		}
+	}
+	_put(x, "\"", 1);
+}
+
+
+/**
+ * Name a code address.
+ * @param x Exporter;
+ * @param addr Address;
+ * @param buf Destination buffer (<code>EXPORT_MAXNAME</code> bytes long).
+ * @return <code>0</code> if the symbolizer knows the address;
+ * <code>-1</code> if <code>buf</code> holds the address in hex.
+ */
+static int
+_name(KHOOK_EXPORT *x, const void *addr, char *buf)
+{
+	if (x->sym != NULL &&
+	    x->sym(x->symctx, addr, buf, EXPORT_MAXNAME) == 0) {
+		buf[EXPORT_MAXNAME - 1] = '\0';
+		return (0);
+	}
+	snprintf(buf, EXPORT_MAXNAME, "%#lx", (unsigned long)addr);
+	return (-1);
+}
+
+
+/**
+ * Encode a varint.
+ * @param p Destination (at least 10 bytes long);
+ * @param v Value.
+ * @return The number of bytes stored at <code>p</code>.
+ */
+static size_t
+_pb_varint(uint8_t *p, uint64_t v)
+{
+	size_t n;
+
+	for (n = 0; v >= 0x80; v >>= 7) {
+		p[n++] = (uint8_t)v | 0x80;
+	}
+	p[n++] = (uint8_t)v;
+	return (n);
+}
+
+
+/**
+ * Encode a varint field.
+ * @param p Destination (at least 11 bytes long);
+ * @param field Field number;
+ * @param v Value.
+ * @return The number of bytes stored at <code>p</code>.
+ */
+static size_t
+_pb_uint(uint8_t *p, int field, uint64_t v)
+{
+	size_t n;
+
+	n = _pb_varint(p, (uint64_t)field << 3 | PB_VARINT);
+	return (n + _pb_varint(p + n, v));
+}
+
+
+/**
+ * Append a length-delimited field of a profile to the output.
+ * @param x Exporter;
+ * @param field Field number;
+ * @param msg Encoded message or string;
+ * @param len Its length.
+ */
+static void
+_pb_put(KHOOK_EXPORT *x, int field, const void *msg, size_t len)
+{
+	uint8_t hdr[20];
+	size_t n;
+
+	n = _pb_varint(hdr, (uint64_t)field << 3 | PB_BYTES);
+	n += _pb_varint(hdr + n, len);
+	_put(x, hdr, n);
+	_put(x, msg, len);
+}
+
+
+/**
+ * Append an entry to the string table of a profile.
+ * The strings are not interned: every call adds a new entry.
+ * @param x Exporter;
+ * @param s String.
+ * @return Its index.
+ */
+static uint64_t
+_pb_str(KHOOK_EXPORT *x, const char *s)
+{
+	_pb_put(x, PB_PROFILE_STRING, s, strlen(s));
+	return (x->nstr++);
+}
+
+
+/**
+ * Append a location of a profile to the output.
+ * If <code>name</code> is <code>NULL</code> the symbolizer is asked
+ * for the name of the function; unknown addresses get a location
+ * without lines, to be symbolized by pprof.
+ * Recently used addresses are found in the location cache (direct
+ * mapped) and not written again.
+ * @param x Exporter;
+ * @param addr Code address;
+ * @param name Function name or <code>NULL</code>.
+ * @return The id of the location.
+ */
+static uint64_t
+_pb_loc(KHOOK_EXPORT *x, const void *addr, const char *name)
+{
+	char buf[EXPORT_MAXNAME];
+	uint8_t msg[EXPORT_MAXMSG], line[EXPORT_MAXMSG];
+	uint64_t str, fid, lid;
+	size_t n, m;
+	int i;
+
+	i = ((uintptr_t)addr >> 4 ^ (uintptr_t)addr >> 12) &
+	    (KHOOK_EXPORT_LOCS - 1);
+	if (x->locid[i] != 0 && x->locaddr[i] == addr) {
+		return (x->locid[i]);
+	}
+
+	fid = 0;
+	if (name != NULL || _name(x, addr, buf) == 0) {
+		str = _pb_str(x, name != NULL ? name : buf);
+		fid = ++x->nid;
+		n = _pb_uint(msg, PB_FUNCTION_ID, fid);
+		n += _pb_uint(msg + n, PB_FUNCTION_NAME, str);
+		n += _pb_uint(msg + n, PB_FUNCTION_SYSNAME, str);
+		_pb_put(x, PB_PROFILE_FUNCTION, msg, n);
+	}
+
+	lid = ++x->nid;
+	n = _pb_uint(msg, PB_LOCATION_ID, lid);
+	n += _pb_uint(msg + n, PB_LOCATION_ADDRESS, (uintptr_t)addr);
+	if (fid != 0) {
+		m = _pb_uint(line, PB_LINE_FUNCTION, fid);
+		n += _pb_varint(msg + n,
+		    (uint64_t)PB_LOCATION_LINE << 3 | PB_BYTES);
+		n += _pb_varint(msg + n, m);
+		memcpy(msg + n, line, m);
+		n += m;
+	}
+	_pb_put(x, PB_PROFILE_LOCATION, msg, n);
+	x->locaddr[i] = addr;
+	x->locid[i] = lid;
+	return (lid);
+}
+
+
+/**
+ * Append a sample of a profile to the output.
+ * @param x Exporter;
+ * @param leaf Location of the hooked function;
+ * @param caller Location of the caller or <code>0</code>;
+ * @param calls Calls;
+ * @param cycles Cycles.
+ */
+static void
+_pb_sample(KHOOK_EXPORT *x, uint64_t leaf, uint64_t caller, uint64_t calls,
+    uint64_t cycles)
+{
+	uint8_t msg[EXPORT_MAXMSG], packed[EXPORT_MAXMSG];
+	size_t n, m;
+
+	m = _pb_varint(packed, leaf);
+	if (caller != 0) {
+		m += _pb_varint(packed + m, caller);
+	}
+	n = _pb_varint(msg, PB_SAMPLE_LOCATION << 3 | PB_BYTES);
+	n += _pb_varint(msg + n, m);
+	memcpy(msg + n, packed, m);
+	n += m;
+
+	m = _pb_varint(packed, calls);
+	m += _pb_varint(packed + m, cycles);
+	n += _pb_varint(msg + n, PB_SAMPLE_VALUE << 3 | PB_BYTES);
+	n += _pb_varint(msg + n, m);
+	memcpy(msg + n, packed, m);
+	n += m;
+
+	_pb_put(x, PB_PROFILE_SAMPLE, msg, n);
+}
+
+
+/**
+ * Start a Chrome trace event.
+ * @param x Exporter;
+ * @param name Event name;
+ * @param ph Event phase.
+ */
+static void
+_chrome_begin(KHOOK_EXPORT *x, const char *name, char ph)
+{
+	if (x->nrec++ > 0) {
+		_put(x, ",", 1);
+	}
+	_put(x, "\n{\"name\":", 9);
+	_json(x, name);
+	_printf(x, ",\"ph\":\"%c\",\"pid\":%ld", ph, (long)getpid());
+}
+
+
+/**
+ * Get an export format from its name.
+ * The names are the ones of <code>KHOOK_PROFILE_FORMAT</code>:
+ * "folded", "cycles", "pprof" and "chrome".
+ * @param name Name (<code>NULL</code>: the default, folded stacks
+ * weighted by calls).
+ * @return The format (<code>KHOOK_EXPORT_*</code>); <code>-1</code> if
+ * <code>name</code> is unknown.
+ */
+int
+khook_export_format(const char *name)
+{
+	/* Indexed by KHOOK_EXPORT_* */
+	static const char *names[] = { "folded", "cycles", "pprof",
+	    "chrome" };
+	int i;
+
+	if (name == NULL) {
+		return (KHOOK_EXPORT_FOLDED);
+	}
+	for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return (i);
+		}
+	}
+	return (-1);
+}
+
+
+/**
+ * Start a profile export.
+ * The output is written as the records are passed, so the profile
+ * can be dumped while hooks are running and without allocating memory.
+ * Time stamps are converted to microseconds using <code>hz</code>.
+ * @param x Exporter;
+ * @param fd Output;
+ * @param format Format (<code>KHOOK_EXPORT_*</code>);
+ * @param hz Time stamp cycles per second (<code>0</code> if unknown:
+ * time stamps are written as they are);
+ * @param sym Symbolizer for the call sites or <code>NULL</code>
+ * (they are written as addresses);
+ * @param symctx Its context.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ * @see khook_export_count()
+ * @see khook_export_callers()
+ * @see khook_export_event()
+ * @see khook_export_end()
+ */
+int
+khook_export_begin(KHOOK_EXPORT *x, int fd, int format, uint64_t hz,
+    KHOOK_SYM sym, void *symctx)
+{
+	uint8_t msg[EXPORT_MAXMSG];
+	size_t n;
+
+	if (format < KHOOK_EXPORT_FOLDED || format > KHOOK_EXPORT_CHROME) {
+		return (-1);
+	}
+	memset(x, 0, sizeof(*x) - sizeof(x->buf));
+	x->fd = fd;
+	x->format = format;
+	x->hz = hz;
+	x->sym = sym;
+	x->symctx = symctx;
+
+	switch (format) {
+	case KHOOK_EXPORT_PPROF:
+		_pb_str(x, "");
+		_pb_str(x, "calls");
+		_pb_str(x, "count");
+		_pb_str(x, "cycles");
+		n = _pb_uint(msg, PB_VALUETYPE_TYPE, PB_STR_CALLS);
+		n += _pb_uint(msg + n, PB_VALUETYPE_UNIT, PB_STR_COUNT);
+		_pb_put(x, PB_PROFILE_SAMPLE_TYPE, msg, n);
+		n = _pb_uint(msg, PB_VALUETYPE_TYPE, PB_STR_CYCLES);
+		n += _pb_uint(msg + n, PB_VALUETYPE_UNIT, PB_STR_COUNT);
+		_pb_put(x, PB_PROFILE_SAMPLE_TYPE, msg, n);
+		break;
+	case KHOOK_EXPORT_CHROME:
+		_printf(x, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+		break;
+	}
+	return (x->error ? -1 : 0);
+}
+
+
+/**
+ * Export the calls counted by a hook.
+ * In folded stacks weighted by calls it is a one frame stack; in pprof
+ * a sample; in a Chrome trace a counter. Counted calls are not timed:
+ * nothing is written in folded stacks weighted by cycles.
+ * @param x Exporter;
+ * @param name Name of the hooked function;
+ * @param fn Its address;
+ * @param calls Calls (<code>khook_count_get()</code>).
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+int
+khook_export_count(KHOOK_EXPORT *x, const char *name, const void *fn,
+    uint64_t calls)
+{
+	switch (x->format) {
+	case KHOOK_EXPORT_FOLDED:
+		_printf(x, "%s %llu\n", name, (unsigned long long)calls);
+		break;
+	case KHOOK_EXPORT_CYCLES:
+		break;
+	case KHOOK_EXPORT_PPROF:
+		_pb_sample(x, _pb_loc(x, fn, name), 0, calls, 0);
+		break;
+	case KHOOK_EXPORT_CHROME:
+		_chrome_begin(x, name, 'C');
+		_printf(x, ",\"ts\":0,\"args\":{\"calls\":%llu}}",
+		    (unsigned long long)calls);
+		break;
+	}
+	return (x->error ? -1 : 0);
+}
+
+
+/**
+ * Export the call sites recorded by a hook.
+ * Every call site is a two frames stack (caller, then the hooked
+ * function) weighted by its calls or cycles; in a Chrome trace it is
+ * a counter with both.
+ * @param x Exporter;
+ * @param name Name of the hooked function;
+ * @param fn Its address;
+ * @param site Call sites (<code>khook_callers_snapshot()</code>);
+ * @param n Number of call sites.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+int
+khook_export_callers(KHOOK_EXPORT *x, const char *name, const void *fn,
+    const KHOOK_CALLER *site, size_t n)
+{
+	char buf[EXPORT_MAXNAME];
+	uint64_t leaf;
+	size_t i;
+
+	leaf = x->format == KHOOK_EXPORT_PPROF && n > 0 ?
+	    _pb_loc(x, fn, name) : 0;
+	for (i = 0; i < n; i++) {
+		switch (x->format) {
+		case KHOOK_EXPORT_FOLDED:
+		case KHOOK_EXPORT_CYCLES:
+			_name(x, site[i].ra, buf);
+			_printf(x, "%s;%s %llu\n", buf, name,
+			    (unsigned long long)(x->format ==
+			    KHOOK_EXPORT_FOLDED ? site[i].calls :
+			    site[i].cycles));
+			break;
+		case KHOOK_EXPORT_PPROF:
+			_pb_sample(x, leaf, _pb_loc(x, site[i].ra, NULL),
+			    site[i].calls, site[i].cycles);
+			break;
+		case KHOOK_EXPORT_CHROME:
+			_name(x, site[i].ra, buf);
+			_chrome_begin(x, name, 'C');
+			_put(x, ",\"ts\":0,\"id\":", 13);
+			_json(x, buf);
+			_printf(x, ",\"args\":{\"calls\":%llu,"
+			    "\"cycles\":%llu}}",
+			    (unsigned long long)site[i].calls,
+			    (unsigned long long)site[i].cycles);
+			break;
+		}
+	}
+	return (x->error ? -1 : 0);
+}
+
+
+/**
+ * Export a traced call.
+ * It is exported as one call from <code>ev->ra</code>; in a Chrome
+ * trace it is an instant event. Traced calls are not timed: nothing is
+ * written in folded stacks weighted by cycles.
+ * @param x Exporter;
+ * @param name Name of the hooked function;
+ * @param fn Its address;
+ * @param ev Event.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+int
+khook_export_event(KHOOK_EXPORT *x, const char *name, const void *fn,
+    const KHOOK_EVENT *ev)
+{
+	char buf[EXPORT_MAXNAME];
+
+	switch (x->format) {
+	case KHOOK_EXPORT_FOLDED:
+		_name(x, ev->ra, buf);
+		_printf(x, "%s;%s 1\n", buf, name);
+		break;
+	case KHOOK_EXPORT_CYCLES:
+		break;
+	case KHOOK_EXPORT_PPROF:
+		_pb_sample(x, _pb_loc(x, fn, name), _pb_loc(x, ev->ra, NULL),
+		    1, 0);
+		break;
+	case KHOOK_EXPORT_CHROME:
+		_name(x, ev->ra, buf);
+		_chrome_begin(x, name, 'i');
+		if (x->hz != 0) {
+			_printf(x, ",\"ts\":%llu.%03llu",
+			    (unsigned long long)(ev->tsc / x->hz * 1000000 +
+			    ev->tsc % x->hz * 1000000 / x->hz),
+			    (unsigned long long)(ev->tsc % x->hz * 1000000 %
+			    x->hz * 1000 / x->hz));
+		} else {
+			_printf(x, ",\"ts\":%llu",
+			    (unsigned long long)ev->tsc);
+		}
+		_printf(x, ",\"tid\":%ld,\"s\":\"t\",\"args\":{\"caller\":",
+		    ev->tid);
+		_json(x, buf);
+		_printf(x, ",\"arg\":\"%#lx\"}}", (unsigned long)ev->arg);
+		break;
+	}
+	return (x->error ? -1 : 0);
+}
+
+
+/**
+ * End a profile export.
+ * The rest of the output is written; <code>fd</code> is not closed.
+ * @param x Exporter.
+ * @return <code>0</code> if the whole profile has been written;
+ * <code>-1</code> on error.
+ */
+int
+khook_export_end(KHOOK_EXPORT *x)
+{
+	if (x->format == KHOOK_EXPORT_CHROME) {
+		_printf(x, "\n]}\n");
+	}
+	return (_flush(x));
+}
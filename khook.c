@@ -25,17 +25,626 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <sys/types.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "disass.h"
 #include "khook.h"
+#include "arena.h"
+#include "callers.h"
+#include "emit.h"
+#include "memo.h"
+#include "registry.h"
+#include "stw.h"
 
 
 /**
- * Offset within the hooking code containing
+ * Max. size of an argument predicate:
+ * <code>mov eax, [esp + disp32]; cmp eax, data32; jxx rel8</code>.
+ */
+#define KHOOK_SIZEOF_MAXPRED	(7 + SIZEOF_CMPEAX32 + SIZEOF_J8)
+
+/**
+ * Size of the code incrementing a call counter.
+ */
+#define KHOOK_SIZEOF_COUNT	(SIZEOF_MOVRMR + SIZEOF_SHREAX8 + \
+				SIZEOF_ANDEAX32 + 2 * SIZEOF_LOCKADD8)
+
+/**
+ * Max. size of the code calling the callback (predicate included).
+ */
+#define KHOOK_SIZEOF_MAXCALL	(KHOOK_SIZEOF_MAXPRED + SIZEOF_PUSH32 + \
+				SIZEOF_CALL32 + SIZEOF_POPEAX)
+
+/**
+ * Max. size of the code calling a probe's callback.
+ */
+#define KHOOK_SIZEOF_MAXPROBE	(SIZEOF_PUSHFD + SIZEOF_CLD + SIZEOF_PUSHAD + \
+				SIZEOF_ADDESP8 + 2 * SIZEOF_MOVRMR + \
+				2 * SIZEOF_ALUR8 + SIZEOF_PUSHEBX + \
+				SIZEOF_PUSH32 + SIZEOF_CALL32 + \
+				SIZEOF_POPAD + SIZEOF_POPFD)
+
+/**
+ * Size of the code intercepting the return of a call.
+ */
+#define KHOOK_SIZEOF_CALLERS	(SIZEOF_MOVRMR + SIZEOF_PUSHEAX + \
+				SIZEOF_PUSH32 + SIZEOF_CALL32 + SIZEOF_ALUR8)
+
+/**
+ * Size of the code looking a call up in the result cache.
+ */
+#define KHOOK_SIZEOF_MEMO	(SIZEOF_MOVRMR + 2 * SIZEOF_PUSHEAX + \
+				SIZEOF_MOVRMR + SIZEOF_PUSHECX + \
+				SIZEOF_PUSHEAX + SIZEOF_PUSH32 + \
+				SIZEOF_CALL32 + SIZEOF_ALUR8 + \
+				SIZEOF_TESTRMR + SIZEOF_POPEAX + \
+				SIZEOF_POPEDX + SIZEOF_J8 + SIZEOF_RET)
+
+/**
+ * Max. offset within the hooking code containing
  * the original (re-encoded) instructions.
  */
-#define KHOOK_OFFSET_RECODED	(SIZEOF_PUSH32 + SIZEOF_CALL32 + SIZEOF_POPEAX)
+#define KHOOK_MAX(a, b)		((a) > (b) ? (a) : (b))
+#define KHOOK_OFFSET_RECODED	KHOOK_MAX(KHOOK_SIZEOF_MAXPROBE, \
+				KHOOK_MAX(KHOOK_SIZEOF_MAXCALL, \
+				KHOOK_MAX(KHOOK_SIZEOF_COUNT, \
+				KHOOK_MAX(KHOOK_SIZEOF_CALLERS, KHOOK_SIZEOF_MEMO))))
+
+
+/*
+ * KHOOK_SIZEOF_MAXPREAMBLE must hold the largest preamble.
+ */
+typedef char _khook_preamble_check[
+    KHOOK_OFFSET_RECODED <= KHOOK_SIZEOF_MAXPREAMBLE ? 1 : -1];
+
+
+/**
+ * Transaction open in the calling thread.
+ */
+static __thread KHOOK_TXN *_txn;
+
+
+/**
+ * Jxx condition met when a predicate is true (indexed by operator).
+ */
+static const uint8_t _pred_cc[KHOOK_PRED_MAX] = {
+	CC_E,	/* KHOOK_PRED_EQ  */
+	CC_NE,	/* KHOOK_PRED_NE  */
+	CC_L,	/* KHOOK_PRED_LT  */
+	CC_LE,	/* KHOOK_PRED_LE  */
+	CC_G,	/* KHOOK_PRED_GT  */
+	CC_GE,	/* KHOOK_PRED_GE  */
+	CC_B,	/* KHOOK_PRED_LTU */
+	CC_BE,	/* KHOOK_PRED_LEU */
+	CC_A,	/* KHOOK_PRED_GTU */
+	CC_AE,	/* KHOOK_PRED_GEU */
+	CC_NE	/* KHOOK_PRED_AND */
+};
+
+
+/**
+ * Generate the code evaluating a predicate.
+ * The code is placed at the very beginning of the hooking code, so the
+ * arguments of the hooked function are found on the stack right above
+ * the return address. The generated code uses EAX and the flags, none
+ * of them is preserved across a function call.
+ * <pre>
+ *    mov eax, [esp + 4 + 4 * argn]
+ *    cmp eax, value            ;or test eax, value
+ *    jxx skip                  ;Predicate false
+ * </pre>
+ * @param e Code buffer;
+ * @param pred Predicate;
+ * @param skip Label of the code run when the predicate is false.
+ * @return <code>0</code> on success; <code>-1</code> if the predicate
+ * is not valid.
+ * @see KHOOK_SIZEOF_MAXPRED
+ */
+static int
+_khook_pred(EMIT *e, const KHOOK_PRED *pred, int skip)
+{
+	long disp;
+
+	if (pred->argn < 0 || pred->argn > (LONG_MAX - 4) / 4 ||
+	    pred->op < 0 || pred->op >= KHOOK_PRED_MAX) {
+		return (-1);
+	}
+
+	/*
+	 * mov eax, [esp + disp]
+	 */
+	disp = 4 + 4 * (long)pred->argn;
+	emit_u8(e, OPCODE_MOVRM);
+	if (INS_ISREL8(disp)) {
+		emit_u8(e, MODRM_EAXSIB8);
+		emit_u8(e, SIB_ESP);
+		emit_u8(e, (uint8_t)disp);
+	} else {
+		emit_u8(e, MODRM_EAXSIB32);
+		emit_u8(e, SIB_ESP);
+		emit_u32(e, (uint32_t)disp);
+	}
+
+	/*
+	 * cmp eax, value / test eax, value
+	 */
+	if (pred->op == KHOOK_PRED_AND) {
+		if (((unsigned long)pred->value & ~0xFFUL) == 0) {
+			emit_u8(e, OPCODE_TESTAL8);
+			emit_u8(e, (uint8_t)pred->value);
+		} else {
+			emit_u8(e, OPCODE_TESTEAX32);
+			emit_u32(e, (uint32_t)pred->value);
+		}
+	} else if (INS_ISREL8(pred->value)) {
+		emit_u8(e, OPCODE_GROUP1I8);
+		emit_u8(e, MODRM_CMPEAX);
+		emit_u8(e, (uint8_t)pred->value);
+	} else {
+		emit_u8(e, OPCODE_CMPEAX32);
+		emit_u32(e, (uint32_t)pred->value);
+	}
+
+	/*
+	 * jxx skip
+	 */
+	emit_branch(e, OPCODE_J8 + CC_NOT(_pred_cc[pred->op]), skip);
+	return (0);
+}
+
+
+/**
+ * Generate the code calling the user callback.
+ * <pre>
+ *    push arg
+ *    call callback
+ *    pop  eax
+ * </pre>
+ * @param e Code buffer;
+ * @param arg Value passed to the callback;
+ * @param callback User defined callback.
+ */
+static void
+_khook_call(EMIT *e, long arg, void (*callback)(long, long, ...))
+{
+
+	emit_push(e, arg);
+	emit_branch_to(e, OPCODE_CALL32, callback);
+	emit_u8(e, OPCODE_POPEAX);
+}
+
+
+/**
+ * Generate the code incrementing a call counter.
+ * The shard is selected from the 4 KB stack page of the caller:
+ * <pre>
+ *    mov  eax, esp
+ *    shr  eax, 12 - 6
+ *    and  eax, (KHOOK_COUNT_SHARDS - 1) << 6
+ *    lock add [eax + counter], 1         ;Low 32 bits
+ *    lock adc [eax + counter + 4], 0     ;Carry to the high 32 bits
+ * </pre>
+ * Only EAX and the flags are used.
+ * @param e Code buffer;
+ * @param counter Counter.
+ * @see KHOOK_SIZEOF_COUNT
+ */
+static void
+_khook_count(EMIT *e, KHOOK_COUNTER *counter)
+{
+	uint32_t lo;
+
+	emit_u8(e, OPCODE_MOVRMR);
+	emit_u8(e, MODRM_ESPEAX);
+
+	emit_u8(e, OPCODE_GROUP2I8);
+	emit_u8(e, MODRM_SHREAX);
+	emit_u8(e, 12 - 6);
+
+	emit_u8(e, OPCODE_ANDEAX32);
+	emit_u32(e, (KHOOK_COUNT_SHARDS - 1) * KHOOK_SIZEOF_CACHELINE);
+
+	lo = (uint32_t)(uintptr_t)&counter->shard[0].n;
+	emit_u8(e, PREFIX1_LOCK);
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_ADDEAX32);
+	emit_u32(e, lo);
+	emit_u8(e, 1);
+
+	emit_u8(e, PREFIX1_LOCK);
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_ADCEAX32);
+	emit_u32(e, lo + 4);
+	emit_u8(e, 0);
+}
+
+
+/**
+ * Generate the code calling a probe's callback.
+ * All the registers and the flags are saved on the stack and restored
+ * afterwards; the stack is aligned to 16 bytes for the callback.
+ * <pre>
+ *    pushfd
+ *    cld
+ *    pushad
+ *    add  dword [esp + 12], 4    ;KHOOK_REGS.esp before pushfd
+ *    mov  ebx, esp               ;KHOOK_REGS *
+ *    and  esp, -16
+ *    sub  esp, 8
+ *    push ebx
+ *    push arg
+ *    call callback
+ *    mov  esp, ebx
+ *    popad
+ *    popfd
+ * </pre>
+ * @param e Code buffer;
+ * @param arg Value passed to the callback;
+ * @param callback User defined callback.
+ * @see KHOOK_SIZEOF_MAXPROBE
+ */
+static void
+_khook_probe(EMIT *e, long arg, void (*callback)(long, KHOOK_REGS *))
+{
+
+	emit_u8(e, OPCODE_PUSHFD);
+	emit_u8(e, OPCODE_CLD);
+	emit_u8(e, OPCODE_PUSHAD);
+
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_ADDSIB8);
+	emit_u8(e, SIB_ESP);
+	emit_u8(e, offsetof(KHOOK_REGS, esp));
+	emit_u8(e, 4);
+
+	emit_u8(e, OPCODE_MOVRMR);
+	emit_u8(e, MODRM_ESPEBX);
+
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_ANDESP);
+	emit_u8(e, (uint8_t)-16);
+
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_SUBESP);
+	emit_u8(e, 8);
+
+	emit_u8(e, OPCODE_PUSHEBX);
+	emit_push(e, arg);
+	emit_branch_to(e, OPCODE_CALL32, callback);
+
+	emit_u8(e, OPCODE_MOVRMR);
+	emit_u8(e, MODRM_EBXESP);
+
+	emit_u8(e, OPCODE_POPAD);
+	emit_u8(e, OPCODE_POPFD);
+}
+
+
+/**
+ * Generate the code intercepting the return of a call.
+ * <pre>
+ *    mov  eax, esp               ;Address of the return address
+ *    push eax
+ *    push callers
+ *    call callers_enter
+ *    add  esp, 8
+ * </pre>
+ * Only EAX, ECX, EDX and the flags are used.
+ * @param e Code buffer;
+ * @param callers Caller table.
+ * @see KHOOK_SIZEOF_CALLERS
+ */
+static void
+_khook_callers(EMIT *e, KHOOK_CALLERS *callers)
+{
+
+	emit_u8(e, OPCODE_MOVRMR);
+	emit_u8(e, MODRM_ESPEAX);
+
+	emit_u8(e, OPCODE_PUSHEAX);
+	emit_push(e, (long)(uintptr_t)callers);
+	emit_branch_to(e, OPCODE_CALL32, callers_enter);
+
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_ADDESP);
+	emit_u8(e, 2 * sizeof(uint32_t));
+}
+
+
+/**
+ * Generate the code looking a call up in the result cache.
+ * On a hit the cached value is returned to the caller, skipping the
+ * function; on a miss the execution continues with the original
+ * instructions:
+ * <pre>
+ *    mov  eax, esp               ;Address of the return address
+ *    push eax                    ;Room for the cached value
+ *    push eax
+ *    mov  ecx, esp
+ *    push ecx
+ *    push eax
+ *    push memo
+ *    call memo_enter
+ *    add  esp, 12
+ *    test eax, eax
+ *    pop  eax                    ;Cached value (EDX:EAX)
+ *    pop  edx
+ *    jz   miss
+ *    ret
+ * miss:
+ * </pre>
+ * Only EAX, ECX, EDX and the flags are used.
+ * @param e Code buffer;
+ * @param memo Memo;
+ * @param miss Label of the original instructions.
+ * @see KHOOK_SIZEOF_MEMO
+ */
+static void
+_khook_memo(EMIT *e, KHOOK_MEMO *memo, int miss)
+{
+
+	emit_u8(e, OPCODE_MOVRMR);
+	emit_u8(e, MODRM_ESPEAX);
+	emit_u8(e, OPCODE_PUSHEAX);
+	emit_u8(e, OPCODE_PUSHEAX);
+	emit_u8(e, OPCODE_MOVRMR);
+	emit_u8(e, MODRM_ESPECX);
+
+	emit_u8(e, OPCODE_PUSHECX);
+	emit_u8(e, OPCODE_PUSHEAX);
+	emit_push(e, (long)(uintptr_t)memo);
+	emit_branch_to(e, OPCODE_CALL32, memo_enter);
+	emit_u8(e, OPCODE_GROUP1I8);
+	emit_u8(e, MODRM_ADDESP);
+	emit_u8(e, 3 * sizeof(uint32_t));
+
+	emit_u8(e, OPCODE_TESTRMR);
+	emit_u8(e, MODRM_EAXEAX);
+	emit_u8(e, OPCODE_POPEAX);
+	emit_u8(e, OPCODE_POPEDX);
+	emit_branch(e, OPCODE_J8 + CC_E, miss);
+	emit_u8(e, OPCODE_RET);
+	emit_bind(e, miss);
+}
+
+
+/**
+ * Re-encode the instructions replaced by a hook that runs in another
+ * address space and generate the jump back to the original code.
+ * <pre>
+ *    ...                       ;Original (re-encoded) instructions
+ *    jmp fn + d                ;Jump to the original code
+ * </pre>
+ * The jump is omitted when the last re-encoded instruction never
+ * continues to the next one (jmp, ret).
+ * @param e Code buffer (executed at <code>info->hcode</code>);
+ * @param info Hook record: <code>fn</code> and <code>hcode</code> are
+ * read, the number of bytes replaced at <code>fn</code> and the offsets
+ * of the instructions are filled;
+ * @param code Local copy of the code at <code>fn</code>;
+ * @param end End of <code>code</code> (<code>NULL</code> if unbounded);
+ * @param peek Reader of the other address space (<code>NULL</code> to
+ * read the targets of the calls directly);
+ * @param ctx Argument of <code>peek</code>.
+ * @return <code>0</code> on success; <code>KHOOK_EUNDEF</code>,
+ * <code>KHOOK_ETRUNC</code> or <code>KHOOK_ERELOC</code> if one of the
+ * instructions can't be fetched or re-encoded.
+ */
+static int
+_khook_relocate_at(EMIT *e, KHOOK_INFO *info, const uint8_t *code,
+    const uint8_t *end, KHOOK_PEEK peek, void *ctx)
+{
+	INS ins;
+	uint8_t *src, *next, callee[4];
+	int n;
+
+	info->size = 0;
+	info->nins = 0;
+	src = (uint8_t *)code;
+	while (info->size < SIZEOF_JMP32) {
+		if (end != NULL) {
+			n = disass_fetch_end(&ins, &src, end);
+		} else {
+			n = disass_fetch(&ins, &src);
+		}
+		if (n == 0) {
+			/*
+			 * Istruction not recognized.
+			 */
+			return (KHOOK_EUNDEF);
+		}
+		if (n < 0) {
+			return (KHOOK_ETRUNC);
+		}
+		info->insoff[info->nins] = info->size;
+		info->recoff[info->nins] = e->len;
+		info->nins++;
+		info->size += ins.size;
+		next = (uint8_t *)info->fn + info->size;
+		if (peek != NULL && disass_target(&ins, next) != NULL) {
+			bzero(callee, sizeof(callee));
+			peek(ctx, callee, disass_target(&ins, next),
+			    sizeof(callee));
+			n = emit_recode(e, &ins, next, callee);
+		} else {
+			n = emit_recode(e, &ins, next, NULL);
+		}
+		if (n == 0) {
+			/*
+			 * Unable to recode the fetched instruction.
+			 */
+			return (KHOOK_ERELOC);
+		}
+	}
+
+	/*
+	 * jmporig:
+	 *    jmp orig+d        ;Jump to the original code.
+	 */
+	if (!disass_isterm(&ins)) {
+		emit_branch_to(e, OPCODE_JMP8, (uint8_t *)info->fn + info->size);
+	}
+	return (0);
+}
+
+
+/**
+ * Re-encode the instructions replaced by the hook and generate the
+ * jump back to the original code.
+ * @param e Code buffer;
+ * @param info Hook record (see <code>_khook_relocate_at()</code>).
+ * @return <code>0</code> on success; <code>-1</code> if one of the
+ * instructions can't be fetched or re-encoded.
+ */
+static int
+_khook_relocate(EMIT *e, KHOOK_INFO *info)
+{
+
+	if (_khook_relocate_at(e, info, info->fn, NULL, NULL, NULL) < 0 ||
+	    emit_end(e) == 0) {
+		return (-1);
+	}
+	return (0);
+}
+
+
+/**
+ * Patch a hooked address with a jump to the hooking code.
+ * @param info Hook record.
+ * @return <code>0</code> on success; <code>-1</code> if the code can't
+ * be written.
+ */
+static int
+_khook_patch(const KHOOK_INFO *info)
+{
+	uint8_t jmp[SIZEOF_JMP32];
+
+	khook_patch_gen(info, jmp);
+	return (arena_poke(info->fn, jmp, sizeof(jmp)));
+}
+
+
+/**
+ * Patch the hooks of a transaction.
+ * If one of them can't be patched the others are restored.
+ * @param txn Transaction.
+ * @return <code>0</code> on success; <code>-1</code> on error (nothing
+ * is left patched).
+ */
+static int
+_khook_txn_patch(KHOOK_TXN *txn)
+{
+	int i;
+
+	for (i = 0; i < txn->nhooks; i++) {
+		if (_khook_patch(&txn->hook[i]) < 0) {
+			while (--i >= 0) {
+				arena_poke(txn->hook[i].fn, txn->hook[i].orig,
+				    SIZEOF_JMP32);
+			}
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * Mark the open transaction (if any) as failed.
+ * @return <code>0</code>.
+ */
+static size_t
+_khook_fail(void)
+{
+
+	if (_txn != NULL) {
+		_txn->failed = 1;
+	}
+	return (0);
+}
+
+
+/**
+ * Add a hook to the open transaction.
+ * The hook is refused if its address is already hooked or if the
+ * bytes it replaces overlap those of another hook of the transaction.
+ * @param info Hook record.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_khook_txn_add(const KHOOK_INFO *info)
+{
+	KHOOK_INFO *hook;
+	uint8_t *fn;
+	int i, max;
+
+	if (khook_lookup(info->fn) != NULL) {
+		return (-1);
+	}
+	fn = (uint8_t *)info->fn;
+	for (i = 0; i < _txn->nhooks; i++) {
+		hook = &_txn->hook[i];
+		if (fn < (uint8_t *)hook->fn + hook->size &&
+		    (uint8_t *)hook->fn < fn + info->size) {
+			return (-1);
+		}
+	}
+
+	if (_txn->nhooks == _txn->maxhooks) {
+		max = _txn->maxhooks == 0 ? 16 : _txn->maxhooks * 2;
+		hook = realloc(_txn->hook, max * sizeof(KHOOK_INFO));
+		if (hook == NULL) {
+			return (-1);
+		}
+		_txn->hook = hook;
+		_txn->maxhooks = max;
+	}
+	memcpy(&_txn->hook[_txn->nhooks++], info, sizeof(KHOOK_INFO));
+	return (0);
+}
+
+
+/**
+ * Register a hook and patch the hooked address with a jump to the
+ * hooking code.
+ * Within a transaction the hook is only prepared: it is registered and
+ * patched by <code>khook_txn_commit()</code>.
+ * @param info Hook record (<code>orig</code> is filled here);
+ * @param hsize Available size in the hooking code buffer.
+ * @return The size of the hooking code; <code>0</code> if the address
+ * is already hooked.
+ */
+static size_t
+_khook_install(KHOOK_INFO *info, size_t *hsize)
+{
+
+	memcpy(info->orig, info->fn, info->size);
+	if (_txn != NULL) {
+		if (_txn->failed || _khook_txn_add(info) < 0) {
+			return (_khook_fail());
+		}
+	} else {
+		if (registry_add(info) == NULL) {
+			return (0);
+		}
+
+		/*
+		 * Replace the original instructions with a jump to hcode.
+		 */
+		if (_khook_patch(info) < 0) {
+			registry_del(info->fn);
+			return (0);
+		}
+	}
+
+	*hsize -= info->hsize;
+	return (info->hsize);
+}
 
 
 /**
@@ -64,113 +673,741 @@
  * - <code>disass_fetch()<code> does not recognize at least one of the
  * instructions to replace;
  * - <code>disass_recode()<code> does not recognize at least one of the
- * instructions to recode.
+ * instructions to recode;
+ * - <code>fn</code> is already hooked.
  *
  * @see KHOOK_SIZEOF_MAXCODE
  * @see disass_fetch()
  * @see disass_recode()
+ * @see khook_lookup()
+ * @see khook_pred()
  */
 size_t
 khook(void *fn, void *hcode, size_t *hsize, long arg,
     void (*callback)(long, long, ...))
 {
-	INS ins;
-	uint8_t *dst, *src;
-	size_t pissiz, copied, totsiz, gensiz;
+
+	return (khook_pred(fn, hcode, hsize, arg, callback, NULL));
+}
+
+
+/**
+ * Install a hook whose callback is called only when a predicate on one
+ * of the arguments of the hooked function is true.
+ * The predicate is compiled into the hooking code, so the calls for
+ * which it is false go straight to the original code without paying
+ * the callback's round trip.<br>
+ * The arguments are expected on the stack (cdecl or stdcall), as
+ * <code>long</code> values.
+ * @param fn Address to hook;
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param arg Value passed to the callback;
+ * @param callback User defined callback;
+ * @param pred Predicate (<code>NULL</code> to always call the callback).
+ * @return On success the hook's size; <code>0</code> on error (see
+ * <code>khook()</code>) or if the predicate is not valid.
+ * @see khook()
+ * @see KHOOK_PRED
+ */
+size_t
+khook_pred(void *fn, void *hcode, size_t *hsize, long arg,
+    void (*callback)(long, long, ...), const KHOOK_PRED *pred)
+{
+	KHOOK_INFO info;
+	EMIT e;
+	int skip;
 
 	/*
 	 * Generated code:
 	 * hcode:
+	 *    mov  eax, [esp + 4 + 4 * argn]    ;Only with a predicate
+	 *    cmp  eax, value
+	 *    jxx  recoded
+	 *
 	 *    push arg
 	 *    call callback
-	 *    pop  arg
+	 *    pop  eax
 	 *
 	 * recoded:
-	 *    ...         ; Re-encoded instructions
+	 *    ...         ; Original (re-encoded) instructions
 	 *    ...
 	 *
 	 * jmporig:
 	 *    jmp fn + d  ; Jump to the original code
+	 *
+	 * Every instruction uses its shortest encoding and jmporig is
+	 * omitted when the last re-encoded instruction never continues
+	 * to the next one (jmp, ret).
 	 */
 
 	/*
 	 * Check available space for the hooking code.
 	 */
 	if (*hsize < KHOOK_SIZEOF_MAXCODE) {
-		return (0);
+		return (_khook_fail());
 	}
-	totsiz = *hsize;
+
+	emit_init(&e, arena_wptr(hcode), *hsize, hcode);
+	skip = -1;
+	if (pred != NULL) {
+		skip = emit_label(&e);
+		if (_khook_pred(&e, pred, skip) < 0) {
+			return (_khook_fail());
+		}
+	}
+
+	_khook_call(&e, arg, callback);
+	if (skip >= 0) {
+		emit_bind(&e, skip);
+	}
+
+	/*
+	 * Re-encode the original replaced instructions.
+	 */
+	bzero(&info, sizeof(info));
+	info.fn = fn;
+	info.hcode = hcode;
+	if (_khook_relocate(&e, &info) < 0) {
+		return (_khook_fail());
+	}
+
+	/*
+	 * Register the hook (this fails if fn is already hooked).
+	 */
+	info.type = KHOOK_TYPE_CALL;
+	info.hsize = e.len;
+	info.arg = arg;
+	info.callback = callback;
+	return (_khook_install(&info, hsize));
+}
+
+
+/**
+ * Install a counting hook.
+ * The hooking code increments <code>counter</code> and then runs the
+ * original code: no callback is involved, so that a call costs only a
+ * few instructions and a locked add on a cache line seldom shared with
+ * other threads.
+ * @param fn Address to hook;
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param counter Call counter (it is not cleared).
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error (see <code>khook()</code>).
+ * @see khook()
+ * @see khook_count_get()
+ */
+size_t
+khook_count(void *fn, void *hcode, size_t *hsize, KHOOK_COUNTER *counter)
+{
+	KHOOK_INFO info;
+	EMIT e;
 
 	/*
+	 * Generated code:
 	 * hcode:
-	 *    push arg
-	 *    call callback
-	 *    pop  arg
+	 *    mov  eax, esp
+	 *    shr  eax, 6
+	 *    and  eax, shard mask
+	 *    lock add [eax + counter], 1
+	 *    lock adc [eax + counter + 4], 0
+	 *
+	 * recoded:
+	 *    ...         ; Original (re-encoded) instructions
+	 *
+	 * jmporig:
+	 *    jmp fn + d  ; Jump to the original code
 	 */
-	dst = (uint8_t *)hcode;
-	*dst = OPCODE_PUSH32;
-	*(uint32_t *)(dst + 1) = (uint32_t)arg;
-	dst += SIZEOF_PUSH32;
+	if (*hsize < KHOOK_SIZEOF_MAXCODE) {
+		return (_khook_fail());
+	}
 
-	*dst = OPCODE_CALL32;
-	*(uint32_t *)(dst + 1) =
-	    (uint32_t)INS_ABS2REL(dst + SIZEOF_CALL32, callback);
-	dst += SIZEOF_CALL32;
+	emit_init(&e, arena_wptr(hcode), *hsize, hcode);
+	_khook_count(&e, counter);
+	bzero(&info, sizeof(info));
+	info.fn = fn;
+	info.hcode = hcode;
+	if (_khook_relocate(&e, &info) < 0) {
+		return (_khook_fail());
+	}
+
+	info.type = KHOOK_TYPE_COUNT;
+	info.hsize = e.len;
+	info.arg = (long)counter;
+	return (_khook_install(&info, hsize));
+}
 
-	*dst = OPCODE_POPEAX;
-	dst += SIZEOF_POPEAX;
+
+/**
+ * Get the number of calls recorded by a counter.
+ * The value is exact once the counted calls have entered the hooked
+ * function; while other threads are counting it may miss a carry
+ * between the two halves of a shard.
+ * @param counter Call counter.
+ * @return The sum of all the shards.
+ * @see khook_count()
+ */
+uint64_t
+khook_count_get(const KHOOK_COUNTER *counter)
+{
+	uint64_t n;
+	int i;
+
+	n = 0;
+	for (i = 0; i < KHOOK_COUNT_SHARDS; i++) {
+		n += __atomic_load_n(&counter->shard[i].n, __ATOMIC_RELAXED);
+	}
+	return (n);
+}
+
+
+/**
+ * Install a probe point.
+ * Unlike <code>khook()</code>, <code>addr</code> can be any instruction
+ * boundary, not just a function entry: every time the execution reaches
+ * it the callback is called with the values of the registers, which it
+ * can change, then the replaced instructions are executed.<br>
+ * The 5 bytes following <code>addr</code> must not be the target of a
+ * jump: it is up to the caller to pick a probe point where no branch
+ * lands within the replaced instructions.
+ * @param addr Address to probe;
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param arg Value passed to the callback;
+ * @param callback User defined callback.
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error (see <code>khook()</code>).
+ * @see khook()
+ * @see KHOOK_REGS
+ */
+size_t
+khook_probe(void *addr, void *hcode, size_t *hsize, long arg,
+    void (*callback)(long, KHOOK_REGS *))
+{
+	KHOOK_INFO info;
+	EMIT e;
+
+	if (*hsize < KHOOK_SIZEOF_MAXCODE) {
+		return (_khook_fail());
+	}
+
+	emit_init(&e, arena_wptr(hcode), *hsize, hcode);
+	_khook_probe(&e, arg, callback);
+	bzero(&info, sizeof(info));
+	info.fn = addr;
+	info.hcode = hcode;
+	if (_khook_relocate(&e, &info) < 0) {
+		return (_khook_fail());
+	}
+
+	info.type = KHOOK_TYPE_PROBE;
+	info.hsize = e.len;
+	info.arg = arg;
+	info.callback = (void (*)(long, long, ...))callback;
+	return (_khook_install(&info, hsize));
+}
+
+
+/**
+ * Install a hook recording the call sites of a function.
+ * Every call is accounted in <code>callers</code> under its return
+ * address, with the number of calls and the time stamp cycles spent
+ * in the function (the return address is replaced with a trampoline
+ * that reads the time stamp counter when the function returns). If
+ * <code>callers->rate</code> is larger than 1 only 1 call out of
+ * <code>rate</code>, drawn at random, is timed and its cycles are
+ * multiplied by <code>rate</code>: the other calls are just counted.<br>
+ * The arguments of the hooked function must be on the stack (EAX, ECX
+ * and EDX are used) and C++ exceptions must not unwind through it.
+ * @param fn Address to hook;
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param callers Caller table (zeroed before its first use).
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error (see <code>khook()</code>).
+ * @see khook()
+ * @see khook_callers_snapshot()
+ */
+size_t
+khook_callers(void *fn, void *hcode, size_t *hsize, KHOOK_CALLERS *callers)
+{
+	KHOOK_INFO info;
+	EMIT e;
+
+	if (*hsize < KHOOK_SIZEOF_MAXCODE) {
+		return (_khook_fail());
+	}
+
+	emit_init(&e, arena_wptr(hcode), *hsize, hcode);
+	_khook_callers(&e, callers);
+	bzero(&info, sizeof(info));
+	info.fn = fn;
+	info.hcode = hcode;
+	if (_khook_relocate(&e, &info) < 0) {
+		return (_khook_fail());
+	}
+
+	info.type = KHOOK_TYPE_CALLERS;
+	info.hsize = e.len;
+	info.arg = (long)callers;
+	return (_khook_install(&info, hsize));
+}
+
+
+/**
+ * Install a detour.
+ * The hooked function jumps straight to <code>target</code>, which
+ * replaces it: <code>target</code> must have the same type and calling
+ * convention and can run the original function by calling
+ * <code>*orig</code> (the re-encoded instructions followed by a jump
+ * back to <code>fn</code>).<br>
+ * Unlike <code>khook()</code> no argument is taken from the stack nor
+ * passed by the hooking code, so the arguments and the return value of
+ * the hooked function go through <code>target</code> with the native ABI.
+ * @param fn Address to hook;
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param target Replacement of <code>fn</code>;
+ * @param orig Receives the address of the original function (it is
+ * set before <code>fn</code> is patched and left unchanged on error).
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error (see <code>khook()</code>).
+ * @see khook()
+ */
+size_t
+khook_detour(void *fn, void *hcode, size_t *hsize, void *target,
+    void **orig)
+{
+	KHOOK_INFO info;
+	void *prev;
+	size_t r;
+	EMIT e;
 
 	/*
-	 * Re-encode the original replaced instructions.
+	 * Generated code:
+	 * hcode:
+	 *    jmp  target ; Threads moved at fn by khook_fixup()
+	 *
+	 * orig:
+	 *    ...         ; Original (re-encoded) instructions
+	 *    jmp  fn + d ; Jump to the original code
 	 */
-	pissiz = 0;
-	dst = hcode + KHOOK_OFFSET_RECODED;
-	src = (uint8_t *)fn;
-	while (pissiz < SIZEOF_JMP32) {
-		if (disass_fetch(&ins, &src) == 0) {
-			/*
-			 * Istruction not recognized.
-			 */
-			return (0);
+	if (*hsize < KHOOK_SIZEOF_MAXCODE) {
+		return (_khook_fail());
+	}
+
+	emit_init(&e, arena_wptr(hcode), *hsize, hcode);
+	emit_branch_to(&e, OPCODE_JMP8, target);
+	bzero(&info, sizeof(info));
+	info.fn = fn;
+	info.hcode = hcode;
+	if (_khook_relocate(&e, &info) < 0) {
+		return (_khook_fail());
+	}
+
+	info.type = KHOOK_TYPE_DETOUR;
+	info.hsize = e.len;
+	info.arg = (long)target;
+	prev = *orig;
+	*orig = (uint8_t *)hcode + info.recoff[0];
+	if ((r = _khook_install(&info, hsize)) == 0) {
+		*orig = prev;
+	}
+	return (r);
+}
+
+
+/**
+ * Install a hook memoizing a pure function.
+ * The first <code>memo->nargs</code> arguments of every call are looked
+ * up in a cache of the calling thread: on a hit the cached result is
+ * returned straight to the caller and the function is not run; on a
+ * miss the function runs and its result is cached when it returns.<br>
+ * The function must be cdecl, take its arguments on the stack and
+ * return its result in EAX or EDX:EAX (not in ST0 nor in memory); its
+ * result must depend on the key arguments only.
+ * @param fn Address to hook;
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param memo Memo (<code>nargs</code> from 0 to
+ * <code>KHOOK_MEMO_MAXARGS</code>).
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error (see <code>khook()</code>) or if <code>nargs</code> is out of
+ * range.
+ * @see khook()
+ * @see khook_memo_flush()
+ */
+size_t
+khook_memo(void *fn, void *hcode, size_t *hsize, KHOOK_MEMO *memo)
+{
+	KHOOK_INFO info;
+	EMIT e;
+
+	if (*hsize < KHOOK_SIZEOF_MAXCODE || memo->nargs < 0 ||
+	    memo->nargs > KHOOK_MEMO_MAXARGS) {
+		return (_khook_fail());
+	}
+
+	emit_init(&e, arena_wptr(hcode), *hsize, hcode);
+	_khook_memo(&e, memo, emit_label(&e));
+	bzero(&info, sizeof(info));
+	info.fn = fn;
+	info.hcode = hcode;
+	if (_khook_relocate(&e, &info) < 0) {
+		return (_khook_fail());
+	}
+
+	info.type = KHOOK_TYPE_MEMO;
+	info.hsize = e.len;
+	info.arg = (long)memo;
+	return (_khook_install(&info, hsize));
+}
+
+
+/**
+ * Open a transaction.
+ * Until the transaction is closed by <code>khook_txn_commit()</code> or
+ * <code>khook_txn_rollback()</code>, the hooks installed by the calling
+ * thread (<code>khook()</code>, <code>khook_count()</code>...) are
+ * only prepared: their hooking code is generated and their instructions
+ * are validated but nothing is registered nor patched.
+ * @param txn Transaction.
+ * @return <code>0</code> on success; <code>-1</code> if a transaction
+ * is already open in the calling thread.
+ * @see khook_txn_commit()
+ * @see khook_txn_rollback()
+ */
+int
+khook_txn_begin(KHOOK_TXN *txn)
+{
+
+	if (_txn != NULL) {
+		return (-1);
+	}
+	bzero(txn, sizeof(KHOOK_TXN));
+	_txn = txn;
+	return (0);
+}
+
+
+/**
+ * Register all the hooks prepared by a transaction.
+ * @param txn Transaction.
+ * @return <code>0</code> on success; <code>-1</code> if one of them
+ * can't be registered (no hook is left registered).
+ */
+static int
+_khook_txn_register(KHOOK_TXN *txn)
+{
+	int i, j;
+
+	for (i = 0; i < txn->nhooks; i++) {
+		if (registry_add(&txn->hook[i]) == NULL) {
+			for (j = 0; j < i; j++) {
+				registry_del(txn->hook[j].fn);
+			}
+			return (-1);
 		}
-		pissiz += ins.size;
-		copied = disass_recode(dst, &ins, src);
-		if (copied == 0) {
-			/*
-			 * Unable to recode the fetched instruction.
-			 */
-			return (0);
+	}
+	return (0);
+}
+
+
+/**
+ * Move a stopped thread out of the bytes replaced by a hook.
+ * A thread about to execute one of the replaced instructions resumes
+ * at its re-encoded copy (or at the start of the hooking code if it is
+ * the first one).
+ * @param txn Transaction;
+ * @param ip Saved instruction pointer of the thread.
+ * @return <code>1</code> if the thread has been moved; <code>0</code>
+ * otherwise.
+ */
+static int
+_khook_fixup(const KHOOK_TXN *txn, uint32_t *ip)
+{
+	uint32_t nip;
+	int i;
+
+	for (i = 0; i < txn->nhooks; i++) {
+		nip = khook_fixup(&txn->hook[i], *ip);
+		if (nip != *ip) {
+			*ip = nip;
+			return (1);
 		}
-		totsiz -= copied;
-		dst += copied;
 	}
+	return (0);
+}
+
+
+/**
+ * Install all the hooks prepared by a transaction and close it.
+ * Either all the hooks are installed or none is: if preparing one of
+ * them failed or if one of them can't be registered or patched, the
+ * transaction is rolled back.
+ * @param txn Transaction.
+ * @return <code>0</code> on success; <code>-1</code> if the transaction
+ * was rolled back.
+ * @see khook_txn_begin()
+ * @see khook_txn_commit_stw()
+ */
+int
+khook_txn_commit(KHOOK_TXN *txn)
+{
+	int i;
 
 	/*
-	 * jmporig:
-	 *    jmp orig+d        ;Jump to the original code.
+	 * Register every hook first, so that nothing is patched if one
+	 * address has been hooked by another thread meanwhile.
 	 */
-	*dst = OPCODE_JMP32;
+	if (_txn != txn || txn->failed || _khook_txn_register(txn) < 0) {
+		khook_txn_rollback(txn);
+		return (-1);
+	}
+	if (_khook_txn_patch(txn) < 0) {
+		for (i = 0; i < txn->nhooks; i++) {
+			registry_del(txn->hook[i].fn);
+		}
+		khook_txn_rollback(txn);
+		return (-1);
+	}
 
-	*(uint32_t *)(dst + 1) =
-	    (uint32_t)INS_ABS2REL(dst + SIZEOF_JMP32, ((uint8_t *)fn) + pissiz);
+	_txn = NULL;
+	free(txn->hook);
+	bzero(txn, sizeof(KHOOK_TXN));
+	return (0);
+}
 
-	dst += SIZEOF_JMP32;
 
-	/*
-	 * Size of the generated code.
-	 */
-	gensiz = (dst - (uint8_t *)hcode);
-	*hsize -= gensiz;
+/**
+ * Install all the hooks prepared by a transaction while all the other
+ * threads are stopped, and close the transaction.
+ * Every other thread of the process is stopped by a signal before
+ * patching; a thread stopped on one of the replaced instructions is
+ * moved to the hooking code, so it never resumes in the middle of the
+ * new jump. Threads with a return address within the replaced bytes
+ * are not fixed.<br>
+ * Only Linux is supported.
+ * @param txn Transaction;
+ * @param stw If not <code>NULL</code> it is filled with the duration of
+ * the pause and the number of stopped and moved threads.
+ * @return <code>0</code> on success; <code>-1</code> if the transaction
+ * was rolled back (see <code>khook_txn_commit()</code>) or if the
+ * threads can't be stopped.
+ * @see khook_txn_commit()
+ */
+int
+khook_txn_commit_stw(KHOOK_TXN *txn, KHOOK_STW *stw)
+{
+	struct timespec t0, t1;
+	uint32_t *ip;
+	int i, n, moved;
 
 	/*
-	 * Replace the original instructions with a jump to hcode.
+	 * Register before stopping: a stopped thread could hold the
+	 * allocator's lock.
 	 */
-	dst = (uint8_t *)fn;
+	if (_txn != txn || txn->failed || _khook_txn_register(txn) < 0) {
+		khook_txn_rollback(txn);
+		return (-1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	n = stw_stop();
+	if (n < 0) {
+		for (i = 0; i < txn->nhooks; i++) {
+			registry_del(txn->hook[i].fn);
+		}
+		khook_txn_rollback(txn);
+		return (-1);
+	}
+	if (_khook_txn_patch(txn) < 0) {
+		stw_resume();
+		for (i = 0; i < txn->nhooks; i++) {
+			registry_del(txn->hook[i].fn);
+		}
+		khook_txn_rollback(txn);
+		return (-1);
+	}
+	moved = 0;
+	for (i = 0; i < n; i++) {
+		ip = stw_ip(i);
+		if (ip != NULL) {
+			moved += _khook_fixup(txn, ip);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stw_resume();
+
+	if (stw != NULL) {
+		stw->pause = (t1.tv_sec - t0.tv_sec) * 1000000000L +
+		    t1.tv_nsec - t0.tv_nsec;
+		stw->threads = n;
+		stw->moved = moved;
+	}
+
+	_txn = NULL;
+	free(txn->hook);
+	bzero(txn, sizeof(KHOOK_TXN));
+	return (0);
+}
+
+
+/**
+ * Drop all the hooks prepared by a transaction and close it.
+ * Nothing has been patched, so the hooking code buffers used by the
+ * transaction can be reused.
+ * @param txn Transaction.
+ * @see khook_txn_begin()
+ */
+void
+khook_txn_rollback(KHOOK_TXN *txn)
+{
+
+	if (_txn == txn) {
+		_txn = NULL;
+	}
+	free(txn->hook);
+	bzero(txn, sizeof(KHOOK_TXN));
+}
+
+
+/**
+ * Generate the code of a counting hook that runs in another address
+ * space (for instance another process).
+ * Nothing is registered nor patched: the caller copies the generated
+ * code to <code>info->hcode</code> and the jump to it (see
+ * <code>khook_patch_gen()</code>) to <code>info->fn</code>.
+ * @param info Hook record: <code>fn</code> and <code>hcode</code> are
+ * the addresses in the other address space, the other fields are
+ * filled;
+ * @param buf Local buffer for the hooking code;
+ * @param bsize Available size in <code>buf</code>; on success it is
+ * decremented by the size of the generated code;
+ * @param code Copy of the first <code>KHOOK_SIZEOF_MAXPATCH</code>
+ * bytes at <code>info->fn</code>;
+ * @param counter Address of the counter in the other address space;
+ * @param peek Reader of the other address space;
+ * @param ctx Argument of <code>peek</code>.
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error.
+ * @see khook_count()
+ */
+size_t
+khook_count_gen(KHOOK_INFO *info, uint8_t *buf, size_t *bsize,
+    const uint8_t *code, KHOOK_COUNTER *counter, KHOOK_PEEK peek, void *ctx)
+{
+	EMIT e;
+
+	if (*bsize < KHOOK_SIZEOF_MAXCODE) {
+		return (0);
+	}
+
+	emit_init(&e, buf, *bsize, info->hcode);
+	_khook_count(&e, counter);
+	if (_khook_relocate_at(&e, info, code, code + KHOOK_SIZEOF_MAXPATCH,
+	    peek, ctx) < 0 || emit_end(&e) == 0) {
+		return (0);
+	}
+
+	info->type = KHOOK_TYPE_COUNT;
+	info->hsize = e.len;
+	info->arg = (long)counter;
+	info->callback = NULL;
+	memcpy(info->orig, code, info->size);
+	*bsize -= info->hsize;
+	return (info->hsize);
+}
+
+
+/**
+ * Generate the jump patched at a hooked address.
+ * It jumps to the hooking code (to the target for detours).
+ * @param info Hook record;
+ * @param dst Destination buffer (<code>SIZEOF_JMP32</code> bytes).
+ * @return The number of bytes to write at <code>info->fn</code>.
+ * @see khook_count_gen()
+ */
+size_t
+khook_patch_gen(const KHOOK_INFO *info, uint8_t *dst)
+{
+
 	*dst = OPCODE_JMP32;
-	*(uint32_t *)(dst + 1) =
-	    (uint32_t)INS_ABS2REL(dst + SIZEOF_JMP32, hcode);
+	*(uint32_t *)(dst + 1) = (uint32_t)INS_ABS2REL(
+	    (uint8_t *)info->fn + SIZEOF_JMP32,
+	    info->type == KHOOK_TYPE_DETOUR ? (void *)info->arg : info->hcode);
+	return (SIZEOF_JMP32);
+}
 
-	return (gensiz);
 
+/**
+ * Move a thread out of the bytes replaced by a hook.
+ * A thread about to execute one of the replaced instructions is moved
+ * to its re-encoded copy (or to the start of the hooking code if it is
+ * the first one).
+ * @param info Hook record;
+ * @param ip Instruction pointer of the thread.
+ * @return The new instruction pointer (<code>ip</code> if the thread is
+ * not within the replaced bytes).
+ */
+uint32_t
+khook_fixup(const KHOOK_INFO *info, uint32_t ip)
+{
+	uint32_t off;
+	int k;
+
+	off = ip - (uint32_t)(uintptr_t)info->fn;
+	if (off >= info->size) {
+		return (ip);
+	}
+	for (k = 0; k < info->nins; k++) {
+		if (info->insoff[k] == off) {
+			return ((uint32_t)(uintptr_t)info->hcode +
+			    (k == 0 ? 0 : info->recoff[k]));
+		}
+	}
+	return (ip);
 }
 
+
+/**
+ * Re-encode the instructions that a hook would replace.
+ * The code is analyzed as <code>khook()</code> does but nothing is
+ * patched: <code>buf</code> receives the re-encoded instructions
+ * followed by the jump back to the original code.
+ * @param info Hook record: <code>fn</code> is the address of the code
+ * and <code>hcode</code> the address where <code>buf</code> would be
+ * executed; the number of bytes replaced and the offsets of the
+ * instructions are filled;
+ * @param buf Destination buffer (<code>KHOOK_SIZEOF_MAXRECODED + 5</code>
+ * bytes);
+ * @param code Copy of the code at <code>info->fn</code> (it may be the
+ * code itself);
+ * @param end End of <code>code</code>: no byte at or past it is read;
+ * @param peek Reader of the targets of the calls;
+ * @param ctx Argument of <code>peek</code>.
+ * @return The number of bytes generated into <code>buf</code>;
+ * <code>KHOOK_EUNDEF</code> if an instruction is not recognized,
+ * <code>KHOOK_ETRUNC</code> if it is truncated by <code>end</code>,
+ * <code>KHOOK_ERELOC</code> if it can't be re-encoded.
+ * @see khook_count_gen()
+ */
+int
+khook_relocate_gen(KHOOK_INFO *info, uint8_t *buf, const uint8_t *code,
+    const uint8_t *end, KHOOK_PEEK peek, void *ctx)
+{
+	EMIT e;
+	int r;
+
+	emit_init(&e, buf, KHOOK_SIZEOF_MAXRECODED + SIZEOF_JMP32,
+	    info->hcode);
+	r = _khook_relocate_at(&e, info, code, end, peek, ctx);
+	if (r < 0) {
+		return (r);
+	}
+	if (emit_end(&e) == 0) {
+		return (KHOOK_ERELOC);
+	}
+	return (e.len);
+}
@@ -29,6 +29,9 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define KHOOK_VERSION	1.0.0
 
@@ -58,19 +61,384 @@ typedef struct _ins INS;
 
 
 /**
- * Maximum size of the hooking code.
+ * Max. number of bytes generated ahead of the recoded instructions
+ * (callback call, counter increment, register save...).
  */
-#define KHOOK_SIZEOF_MAXCODE		(KHOOK_OFFSET_RECODED + \
-					KHOOK_SIZEOF_MAXRECODED + \
-					SIZEOF_JMP32)
+#define KHOOK_SIZEOF_MAXPREAMBLE	32
+
+
+/**
+ * Maximum size of the hooking code (preamble, recoded instructions
+ * and a <code>jmp rel32</code> back to the original code).
+ */
+#define KHOOK_SIZEOF_MAXCODE		(KHOOK_SIZEOF_MAXPREAMBLE + \
+					KHOOK_SIZEOF_MAXRECODED + 5)
+
+/**
+ * Max. number of bytes replaced at the hooked address.
+ * A <code>jmp rel32</code> uses 5 bytes and it can end in the first byte
+ * of an instruction up to 15 bytes long: 4 + 15 = 19 bytes.
+ */
+#define KHOOK_SIZEOF_MAXPATCH		20
+
+/**
+ * Max. number of instructions replaced at the hooked address
+ * (all of them 1 byte long but the last one).
+ */
+#define KHOOK_MAXINS			5
+
+
+/*
+ * Predicate operators.
+ * Signed comparisons unless stated otherwise.
+ */
+#define KHOOK_PRED_EQ	0	/**< arg == value			*/
+#define KHOOK_PRED_NE	1	/**< arg != value			*/
+#define KHOOK_PRED_LT	2	/**< arg < value			*/
+#define KHOOK_PRED_LE	3	/**< arg <= value			*/
+#define KHOOK_PRED_GT	4	/**< arg > value			*/
+#define KHOOK_PRED_GE	5	/**< arg >= value			*/
+#define KHOOK_PRED_LTU	6	/**< arg < value (unsigned)		*/
+#define KHOOK_PRED_LEU	7	/**< arg <= value (unsigned)		*/
+#define KHOOK_PRED_GTU	8	/**< arg > value (unsigned)		*/
+#define KHOOK_PRED_GEU	9	/**< arg >= value (unsigned)		*/
+#define KHOOK_PRED_AND	10	/**< (arg & value) != 0			*/
+#define KHOOK_PRED_MAX	11	/**< Number of operators		*/
+
+
+/**
+ * Argument predicate.
+ * @see khook_pred()
+ */
+typedef struct _khook_pred {
+	int	 argn;		/**< Argument index (0 is the first one)	*/
+	int	 op;		/**< Operator (KHOOK_PRED_*)		*/
+	long	 value;		/**< Constant operand			*/
+} KHOOK_PRED;
+
+
+/**
+ * Cache line size.
+ */
+#define KHOOK_SIZEOF_CACHELINE		64
+
+/**
+ * Number of shards of a call counter (power of 2).
+ */
+#define KHOOK_COUNT_SHARDS		32
+
+
+/**
+ * Call counter.
+ * Every shard sits in its own cache line; the shard updated by a call
+ * is selected from the caller's stack page, so that concurrent threads
+ * seldom update the same one.
+ * @see khook_count()
+ * @see khook_count_get()
+ */
+typedef struct _khook_counter {
+	struct {
+		uint64_t n;				/**< Calls	*/
+		uint8_t	 pad[KHOOK_SIZEOF_CACHELINE - sizeof(uint64_t)];
+	} shard[KHOOK_COUNT_SHARDS];
+} __attribute__((aligned(KHOOK_SIZEOF_CACHELINE))) KHOOK_COUNTER;
+
+
+/**
+ * log2 of the number of slots of a caller table shard.
+ */
+#define KHOOK_CALLERS_BITS		8
+
+/**
+ * Number of shards of a caller table (power of 2).
+ */
+#define KHOOK_CALLERS_SHARDS		8
+
+
+/**
+ * Calls from a call site.
+ * @see khook_callers_snapshot()
+ */
+typedef struct _khook_caller {
+	const void *ra;				/**< Return address	*/
+	uint64_t    calls;			/**< Calls		*/
+	uint64_t    cycles;			/**< Time stamp cycles	*/
+} __attribute__((aligned(8))) KHOOK_CALLER;
+
+
+/**
+ * Caller table.
+ * Every shard is a lock-free hash table of call sites; the shard
+ * updated by a call is selected from the caller's stack page.
+ * @see khook_callers()
+ */
+typedef struct _khook_callers {
+	KHOOK_CALLER slot[KHOOK_CALLERS_SHARDS][1 << KHOOK_CALLERS_BITS];
+	uint64_t     dropped;			/**< Calls not recorded	*/
+	uint32_t     rate;			/**< Time 1 call out of rate */
+} KHOOK_CALLERS;
+
+
+/**
+ * Max. number of arguments in the key of a memoized call.
+ */
+#define KHOOK_MEMO_MAXARGS		4
+
+/**
+ * log2 of the number of entries of the per-thread result cache.
+ */
+#define KHOOK_MEMO_BITS			8
+
+
+/**
+ * Memo of a pure function.
+ * The results are cached per thread (shared by all the memos),
+ * keyed by the memo and the first <code>nargs</code> arguments.
+ * @see khook_memo()
+ */
+typedef struct _khook_memo {
+	int	 nargs;				/**< Arguments in the key */
+	uint32_t gen;				/**< Generation		*/
+} KHOOK_MEMO;
+
+
+/**
+ * Registers at a probe point.
+ * The layout is the one left on the stack by
+ * <code>pushfd; pushad</code>: the callback can change any of them
+ * but <code>esp</code>, the new values are restored when it returns.
+ * @see khook_probe()
+ */
+typedef struct _khook_regs {
+	uint32_t edi;
+	uint32_t esi;
+	uint32_t ebp;
+	uint32_t esp;		/**< Read-only			*/
+	uint32_t ebx;
+	uint32_t edx;
+	uint32_t ecx;
+	uint32_t eax;
+	uint32_t eflags;
+} KHOOK_REGS;
+
+
+/*
+ * Hook types.
+ */
+#define KHOOK_TYPE_CALL		0	/**< Calls a callback (khook())	*/
+#define KHOOK_TYPE_COUNT	1	/**< Counts calls (khook_count()) */
+#define KHOOK_TYPE_PROBE	2	/**< Probe point (khook_probe())	*/
+#define KHOOK_TYPE_CALLERS	3	/**< Call sites (khook_callers())	*/
+#define KHOOK_TYPE_DETOUR	4	/**< Replacement (khook_detour())	*/
+#define KHOOK_TYPE_MEMO		5	/**< Memoization (khook_memo())	*/
+
+
+/*
+ * Errors of khook_relocate_gen().
+ */
+#define KHOOK_EUNDEF		-1	/**< Instruction not recognized	*/
+#define KHOOK_ETRUNC		-2	/**< Instruction truncated	*/
+#define KHOOK_ERELOC		-3	/**< Instruction not re-encodable */
+
+
+/**
+ * Installed hook.
+ * For counting hooks <code>arg</code> is the address of the counter
+ * and <code>callback</code> is <code>NULL</code> (caller tables and
+ * memos are recorded the same way) and for detours the target; for probe points
+ * <code>callback</code> takes a <code>KHOOK_REGS *</code>.
+ * @see khook_lookup()
+ */
+typedef struct _khook_info {
+	int	 type;				/**< KHOOK_TYPE_*	*/
+	void	*fn;				/**< Hooked address	*/
+	void	*hcode;				/**< Hooking code	*/
+	size_t	 hsize;				/**< Hooking code size	*/
+	size_t	 size;				/**< Replaced bytes	*/
+	long	 arg;				/**< Callback argument	*/
+	void	(*callback)(long, long, ...);	/**< Callback		*/
+	uint8_t	 orig[KHOOK_SIZEOF_MAXPATCH];	/**< Original code	*/
+	int	 nins;				/**< Replaced instructions */
+	uint8_t	 insoff[KHOOK_MAXINS];		/**< Their offsets at fn */
+	uint8_t	 recoff[KHOOK_MAXINS];		/**< Offsets in hcode	*/
+} KHOOK_INFO;
+
+
+/**
+ * Transaction.
+ * @see khook_txn_begin()
+ */
+typedef struct _khook_txn {
+	KHOOK_INFO *hook;			/**< Prepared hooks	*/
+	int	    nhooks;			/**< No. of hooks	*/
+	int	    maxhooks;			/**< Allocated hooks	*/
+	int	    failed;			/**< A hook failed	*/
+} KHOOK_TXN;
+
+
+/**
+ * Size of the pages backing a trampoline arena.
+ */
+#define KHOOK_SIZEOF_HUGEPAGE	(2 * 1024 * 1024)
+
+/**
+ * Trampoline arena: executable memory for the hooking code.
+ * The hooks are installed passing <code>hcode</code> and
+ * <code>&hsize</code> (<code>hcode</code> is advanced by the caller).
+ * @see khook_arena_init()
+ */
+typedef struct _khook_arena {
+	uint8_t	*base;			/**< Arena			*/
+	uint8_t	*wbase;			/**< Writable view (W^X arenas)	*/
+	size_t	 size;			/**< Arena size			*/
+	uint8_t	*hcode;			/**< First free byte		*/
+	size_t	 hsize;			/**< Free bytes			*/
+	int	 huge;			/**< Backed by huge pages	*/
+} KHOOK_ARENA;
+
+
+/**
+ * Pause of a stop-the-world commit.
+ * @see khook_txn_commit_stw()
+ */
+typedef struct _khook_stw {
+	long	 pause;			/**< Threads stopped for (ns)	*/
+	int	 threads;		/**< Stopped threads		*/
+	int	 moved;			/**< Threads moved to a hook	*/
+} KHOOK_STW;
+
+
+/**
+ * Reader of another address space.
+ * It copies <code>len</code> bytes from <code>addr</code> (in the other
+ * address space) to <code>dst</code> and returns <code>0</code> on
+ * success, <code>-1</code> on error.
+ * @see khook_count_gen()
+ */
+typedef int (*KHOOK_PEEK)(void *ctx, void *dst, const void *addr,
+    size_t len);
+
+
+/*
+ * Export formats.
+ */
+#define KHOOK_EXPORT_FOLDED	0	/**< Folded stacks, weighted by calls */
+#define KHOOK_EXPORT_CYCLES	1	/**< Folded stacks, weighted by cycles */
+#define KHOOK_EXPORT_PPROF	2	/**< pprof protobuf (uncompressed) */
+#define KHOOK_EXPORT_CHROME	3	/**< Chrome/Perfetto trace JSON	*/
+
+
+/**
+ * Size of the output buffer of an exporter.
+ */
+#define KHOOK_SIZEOF_EXPORTBUF	4096
+
+/**
+ * Number of pprof locations remembered by an exporter (power of 2).
+ */
+#define KHOOK_EXPORT_LOCS	64
+
+
+/**
+ * Symbolizer.
+ * It stores in <code>buf</code> (<code>len</code> bytes long) the name
+ * of the function containing <code>addr</code> and returns <code>0</code>,
+ * or returns <code>-1</code> if the address is unknown.
+ * @see khook_export_begin()
+ */
+typedef int (*KHOOK_SYM)(void *ctx, const void *addr, char *buf,
+    size_t len);
+
+
+/**
+ * Trace event: a call recorded by a hook.
+ * @see khook_export_event()
+ */
+typedef struct _khook_event {
+	uint64_t    tsc;			/**< Time stamp cycles	*/
+	const void *ra;				/**< Return address	*/
+	long	    arg;			/**< First argument	*/
+	long	    tid;			/**< Thread id		*/
+} KHOOK_EVENT;
+
+
+/**
+ * Profile exporter.
+ * The records are encoded as they are passed and written to
+ * <code>fd</code> every <code>KHOOK_SIZEOF_EXPORTBUF</code> bytes, so
+ * the memory used does not depend on the size of the profile; pprof
+ * locations are reused only while they are in a small cache.
+ * @see khook_export_begin()
+ */
+typedef struct _khook_export {
+	int	 fd;				/**< Output		*/
+	int	 format;			/**< KHOOK_EXPORT_*	*/
+	int	 error;				/**< A write failed	*/
+	uint64_t hz;				/**< Cycles per second	*/
+	KHOOK_SYM sym;				/**< Symbolizer or NULL	*/
+	void	*symctx;			/**< Its context	*/
+	uint64_t nrec;				/**< Records written	*/
+	uint64_t nstr;				/**< pprof strings	*/
+	uint64_t nid;				/**< pprof ids		*/
+	const void *locaddr[KHOOK_EXPORT_LOCS];	/**< Recent locations	*/
+	uint64_t locid[KHOOK_EXPORT_LOCS];	/**< Their ids		*/
+	size_t	 len;				/**< Buffered bytes	*/
+	uint8_t	 buf[KHOOK_SIZEOF_EXPORTBUF];	/**< Output buffer	*/
+} KHOOK_EXPORT;
+
 
 /*
  * Prototypes.
  */
 int	disass_fetch(INS *, uint8_t **);
+int	disass_fetch_end(INS *, uint8_t **, const uint8_t *);
 int	disass_put(uint8_t *, const INS *);
 int	disass_recode(uint8_t *, const INS *, const uint8_t *);
+int	disass_recode_at(uint8_t *, const uint8_t *, const INS *,
+	    const uint8_t *, const uint8_t *);
+const uint8_t *disass_target(const INS *, const uint8_t *);
+int	disass_isterm(const INS *);
 size_t	khook(void *, void *, size_t *, long, void (*)(long, long, ...));
+size_t	khook_pred(void *, void *, size_t *, long, void (*)(long, long, ...),
+	    const KHOOK_PRED *);
+size_t	khook_count(void *, void *, size_t *, KHOOK_COUNTER *);
+uint64_t khook_count_get(const KHOOK_COUNTER *);
+size_t	khook_probe(void *, void *, size_t *, long,
+	    void (*)(long, KHOOK_REGS *));
+size_t	khook_callers(void *, void *, size_t *, KHOOK_CALLERS *);
+size_t	khook_detour(void *, void *, size_t *, void *, void **);
+size_t	khook_memo(void *, void *, size_t *, KHOOK_MEMO *);
+void	khook_memo_flush(KHOOK_MEMO *);
+size_t	khook_callers_snapshot(const KHOOK_CALLERS *, KHOOK_CALLER *, size_t);
+int	khook_txn_begin(KHOOK_TXN *);
+int	khook_txn_commit(KHOOK_TXN *);
+int	khook_txn_commit_stw(KHOOK_TXN *, KHOOK_STW *);
+int	khook_arena_init(KHOOK_ARENA *, size_t);
+int	khook_arena_init_wx(KHOOK_ARENA *, size_t);
+int	khook_arena_repack(KHOOK_ARENA *, void *const *, const uint64_t *, int,
+	    KHOOK_STW *);
+size_t	khook_count_gen(KHOOK_INFO *, uint8_t *, size_t *, const uint8_t *,
+	    KHOOK_COUNTER *, KHOOK_PEEK, void *);
+size_t	khook_patch_gen(const KHOOK_INFO *, uint8_t *);
+uint32_t khook_fixup(const KHOOK_INFO *, uint32_t);
+int	khook_relocate_gen(KHOOK_INFO *, uint8_t *, const uint8_t *,
+	    const uint8_t *, KHOOK_PEEK, void *);
+void	khook_txn_rollback(KHOOK_TXN *);
+const KHOOK_INFO *khook_lookup(const void *);
+int	khook_export_format(const char *);
+int	khook_export_begin(KHOOK_EXPORT *, int, int, uint64_t, KHOOK_SYM,
+	    void *);
+int	khook_export_count(KHOOK_EXPORT *, const char *, const void *,
+	    uint64_t);
+int	khook_export_callers(KHOOK_EXPORT *, const char *, const void *,
+	    const KHOOK_CALLER *, size_t);
+int	khook_export_event(KHOOK_EXPORT *, const char *, const void *,
+	    const KHOOK_EVENT *);
+int	khook_export_end(KHOOK_EXPORT *);
+
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif	/* __KHOOK_H__ */
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __KHOOK_HPP__
+#define __KHOOK_HPP__
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <stdint.h>
+
+/*
+ * The C API is declared within the namespace, as khook::c: the function
+ * khook() would clash with it (khook.h must not be included before).
+ */
+namespace khook {
+namespace c {
+#include "khook.h"
+}	/* namespace c */
+}	/* namespace khook */
+
+
+namespace khook {
+
+using namespace c;
+
+/**
+ * Size of the arena used by the hooks installed without one.
+ */
+static const size_t SIZEOF_ARENA = 256 * KHOOK_SIZEOF_MAXCODE;
+
+
+namespace detail {
+
+/**
+ * Detour of <code>Fn</code> calling a callback of type <code>F</code>.
+ * There is one for every hooked function and callback type: the thunk
+ * has the type of the hooked function, so the arguments arrive with
+ * the native ABI and the callback can be inlined into it.
+ * Only non variadic functions with the default calling convention are
+ * supported.
+ */
+template <auto Fn, class F, class R, class... A>
+struct detour {
+	typedef R (*orig_t)(A...);
+
+	static inline orig_t orig;		/**< Original function	*/
+	alignas(F) static inline unsigned char cb[sizeof(F)]; /**< Callback */
+
+	/**
+	 * Replacement of <code>Fn</code>.
+	 * @param a Arguments.
+	 * @return The value returned by the callback.
+	 */
+	static R
+	call(A... a)
+	{
+
+		return ((*std::launder(reinterpret_cast<F *>(cb)))(orig,
+		    std::forward<A>(a)...));
+	}
+};
+
+/*
+ * Detour type of a function (declarations only, see decltype()).
+ */
+template <auto Fn, class F, class R, class... A>
+detour<Fn, F, R, A...> detour_of(R (*)(A...));
+template <auto Fn, class F, class R, class... A>
+detour<Fn, F, R, A...> detour_of(R (*)(A...) noexcept);
+
+
+/**
+ * Change the protection of the pages patched by a hook.
+ * @param fn Hooked address;
+ * @param prot Protection.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+inline int
+protect(const void *fn, int prot)
+{
+	uintptr_t start, end, pgsiz;
+
+	pgsiz = (uintptr_t)sysconf(_SC_PAGESIZE);
+	start = (uintptr_t)fn & ~(pgsiz - 1);
+	end = ((uintptr_t)fn + KHOOK_SIZEOF_MAXPATCH + pgsiz - 1) &
+	    ~(pgsiz - 1);
+	return (mprotect((void *)start, end - start, prot));
+}
+
+}	/* namespace detail */
+
+
+/**
+ * Default arena.
+ * It is W^X where available, so that the hooked functions are
+ * patched without changing their protection.
+ * @return The arena; <code>NULL</code> if it can't be allocated.
+ */
+inline KHOOK_ARENA *
+arena()
+{
+	static KHOOK_ARENA a;
+	static bool ok = khook_arena_init_wx(&a, SIZEOF_ARENA) == 0 ||
+	    khook_arena_init(&a, SIZEOF_ARENA) == 0;
+
+	return (ok ? &a : nullptr);
+}
+
+
+/**
+ * Hook a function with a typed callback.
+ * Every call of <code>Fn</code> calls <code>f(orig, args...)</code>,
+ * where <code>orig</code> is a pointer to the original function (of the
+ * same type as <code>Fn</code>) and <code>args</code> are the arguments
+ * of the call; the value returned by <code>f</code> is returned to the
+ * caller:
+ * <pre>
+ *   khook::hook<&malloc>(hcode, &hsize, [](auto orig, size_t n) {
+ *           return (n == 0 ? nullptr : orig(n));
+ *   });
+ * </pre>
+ * A function can be hooked once (see <code>khook_detour()</code>).
+ * @param hcode Destination address for the <i>hooking code</i>;
+ * @param hsize Available size in the <code>hcode</code> buffer;
+ * @param f Callback (copied).
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error.
+ */
+template <auto Fn, class F>
+size_t
+hook(void *hcode, size_t *hsize, F f)
+{
+	typedef decltype(detail::detour_of<Fn, F>(Fn)) D;
+
+	new (D::cb) F(std::move(f));
+	return (khook_detour(reinterpret_cast<void *>(Fn), hcode, hsize,
+	    reinterpret_cast<void *>(&D::call),
+	    reinterpret_cast<void **>(&D::orig)));
+}
+
+
+/**
+ * Hook a function with a typed callback, taking the hooking code from
+ * an arena.
+ * The pages of <code>Fn</code> are made writable while it is patched
+ * unless the arena is W^X.
+ * @param a Arena (<code>a.hcode</code> and <code>a.hsize</code> are
+ * advanced);
+ * @param f Callback.
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error.
+ */
+template <auto Fn, class F>
+size_t
+hook(KHOOK_ARENA &a, F f)
+{
+	size_t r;
+
+	if (a.wbase == nullptr && detail::protect(
+	    reinterpret_cast<void *>(Fn), PROT_READ | PROT_WRITE | PROT_EXEC) <
+	    0) {
+		return (0);
+	}
+	r = hook<Fn>(a.hcode, &a.hsize, std::move(f));
+	if (a.wbase == nullptr) {
+		detail::protect(reinterpret_cast<void *>(Fn),
+		    PROT_READ | PROT_EXEC);
+	}
+	a.hcode += r;
+	return (r);
+}
+
+
+/**
+ * Hook a function with a typed callback, taking the hooking code from
+ * the default arena.
+ * @param f Callback.
+ * @return On success the size of the hooking code; <code>0</code> on
+ * error.
+ * @see arena()
+ */
+template <auto Fn, class F>
+size_t
+hook(F f)
+{
+	KHOOK_ARENA *a;
+
+	if ((a = arena()) == nullptr) {
+		return (0);
+	}
+	return (hook<Fn>(*a, std::move(f)));
+}
+
+}	/* namespace khook */
+
+
+#endif	/* __KHOOK_HPP__ */
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "khook.h"
+#include "memo.h"
+#include "shadow.h"
+
+
+/**
+ * Max. number of nested memoized calls per thread.
+ */
+#define MEMO_DEPTH	64
+
+
+/**
+ * Cached result.
+ * An entry is valid while <code>memo</code> is set and <code>gen</code>
+ * is the generation of the memo.
+ */
+typedef struct _entry {
+	KHOOK_MEMO	*memo;			/**< Memo			*/
+	uint32_t	 gen;			/**< Generation			*/
+	long		 arg[KHOOK_MEMO_MAXARGS]; /**< Key			*/
+	uint64_t	 value;			/**< EDX:EAX			*/
+} ENTRY;
+
+
+/**
+ * Memoized call waiting for its result.
+ */
+typedef struct _call {
+	SHADOW		 s;			/**< Shadow stack entry		*/
+	KHOOK_MEMO	*memo;			/**< Memo			*/
+	uint32_t	 gen;			/**< Generation at the call	*/
+	long		 arg[KHOOK_MEMO_MAXARGS]; /**< Key			*/
+} CALL;
+
+
+static __thread ENTRY _cache[1 << KHOOK_MEMO_BITS];
+static __thread CALL _shadow[MEMO_DEPTH];
+static __thread int _depth;
+
+
+/*
+ * Return trampoline.
+ * The return address of a call that missed the cache is replaced with
+ * memo_ret: it passes the return value (EDX:EAX) to memo_exit(), then
+ * restores it and jumps to the original return address.
+ *
+ *    push eax                ;Slot for the original return address
+ *    push eax
+ *    push edx
+ *    lea  ecx, [esp + 12]    ;ESP at the return
+ *    push ecx
+ *    call memo_exit
+ *    add  esp, 4
+ *    mov  [esp + 8], eax
+ *    pop  edx
+ *    pop  eax
+ *    ret
+ */
+__asm__(
+	"	.text\n"
+	"	.globl	memo_ret\n"
+	"	.hidden	memo_ret\n"
+	"	.type	memo_ret, @function\n"
+	"memo_ret:\n"
+	"	pushl	%eax\n"
+	"	pushl	%eax\n"
+	"	pushl	%edx\n"
+	"	leal	12(%esp), %ecx\n"
+	"	pushl	%ecx\n"
+	"	call	memo_exit\n"
+	"	addl	$4, %esp\n"
+	"	movl	%eax, 8(%esp)\n"
+	"	popl	%edx\n"
+	"	popl	%eax\n"
+	"	ret\n"
+	"	.size	memo_ret, .-memo_ret\n"
+);
+
+
+/**
+ * Hash a key.
+ * @param memo Memo;
+ * @param arg Arguments.
+ * @return Cache index.
+ */
+static inline uint32_t
+_hash(const KHOOK_MEMO *memo, const long *arg)
+{
+	uint32_t h;
+	int i;
+
+	h = (uint32_t)(uintptr_t)memo;
+	for (i = 0; i < memo->nargs; i++) {
+		h = (h ^ (uint32_t)arg[i]) * 0x9E3779B1U;
+	}
+	return (h >> (32 - KHOOK_MEMO_BITS));
+}
+
+
+/**
+ * Compare the key of an entry.
+ * @param e Entry;
+ * @param memo Memo;
+ * @param gen Generation;
+ * @param arg Arguments.
+ * @return Non zero if the entry holds the result of the call.
+ */
+static inline int
+_match(const ENTRY *e, const KHOOK_MEMO *memo, uint32_t gen,
+    const long *arg)
+{
+
+	return (e->memo == memo && e->gen == gen &&
+	    memcmp(e->arg, arg, memo->nargs * sizeof(long)) == 0);
+}
+
+
+/**
+ * Look a call up in the cache of the calling thread.
+ * It is called by the hooking code on entry to the hooked function.
+ * On a miss the return of the call is intercepted, to store its result.
+ * @param memo Memo;
+ * @param ret Address of the return address (the arguments follow);
+ * @param value Receives the cached result.
+ * @return Non zero on a hit (the hooking code returns
+ * <code>value</code> without running the function); <code>0</code> on
+ * a miss.
+ */
+int
+memo_enter(KHOOK_MEMO *memo, void **ret, uint64_t *value)
+{
+	const long *arg;
+	uint32_t gen;
+	ENTRY *e;
+	CALL *c;
+	int i;
+
+	arg = (const long *)(ret + 1);
+	gen = __atomic_load_n(&memo->gen, __ATOMIC_RELAXED);
+	e = &_cache[_hash(memo, arg)];
+	if (_match(e, memo, gen, arg)) {
+		*value = e->value;
+
+		/*
+		 * A signal handler may have replaced the entry meanwhile.
+		 */
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		if (_match(e, memo, gen, arg)) {
+			return (1);
+		}
+	}
+
+	_depth = shadow_trim(_shadow, sizeof(CALL), _depth, (uintptr_t)ret);
+	if (*ret == (void *)memo_ret) {
+		/*
+		 * Tail call from a missed call: its return is intercepted
+		 * already and stores this result as its own. Run the call
+		 * without caching it under this memo.
+		 */
+		return (0);
+	}
+	i = shadow_find(_shadow, sizeof(CALL), _depth, (uintptr_t)ret);
+	if (i >= 0) {
+		/*
+		 * Stale: the return address has been overwritten.
+		 */
+		_depth = shadow_drop(_shadow, sizeof(CALL), _depth, i);
+	}
+	if (_depth == MEMO_DEPTH) {
+		/*
+		 * Too deep: run the call without caching its result.
+		 */
+		return (0);
+	}
+
+	c = &_shadow[_depth];
+	c->s.sp = (uintptr_t)ret;
+	c->s.ret = *ret;
+	c->memo = memo;
+	c->gen = gen;
+	memcpy(c->arg, arg, memo->nargs * sizeof(long));
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	_depth++;
+	*ret = (void *)memo_ret;
+	return (0);
+}
+
+
+/**
+ * Store the result of a call in the cache.
+ * It is called by memo_ret.
+ * @param sp Value of ESP after the return;
+ * @param edx EDX at the return;
+ * @param eax EAX at the return.
+ * @return The original return address.
+ */
+void *
+memo_exit(uintptr_t sp, uint32_t edx, uint32_t eax)
+{
+	ENTRY *e;
+	CALL c;
+	int i;
+
+	sp -= sizeof(void *);
+	_depth = shadow_trim(_shadow, sizeof(CALL), _depth, sp);
+	i = shadow_find(_shadow, sizeof(CALL), _depth, sp);
+	if (i < 0) {
+		/*
+		 * The original return address is lost.
+		 */
+		abort();
+	}
+	c = _shadow[i];
+	_depth = shadow_drop(_shadow, sizeof(CALL), _depth, i);
+
+	/*
+	 * The entry is invalid while it is written: a signal handler
+	 * looking it up misses.
+	 */
+	e = &_cache[_hash(c.memo, c.arg)];
+	e->memo = NULL;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	e->gen = c.gen;
+	memcpy(e->arg, c.arg, c.memo->nargs * sizeof(long));
+	e->value = (uint64_t)edx << 32 | eax;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	e->memo = c.memo;
+	return (c.s.ret);
+}
+
+
+/**
+ * Invalidate the results cached for a memo.
+ * The entries of every thread become stale at once: they are
+ * replaced as they are looked up again. Calls in progress store
+ * stale results.
+ * @param memo Memo.
+ * @see khook_memo()
+ */
+void
+khook_memo_flush(KHOOK_MEMO *memo)
+{
+
+	__atomic_fetch_add(&memo->gen, 1, __ATOMIC_RELEASE);
+}
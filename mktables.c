@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Generate the packed decoding tables (tables.h) from the human
+ * readable opcode maps (opcodes.h).
+ * This program runs on the build host: ./mktables > tables.h
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "opcodes.h"
+#include "disass.h"
+
+
+/**
+ * Pack the flags of an opcode map element.
+ * @param flags Flags from one of the opcode maps.
+ * @return The packed entry.
+ * @see OPMAP_KIND()
+ * @see OPMAP_IMM()
+ */
+static uint16_t
+_pack(uint16_t flags)
+{
+	uint16_t e;
+	int size, ovr, kind;
+
+	/*
+	 * Immediate data size: normal and overridden.
+	 */
+	switch (flags & (_b | _w | _d | _q | _v | _p | _s | _A)) {
+	case _b:
+		size = ovr = 1;
+		break;
+	case _w:
+		size = ovr = 2;
+		break;
+	case _s:
+		size = ovr = 3;
+		break;
+	case _d:
+		size = ovr = 4;
+		break;
+	case _q:
+		size = ovr = 8;
+		break;
+	case _v:
+	case _A:
+		size = 4;
+		ovr = 2;
+		break;
+	case _p:
+		size = 6;
+		ovr = 4;
+		break;
+	default:
+		size = ovr = 0;
+	}
+
+	if (flags & _U) {
+		kind = OPMAP_KIND_UNDEF;
+	} else if (flags & _P) {
+		kind = OPMAP_KIND_PREFIX;
+	} else if (flags & _E) {
+		kind = OPMAP_KIND_ESCAPE;
+	} else if (flags & _C) {
+		kind = OPMAP_KIND_COPRO;
+	} else if (flags & _X) {
+		kind = OPMAP_KIND_VEX;
+	} else {
+		kind = OPMAP_KIND_INS;
+	}
+
+	e = (uint16_t)((ovr << 12) | (size << 8) | (kind << 2));
+	if (flags & _M) {
+		e |= OPMAP_MODRM;
+	}
+	if (flags & _R) {
+		e |= OPMAP_REL;
+	}
+	if (flags & _G) {
+		e |= OPMAP_IMMGROUP;
+	}
+	if (flags & _A) {
+		e |= OPMAP_IMMADDR;
+	}
+	return (e);
+}
+
+
+/**
+ * Generate the packed MODRM map entry.
+ * @param adsiz Non-zero for 16 bits addressing;
+ * @param modrm MODRM.
+ * @return The packed entry.
+ * @see MODRM_DISP()
+ */
+static uint8_t
+_modrm(int adsiz, uint8_t modrm)
+{
+	int mod, rm;
+
+	mod = modrm >> 6;
+	rm = modrm & 0x07;
+	if (mod == 3) {
+		return (0);
+	}
+	if (adsiz) {
+		/*
+		 *	00xxx110 -> 16 bits displacement
+		 *	01xxxxxx -> 8 bits displacement
+		 *	10xxxxxx -> 16 bits displacement
+		 */
+		if (mod == 0) {
+			return ((rm == 6) ? 2 : 0);
+		}
+		return ((mod == 1) ? 1 : 2);
+	}
+
+	/*
+	 *	00xxx101 -> 32 bits displacement
+	 *	01xxxxxx -> 8 bits displacement
+	 *	10xxxxxx -> 32 bits displacement
+	 *	xxxxx100 -> SIB (00xxx100 + SIB xxxxx101 -> 32 bits disp.)
+	 */
+	if (rm == 4) {
+		if (mod == 0) {
+			return (MODRM_SIB | MODRM_SIBDISP);
+		}
+		return (MODRM_SIB | ((mod == 1) ? 1 : 4));
+	}
+	if (mod == 0) {
+		return ((rm == 5) ? 4 : 0);
+	}
+	return ((mod == 1) ? 1 : 4);
+}
+
+
+/**
+ * Print a packed opcode map.
+ * @param name Name of the map;
+ * @param map Human readable map.
+ */
+static void
+_print_opmap(const char *name, const uint16_t *map)
+{
+	int i;
+
+	printf("static const uint16_t %s[256] = {", name);
+	for (i = 0; i < 256; i++) {
+		printf("%s0x%04x%s", (i % 8) ? " " : "\n\t", _pack(map[i]),
+		    (i < 255) ? "," : "\n");
+	}
+	printf("};\n\n");
+}
+
+
+int
+main(void)
+{
+	int i, j;
+
+	printf("/* Generated by mktables from opcodes.h. Do not edit. */\n"
+	    "#ifndef TABLES_H\n#define TABLES_H\n\n");
+
+	_print_opmap("opmap1", opcode1_map);
+	_print_opmap("opmap2", opcode2_map);
+	_print_opmap("opmap38", opcode3_38_map);
+	_print_opmap("opmap3a", opcode3_3a_map);
+
+	printf("static const uint8_t modrm_map[2][256] = {");
+	for (i = 0; i < 2; i++) {
+		printf("\n\t{");
+		for (j = 0; j < 256; j++) {
+			printf("%s0x%02x%s", (j % 8) ? " " : "\n\t",
+			    _modrm(i, (uint8_t)j), (j < 255) ? "," : "\n");
+		}
+		printf("\t}%s", i ? "\n" : ",");
+	}
+	printf("};\n\n");
+
+	printf("static const uint8_t copro_map[8][9] = {\n");
+	for (i = 0; i < 8; i++) {
+		printf("\t{ 0x%02x,", copro_mem_map[i]);
+		for (j = 0; j < 8; j++) {
+			printf(" 0x%02x%s", copro_reg_map[i][j],
+			    (j < 7) ? "," : " }");
+		}
+		printf("%s\n", (i < 7) ? "," : "");
+	}
+	printf("};\n\n#endif\t/* TABLES_H */\n");
+	return (0);
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * khook-heap: heap allocation profiler.
+ *
+ * malloc(), calloc(), realloc() and free() are detoured where they are
+ * defined, in the executable too (an allocator linked statically is
+ * profiled as well): every call is timed and accounted in a shard of
+ * the calling thread, by size class and by call site. The shards are
+ * merged when the report is written, at exit.
+ */
+#include <sys/types.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <khook.h>
+
+#include "module.h"
+
+
+/*
+ * Hooked functions.
+ */
+#define HEAP_MALLOC	0
+#define HEAP_CALLOC	1
+#define HEAP_REALLOC	2
+#define HEAP_FREE	3
+#define HEAP_NOPS	4
+
+/**
+ * Number of size classes: 0, then [2^(k-1), 2^k) for k = 1..32.
+ */
+#define HEAP_CLASSES	33
+
+/**
+ * Number of call sites reported for each function.
+ */
+#define HEAP_TOP	10
+
+
+/**
+ * Per-thread data.
+ */
+typedef struct _heap_shard {
+	MODULE_SHARD	 hdr;			/**< Shard header	*/
+	uint64_t	 calls[HEAP_NOPS];	/**< Calls		*/
+	uint64_t	 cycles[HEAP_NOPS];	/**< Cycles in the calls */
+	uint64_t	 overhead;		/**< Cycles accounting	*/
+	uint64_t	 size[HEAP_CLASSES];	/**< Allocations by size */
+	uint64_t	 allocated;		/**< Bytes allocated	*/
+	uint64_t	 freed;			/**< Bytes freed	*/
+	MODULE_SITES	 site[HEAP_NOPS];	/**< Calls by call site	*/
+} HEAP_SHARD;
+
+
+static const char *_name[HEAP_NOPS] = {
+	"malloc", "calloc", "realloc", "free"
+};
+
+static void	*(*_malloc)(size_t);
+static void	*(*_calloc)(size_t, size_t);
+static void	*(*_realloc)(void *, size_t);
+static void	 (*_free)(void *);
+static size_t	 (*_usable)(void *);
+static void	*_fn[HEAP_NOPS];
+
+static MODULE_SHARD *_shards;
+static HEAP_SHARD *_sum;
+
+static MODULE_TLS HEAP_SHARD *_shard;
+static MODULE_TLS int _busy;
+
+
+/**
+ * Get the size class of a size.
+ * @param size Size.
+ * @return Size class.
+ */
+static inline int
+_class(size_t size)
+{
+
+	return (size == 0 ? 0 : 32 - __builtin_clz((uint32_t)size));
+}
+
+
+/**
+ * Get the usable size of a block.
+ * @param p Block;
+ * @param size Requested size.
+ * @return The size (the requested one if it is unknown).
+ */
+static inline size_t
+_size(void *p, size_t size)
+{
+
+	return (p != NULL && _usable != NULL ? _usable(p) : size);
+}
+
+
+/**
+ * Account a call.
+ * The cycles spent by the detour out of the original function are
+ * accounted as overhead.
+ * @param op Function (<code>HEAP_*</code>);
+ * @param ra Return address;
+ * @param size Requested size (allocations only);
+ * @param alloc Bytes allocated;
+ * @param freed Bytes freed;
+ * @param te Time stamp at the entry of the detour;
+ * @param t0 Time stamp at the call of the original function;
+ * @param t1 Time stamp at its return.
+ */
+static void
+_account(int op, const void *ra, size_t size, size_t alloc, size_t freed,
+    uint64_t te, uint64_t t0, uint64_t t1)
+{
+	HEAP_SHARD *s;
+
+	if ((s = _shard) == NULL) {
+		s = module_shard(&_shards, sizeof(HEAP_SHARD));
+		if ((_shard = s) == NULL) {
+			return;
+		}
+	}
+	s->calls[op]++;
+	s->cycles[op] += t1 - t0;
+	if (op != HEAP_FREE) {
+		s->size[_class(size)]++;
+	}
+	s->allocated += alloc;
+	s->freed += freed;
+	module_site_add(&s->site[op], ra, t1 - t0, alloc);
+	s->overhead += module_tsc() - te - (t1 - t0);
+}
+
+
+/*
+ * Detours.
+ * The calls made by the allocator itself (calloc() calling malloc()...)
+ * run the original functions.
+ */
+
+static void *
+_heap_malloc(size_t size)
+{
+	uint64_t te, t0, t1;
+	void *p;
+
+	if (_busy) {
+		return (_malloc(size));
+	}
+	_busy = 1;
+	te = t0 = module_tsc();
+	p = _malloc(size);
+	t1 = module_tsc();
+	_account(HEAP_MALLOC, __builtin_return_address(0), size,
+	    p == NULL ? 0 : _size(p, size), 0, te, t0, t1);
+	_busy = 0;
+	return (p);
+}
+
+
+static void *
+_heap_calloc(size_t n, size_t size)
+{
+	uint64_t te, t0, t1;
+	void *p;
+
+	if (_busy) {
+		return (_calloc(n, size));
+	}
+	_busy = 1;
+	te = t0 = module_tsc();
+	p = _calloc(n, size);
+	t1 = module_tsc();
+	_account(HEAP_CALLOC, __builtin_return_address(0), n * size,
+	    p == NULL ? 0 : _size(p, n * size), 0, te, t0, t1);
+	_busy = 0;
+	return (p);
+}
+
+
+static void *
+_heap_realloc(void *old, size_t size)
+{
+	uint64_t te, t0, t1;
+	size_t freed;
+	void *p;
+
+	if (_busy) {
+		return (_realloc(old, size));
+	}
+	_busy = 1;
+	te = module_tsc();
+	freed = old == NULL || _usable == NULL ? 0 : _usable(old);
+	t0 = module_tsc();
+	p = _realloc(old, size);
+	t1 = module_tsc();
+	if (p == NULL && size != 0) {
+		/*
+		 * Failed: the old block is still there.
+		 */
+		freed = 0;
+	}
+	_account(HEAP_REALLOC, __builtin_return_address(0), size,
+	    p == NULL ? 0 : _size(p, size), freed, te, t0, t1);
+	_busy = 0;
+	return (p);
+}
+
+
+static void
+_heap_free(void *p)
+{
+	uint64_t te, t0, t1;
+	size_t freed;
+
+	if (_busy || p == NULL) {
+		_free(p);
+		return;
+	}
+	_busy = 1;
+	te = module_tsc();
+	freed = _usable == NULL ? 0 : _usable(p);
+	t0 = module_tsc();
+	_free(p);
+	t1 = module_tsc();
+	_account(HEAP_FREE, __builtin_return_address(0), 0, 0, freed, te, t0,
+	    t1);
+	_busy = 0;
+}
+
+
+/**
+ * Install the hooks.
+ */
+__attribute__((constructor))
+static void
+_heap_init(void)
+{
+
+	if (module_init("khook-heap") < 0) {
+		return;
+	}
+	_usable = (size_t (*)(void *))module_sym("malloc_usable_size");
+	_fn[HEAP_MALLOC] = module_hook("malloc", (void *)_heap_malloc,
+	    (void **)&_malloc);
+	_fn[HEAP_CALLOC] = module_hook("calloc", (void *)_heap_calloc,
+	    (void **)&_calloc);
+	_fn[HEAP_REALLOC] = module_hook("realloc", (void *)_heap_realloc,
+	    (void **)&_realloc);
+	_fn[HEAP_FREE] = module_hook("free", (void *)_heap_free,
+	    (void **)&_free);
+	module_commit();
+}
+
+
+/**
+ * Merge a shard.
+ * @param dst Sum;
+ * @param src Shard.
+ */
+static void
+_merge(void *dst, const void *src)
+{
+	const HEAP_SHARD *s;
+	HEAP_SHARD *sum;
+	int i;
+
+	sum = dst;
+	s = src;
+	for (i = 0; i < HEAP_NOPS; i++) {
+		sum->calls[i] += s->calls[i];
+		sum->cycles[i] += s->cycles[i];
+		module_sites_merge(&sum->site[i], &s->site[i]);
+	}
+	for (i = 0; i < HEAP_CLASSES; i++) {
+		sum->size[i] += s->size[i];
+	}
+	sum->overhead += s->overhead;
+	sum->allocated += s->allocated;
+	sum->freed += s->freed;
+}
+
+
+/**
+ * Export the call sites.
+ * @param x Exporter.
+ */
+static void
+_export(KHOOK_EXPORT *x)
+{
+	int i;
+
+	for (i = 0; i < HEAP_NOPS; i++) {
+		if (_fn[i] != NULL) {
+			module_export_sites(x, _name[i], _fn[i],
+			    &_sum->site[i]);
+		}
+	}
+}
+
+
+/**
+ * Report the collected data on stderr (and export it, see
+ * <code>module_export()</code>).
+ */
+__attribute__((destructor))
+static void
+_heap_fini(void)
+{
+	MODULE_SITE top[HEAP_TOP];
+	char buf[128];
+	uint64_t calls;
+	size_t j, n;
+	int i, threads;
+
+	_busy = 1;
+	if ((_sum = module_merge(&_shards, sizeof(HEAP_SHARD), _merge,
+	    &threads)) == NULL) {
+		return;
+	}
+
+	calls = 0;
+	for (i = 0; i < HEAP_NOPS; i++) {
+		calls += _sum->calls[i];
+	}
+	fprintf(stderr, "khook-heap: %d threads, %llu calls, %llu bytes "
+	    "allocated, %llu freed, %lld live%s\n", threads,
+	    (unsigned long long)calls,
+	    (unsigned long long)_sum->allocated,
+	    (unsigned long long)_sum->freed,
+	    (long long)(_sum->allocated - _sum->freed),
+	    _usable == NULL ? " (usable sizes unknown)" : "");
+	fprintf(stderr, "khook-heap: overhead %llu cycles/call\n",
+	    (unsigned long long)(calls == 0 ? 0 : _sum->overhead / calls));
+
+	for (i = 0; i < HEAP_NOPS; i++) {
+		if (_sum->calls[i] == 0) {
+			continue;
+		}
+		fprintf(stderr, "khook-heap: %s: %llu calls, %llu cycles/call"
+		    "%s\n", _name[i], (unsigned long long)_sum->calls[i],
+		    (unsigned long long)(_sum->cycles[i] / _sum->calls[i]),
+		    _sum->site[i].dropped != 0 ? " (call sites dropped)" : "");
+		n = module_sites_top(&_sum->site[i], top, HEAP_TOP);
+		for (j = 0; j < n; j++) {
+			fprintf(stderr, "khook-heap:   from %s: %llu calls, "
+			    "%llu cycles, %llu bytes\n",
+			    module_addr(top[j].ra, buf, sizeof(buf)),
+			    (unsigned long long)top[j].calls,
+			    (unsigned long long)top[j].cycles,
+			    (unsigned long long)top[j].value);
+		}
+	}
+
+	for (i = 0; i < HEAP_CLASSES; i++) {
+		if (_sum->size[i] != 0) {
+			fprintf(stderr, "khook-heap: size < %llu: %llu\n",
+			    1ULL << i, (unsigned long long)_sum->size[i]);
+		}
+	}
+
+	module_export(_export);
+}
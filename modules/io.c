@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * khook-io: I/O latency tracer.
+ *
+ * The libc wrappers of read(), write(), send(), recv(), epoll_wait()
+ * and fsync() are detoured. Every call is counted, with the bytes
+ * transferred and the errors, in a shard of the calling thread by file
+ * descriptor; one call in KHOOK_IO_SAMPLE (default 1) is also timed.
+ * The shards are merged when the report is written, at exit.
+ */
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <khook.h>
+
+#include "module.h"
+
+
+/*
+ * Hooked functions.
+ */
+#define IO_READ		0
+#define IO_WRITE	1
+#define IO_SEND		2
+#define IO_RECV		3
+#define IO_EPOLL_WAIT	4
+#define IO_FSYNC	5
+#define IO_NOPS		6
+
+/**
+ * Number of file descriptors accounted separately; the others are
+ * accounted together.
+ */
+#define IO_FDS		256
+
+/**
+ * Number of classes: 0, then [2^(k-1), 2^k) for k = 1..32.
+ */
+#define IO_CLASSES	33
+
+/**
+ * Number of call sites reported for each function.
+ */
+#define IO_TOP		10
+
+
+/**
+ * Calls on a file descriptor.
+ */
+typedef struct _io_fd {
+	uint64_t	 calls[IO_NOPS];	/**< Calls		*/
+	uint64_t	 bytes[IO_NOPS];	/**< Bytes transferred	*/
+	uint64_t	 errors;		/**< Calls failed	*/
+	uint64_t	 latency[IO_CLASSES];	/**< Timed calls by cycles */
+	uint64_t	 size[IO_CLASSES];	/**< Transfers by bytes	*/
+} IO_FD;
+
+/**
+ * Per-thread data.
+ */
+typedef struct _io_shard {
+	MODULE_SHARD	 hdr;			/**< Shard header	*/
+	uint32_t	 skip;			/**< Calls until sampled */
+	uint64_t	 sampled[IO_NOPS];	/**< Timed calls	*/
+	uint64_t	 cycles[IO_NOPS];	/**< Cycles in them	*/
+	uint64_t	 overhead;		/**< Cycles accounting	*/
+	MODULE_SITES	 site[IO_NOPS];		/**< Timed calls by site */
+	IO_FD		 fd[IO_FDS + 1];	/**< Calls by descriptor */
+} IO_SHARD;
+
+
+static const char *_name[IO_NOPS] = {
+	"read", "write", "send", "recv", "epoll_wait", "fsync"
+};
+
+static ssize_t	(*_read)(int, void *, size_t);
+static ssize_t	(*_write)(int, const void *, size_t);
+static ssize_t	(*_send)(int, const void *, size_t, int);
+static ssize_t	(*_recv)(int, void *, size_t, int);
+static int	(*_epoll_wait)(int, struct epoll_event *, int, int);
+static int	(*_fsync)(int);
+static void	*_fn[IO_NOPS];
+
+static uint32_t	 _period = 1;
+static MODULE_SHARD *_shards;
+static IO_SHARD	*_sum;
+
+static MODULE_TLS IO_SHARD *_shard;
+static MODULE_TLS int _busy;
+
+
+/**
+ * Get the class of a value.
+ * @param v Value.
+ * @return Class.
+ */
+static inline int
+_class(uint64_t v)
+{
+
+	if (v >> 31 != 0) {
+		return (IO_CLASSES - 1);
+	}
+	return (v == 0 ? 0 : 32 - __builtin_clz((uint32_t)v));
+}
+
+
+/**
+ * Start a call.
+ * Called before the original function, which may set errno.
+ * @param sp Where to store the shard of the calling thread
+ *	(<code>NULL</code> if the call is not accounted).
+ * @return Time stamp if the call is timed; <code>0</code> otherwise.
+ */
+static inline uint64_t
+_begin(IO_SHARD **sp)
+{
+	IO_SHARD *s;
+
+	if (_busy) {
+		*sp = NULL;
+		return (0);
+	}
+	if (__builtin_expect((s = _shard) == NULL, 0)) {
+		s = _shard = module_shard(&_shards, sizeof(IO_SHARD));
+		if ((*sp = s) == NULL) {
+			return (0);
+		}
+	}
+	*sp = s;
+	if (s->skip != 0) {
+		s->skip--;
+		return (0);
+	}
+	s->skip = _period - 1;
+	return (module_tsc());
+}
+
+
+/**
+ * Account a call.
+ * @param s Shard (<code>NULL</code> if the call is not accounted);
+ * @param op Function (<code>IO_*</code>);
+ * @param fd File descriptor;
+ * @param r Value returned;
+ * @param transfer Whether <code>r</code> is a number of bytes;
+ * @param ra Return address;
+ * @param t0 Time stamp returned by <code>_begin()</code>.
+ */
+static inline void
+_end(IO_SHARD *s, int op, int fd, long r, int transfer, const void *ra,
+    uint64_t t0)
+{
+	IO_FD *f;
+	uint64_t t1;
+
+	if (s == NULL) {
+		return;
+	}
+	t1 = t0 != 0 ? module_tsc() : 0;
+	f = &s->fd[fd >= 0 && fd < IO_FDS ? fd : IO_FDS];
+	f->calls[op]++;
+	if (r < 0) {
+		f->errors++;
+	} else if (transfer) {
+		f->bytes[op] += r;
+		f->size[_class(r)]++;
+	}
+	if (t0 != 0) {
+		s->sampled[op]++;
+		s->cycles[op] += t1 - t0;
+		f->latency[_class(t1 - t0)]++;
+		module_site_add(&s->site[op], ra, t1 - t0, r < 0 ? 0 : r);
+		s->overhead += module_tsc() - t1;
+	}
+}
+
+
+/*
+ * Detours.
+ */
+
+static ssize_t
+_io_read(int fd, void *buf, size_t len)
+{
+	IO_SHARD *s;
+	uint64_t t0;
+	ssize_t r;
+
+	t0 = _begin(&s);
+	r = _read(fd, buf, len);
+	_end(s, IO_READ, fd, r, 1, __builtin_return_address(0), t0);
+	return (r);
+}
+
+
+static ssize_t
+_io_write(int fd, const void *buf, size_t len)
+{
+	IO_SHARD *s;
+	uint64_t t0;
+	ssize_t r;
+
+	t0 = _begin(&s);
+	r = _write(fd, buf, len);
+	_end(s, IO_WRITE, fd, r, 1, __builtin_return_address(0), t0);
+	return (r);
+}
+
+
+static ssize_t
+_io_send(int fd, const void *buf, size_t len, int flags)
+{
+	IO_SHARD *s;
+	uint64_t t0;
+	ssize_t r;
+
+	t0 = _begin(&s);
+	r = _send(fd, buf, len, flags);
+	_end(s, IO_SEND, fd, r, 1, __builtin_return_address(0), t0);
+	return (r);
+}
+
+
+static ssize_t
+_io_recv(int fd, void *buf, size_t len, int flags)
+{
+	IO_SHARD *s;
+	uint64_t t0;
+	ssize_t r;
+
+	t0 = _begin(&s);
+	r = _recv(fd, buf, len, flags);
+	_end(s, IO_RECV, fd, r, 1, __builtin_return_address(0), t0);
+	return (r);
+}
+
+
+static int
+_io_epoll_wait(int fd, struct epoll_event *ev, int n, int timeout)
+{
+	IO_SHARD *s;
+	uint64_t t0;
+	int r;
+
+	t0 = _begin(&s);
+	r = _epoll_wait(fd, ev, n, timeout);
+	_end(s, IO_EPOLL_WAIT, fd, r, 0, __builtin_return_address(0), t0);
+	return (r);
+}
+
+
+static int
+_io_fsync(int fd)
+{
+	IO_SHARD *s;
+	uint64_t t0;
+	int r;
+
+	t0 = _begin(&s);
+	r = _fsync(fd);
+	_end(s, IO_FSYNC, fd, r, 0, __builtin_return_address(0), t0);
+	return (r);
+}
+
+
+/**
+ * Install the hooks.
+ */
+__attribute__((constructor))
+static void
+_io_init(void)
+{
+	const char *p;
+	long n;
+
+	if ((p = getenv("KHOOK_IO_SAMPLE")) != NULL) {
+		if ((n = strtol(p, NULL, 0)) < 1) {
+			warnx("khook-io: KHOOK_IO_SAMPLE: %s: invalid", p);
+		} else {
+			_period = n;
+		}
+	}
+	if (module_init("khook-io") < 0) {
+		return;
+	}
+	_fn[IO_READ] = module_hook(_name[IO_READ], (void *)_io_read,
+	    (void **)&_read);
+	_fn[IO_WRITE] = module_hook(_name[IO_WRITE], (void *)_io_write,
+	    (void **)&_write);
+	_fn[IO_SEND] = module_hook(_name[IO_SEND], (void *)_io_send,
+	    (void **)&_send);
+	_fn[IO_RECV] = module_hook(_name[IO_RECV], (void *)_io_recv,
+	    (void **)&_recv);
+	_fn[IO_EPOLL_WAIT] = module_hook(_name[IO_EPOLL_WAIT],
+	    (void *)_io_epoll_wait, (void **)&_epoll_wait);
+	_fn[IO_FSYNC] = module_hook(_name[IO_FSYNC], (void *)_io_fsync,
+	    (void **)&_fsync);
+	module_commit();
+}
+
+
+/**
+ * Merge a shard.
+ * @param dst Sum;
+ * @param src Shard.
+ */
+static void
+_merge(void *dst, const void *src)
+{
+	const IO_SHARD *s;
+	IO_SHARD *sum;
+	const IO_FD *f;
+	IO_FD *d;
+	int i, j;
+
+	sum = dst;
+	s = src;
+	for (i = 0; i < IO_NOPS; i++) {
+		sum->sampled[i] += s->sampled[i];
+		sum->cycles[i] += s->cycles[i];
+		module_sites_merge(&sum->site[i], &s->site[i]);
+	}
+	sum->overhead += s->overhead;
+	for (i = 0; i <= IO_FDS; i++) {
+		d = &sum->fd[i];
+		f = &s->fd[i];
+		for (j = 0; j < IO_NOPS; j++) {
+			d->calls[j] += f->calls[j];
+			d->bytes[j] += f->bytes[j];
+		}
+		d->errors += f->errors;
+		for (j = 0; j < IO_CLASSES; j++) {
+			d->latency[j] += f->latency[j];
+			d->size[j] += f->size[j];
+		}
+	}
+}
+
+
+/**
+ * Export the timed calls by call site.
+ * @param x Exporter.
+ */
+static void
+_export(KHOOK_EXPORT *x)
+{
+	int i;
+
+	for (i = 0; i < IO_NOPS; i++) {
+		if (_fn[i] != NULL) {
+			module_export_sites(x, _name[i], _fn[i],
+			    &_sum->site[i]);
+		}
+	}
+}
+
+
+/**
+ * Report the calls on a file descriptor.
+ * @param fd File descriptor (<code>IO_FDS</code>: the others).
+ */
+static void
+_report_fd(int fd)
+{
+	const IO_FD *f;
+	char name[16];
+	int i;
+
+	f = &_sum->fd[fd];
+	if (fd < IO_FDS) {
+		snprintf(name, sizeof(name), "fd %d", fd);
+	} else {
+		snprintf(name, sizeof(name), "fd >= %d", IO_FDS);
+	}
+	for (i = 0; i < IO_NOPS; i++) {
+		if (f->calls[i] == 0) {
+			continue;
+		}
+		if (i < IO_EPOLL_WAIT) {
+			fprintf(stderr, "khook-io: %s: %s: %llu calls, %llu "
+			    "bytes\n", name, _name[i],
+			    (unsigned long long)f->calls[i],
+			    (unsigned long long)f->bytes[i]);
+		} else {
+			fprintf(stderr, "khook-io: %s: %s: %llu calls\n", name,
+			    _name[i], (unsigned long long)f->calls[i]);
+		}
+	}
+	if (f->errors != 0) {
+		fprintf(stderr, "khook-io: %s: %llu errors\n", name,
+		    (unsigned long long)f->errors);
+	}
+	for (i = 0; i < IO_CLASSES; i++) {
+		if (f->latency[i] != 0) {
+			fprintf(stderr, "khook-io: %s:   cycles < %llu: %llu\n",
+			    name, 1ULL << i, (unsigned long long)f->latency[i]);
+		}
+	}
+	for (i = 0; i < IO_CLASSES; i++) {
+		if (f->size[i] != 0) {
+			fprintf(stderr, "khook-io: %s:   bytes < %llu: %llu\n",
+			    name, 1ULL << i, (unsigned long long)f->size[i]);
+		}
+	}
+}
+
+
+/**
+ * Report the collected data on stderr (and export it, see
+ * <code>module_export()</code>).
+ */
+__attribute__((destructor))
+static void
+_io_fini(void)
+{
+	MODULE_SITE top[IO_TOP];
+	char buf[128];
+	uint64_t calls[IO_NOPS], sampled;
+	size_t j, n;
+	int i, fd, threads;
+
+	_busy = 1;
+	if ((_sum = module_merge(&_shards, sizeof(IO_SHARD), _merge,
+	    &threads)) == NULL) {
+		return;
+	}
+
+	sampled = 0;
+	for (i = 0; i < IO_NOPS; i++) {
+		calls[i] = 0;
+		for (fd = 0; fd <= IO_FDS; fd++) {
+			calls[i] += _sum->fd[fd].calls[i];
+		}
+		sampled += _sum->sampled[i];
+	}
+	fprintf(stderr, "khook-io: %d threads, 1 call in %u timed, overhead "
+	    "%llu cycles/timed call\n", threads, _period,
+	    (unsigned long long)(sampled == 0 ? 0 : _sum->overhead / sampled));
+	for (i = 0; i < IO_NOPS; i++) {
+		if (calls[i] == 0) {
+			continue;
+		}
+		fprintf(stderr, "khook-io: %s: %llu calls, %llu timed, %llu "
+		    "cycles/call%s\n", _name[i], (unsigned long long)calls[i],
+		    (unsigned long long)_sum->sampled[i],
+		    (unsigned long long)(_sum->sampled[i] == 0 ? 0 :
+		    _sum->cycles[i] / _sum->sampled[i]),
+		    _sum->site[i].dropped != 0 ? " (call sites dropped)" : "");
+		n = module_sites_top(&_sum->site[i], top, IO_TOP);
+		for (j = 0; j < n; j++) {
+			fprintf(stderr, "khook-io:   from %s: %llu calls, "
+			    "%llu cycles, %llu bytes\n",
+			    module_addr(top[j].ra, buf, sizeof(buf)),
+			    (unsigned long long)top[j].calls,
+			    (unsigned long long)top[j].cycles,
+			    (unsigned long long)top[j].value);
+		}
+	}
+
+	for (fd = 0; fd <= IO_FDS; fd++) {
+		_report_fd(fd);
+	}
+
+	module_export(_export);
+}
@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * khook-locks: lock contention profiler.
+ *
+ * The pthread mutex, rwlock and condition variable entry points are
+ * detoured. A lock is first tried: when it is free the call costs a
+ * try-lock and a counter increment. Only when the try-lock fails the
+ * wait is timed and accounted, in a shard of the calling thread, under
+ * the address of the lock and the call site; the time the contended
+ * locks are then held is accounted on unlock.
+ */
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <khook.h>
+
+#include "module.h"
+
+
+/*
+ * Hooked functions.
+ */
+#define LOCK_MUTEX	0	/**< pthread_mutex_lock()		*/
+#define LOCK_RDLOCK	1	/**< pthread_rwlock_rdlock()		*/
+#define LOCK_WRLOCK	2	/**< pthread_rwlock_wrlock()		*/
+#define LOCK_COND	3	/**< pthread_cond_wait()		*/
+#define LOCK_TIMEDCOND	4	/**< pthread_cond_timedwait()		*/
+#define LOCK_NOPS	5
+#define LOCK_MUTEX_UNLOCK 5	/**< pthread_mutex_unlock()		*/
+#define LOCK_RW_UNLOCK	6	/**< pthread_rwlock_unlock()		*/
+#define LOCK_NFN	7
+
+/**
+ * Max. number of contended locks held at once by a thread (the hold
+ * time of the others is not accounted).
+ */
+#define LOCK_MAXHELD	16
+
+/**
+ * Number of locks and call sites reported.
+ */
+#define LOCK_TOP	10
+
+
+/**
+ * Contended lock held by a thread.
+ */
+typedef struct _held {
+	const void	*lock;			/**< Lock		*/
+	uint64_t	 tsc;			/**< Acquired at	*/
+} HELD;
+
+/**
+ * Per-thread data.
+ * In <code>lock</code> the key is the address of the lock: calls are
+ * the contended acquisitions, cycles the wait and value the hold time.
+ */
+typedef struct _lock_shard {
+	MODULE_SHARD	 hdr;			/**< Shard header	*/
+	uint64_t	 calls[LOCK_NOPS];	/**< Calls		*/
+	uint64_t	 contended[LOCK_NOPS];	/**< Waits		*/
+	uint64_t	 cycles[LOCK_NOPS];	/**< Cycles waiting	*/
+	uint64_t	 overhead;		/**< Cycles accounting	*/
+	MODULE_SITES	 lock;			/**< Waits by lock	*/
+	MODULE_SITES	 site[LOCK_NOPS];	/**< Waits by call site	*/
+	int		 nheld;			/**< Contended locks held */
+	HELD		 held[LOCK_MAXHELD];	/**< Their time stamps	*/
+} LOCK_SHARD;
+
+
+static const char *_name[LOCK_NFN] = {
+	"pthread_mutex_lock", "pthread_rwlock_rdlock",
+	"pthread_rwlock_wrlock", "pthread_cond_wait",
+	"pthread_cond_timedwait", "pthread_mutex_unlock",
+	"pthread_rwlock_unlock"
+};
+
+static int	(*_mutex_lock)(pthread_mutex_t *);
+static int	(*_mutex_trylock)(pthread_mutex_t *);
+static int	(*_mutex_unlock)(pthread_mutex_t *);
+static int	(*_rdlock)(pthread_rwlock_t *);
+static int	(*_tryrdlock)(pthread_rwlock_t *);
+static int	(*_wrlock)(pthread_rwlock_t *);
+static int	(*_trywrlock)(pthread_rwlock_t *);
+static int	(*_rw_unlock)(pthread_rwlock_t *);
+static int	(*_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int	(*_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *,
+		    const struct timespec *);
+static void	*_fn[LOCK_NFN];
+
+static MODULE_SHARD *_shards;
+static LOCK_SHARD *_sum;
+
+static MODULE_TLS LOCK_SHARD *_shard;
+static MODULE_TLS int _busy;
+
+
+/**
+ * Get the shard of the calling thread.
+ * @return The shard; <code>NULL</code> if it can't be allocated.
+ */
+static inline LOCK_SHARD *
+_get(void)
+{
+
+	if (__builtin_expect(_shard == NULL, 0)) {
+		_shard = module_shard(&_shards, sizeof(LOCK_SHARD));
+	}
+	return (_shard);
+}
+
+
+/**
+ * Account a wait.
+ * @param s Shard;
+ * @param op Function (<code>LOCK_*</code>);
+ * @param lock Lock (<code>NULL</code> for condition variables);
+ * @param acquired Whether the lock was acquired (the time it is held
+ *	is then accounted on unlock);
+ * @param ra Return address;
+ * @param t0 Time stamp at the call of the original function;
+ * @param t1 Time stamp at its return.
+ */
+static void
+_wait(LOCK_SHARD *s, int op, const void *lock, int acquired,
+    const void *ra, uint64_t t0, uint64_t t1)
+{
+
+	s->contended[op]++;
+	s->cycles[op] += t1 - t0;
+	module_site_add(&s->site[op], ra, t1 - t0, 0);
+	if (lock != NULL) {
+		module_site_add(&s->lock, lock, t1 - t0, 0);
+		if (acquired && s->nheld < LOCK_MAXHELD) {
+			s->held[s->nheld].lock = lock;
+			s->held[s->nheld++].tsc = t1;
+		}
+	}
+	s->overhead += module_tsc() - t1;
+}
+
+
+/**
+ * Account the hold time of a contended lock being released.
+ * @param s Shard;
+ * @param lock Lock.
+ */
+static void
+_release(LOCK_SHARD *s, const void *lock)
+{
+	MODULE_SITE *site;
+	uint64_t t;
+	int i;
+
+	for (i = s->nheld - 1; i >= 0; i--) {
+		if (s->held[i].lock == lock) {
+			t = module_tsc();
+			if ((site = module_site_get(&s->lock, lock)) != NULL) {
+				site->value += t - s->held[i].tsc;
+			}
+			s->held[i] = s->held[--s->nheld];
+			s->overhead += module_tsc() - t;
+			return;
+		}
+	}
+}
+
+
+/*
+ * Detours.
+ */
+
+static int
+_locks_mutex_lock(pthread_mutex_t *m)
+{
+	LOCK_SHARD *s;
+	uint64_t t0, t1;
+	int r;
+
+	if (_busy || (s = _get()) == NULL) {
+		return (_mutex_lock(m));
+	}
+	s->calls[LOCK_MUTEX]++;
+	if ((r = _mutex_trylock(m)) != EBUSY) {
+		return (r);
+	}
+	t0 = module_tsc();
+	r = _mutex_lock(m);
+	t1 = module_tsc();
+	_wait(s, LOCK_MUTEX, m, r == 0 || r == EOWNERDEAD,
+	    __builtin_return_address(0), t0, t1);
+	return (r);
+}
+
+
+static int
+_locks_mutex_unlock(pthread_mutex_t *m)
+{
+	LOCK_SHARD *s;
+
+	if ((s = _shard) != NULL && s->nheld != 0) {
+		_release(s, m);
+	}
+	return (_mutex_unlock(m));
+}
+
+
+static int
+_locks_rdlock(pthread_rwlock_t *l)
+{
+	LOCK_SHARD *s;
+	uint64_t t0, t1;
+	int r;
+
+	if (_busy || (s = _get()) == NULL) {
+		return (_rdlock(l));
+	}
+	s->calls[LOCK_RDLOCK]++;
+	if ((r = _tryrdlock(l)) != EBUSY) {
+		return (r);
+	}
+	t0 = module_tsc();
+	r = _rdlock(l);
+	t1 = module_tsc();
+	_wait(s, LOCK_RDLOCK, l, r == 0, __builtin_return_address(0), t0, t1);
+	return (r);
+}
+
+
+static int
+_locks_wrlock(pthread_rwlock_t *l)
+{
+	LOCK_SHARD *s;
+	uint64_t t0, t1;
+	int r;
+
+	if (_busy || (s = _get()) == NULL) {
+		return (_wrlock(l));
+	}
+	s->calls[LOCK_WRLOCK]++;
+	if ((r = _trywrlock(l)) != EBUSY) {
+		return (r);
+	}
+	t0 = module_tsc();
+	r = _wrlock(l);
+	t1 = module_tsc();
+	_wait(s, LOCK_WRLOCK, l, r == 0, __builtin_return_address(0), t0, t1);
+	return (r);
+}
+
+
+static int
+_locks_rw_unlock(pthread_rwlock_t *l)
+{
+	LOCK_SHARD *s;
+
+	if ((s = _shard) != NULL && s->nheld != 0) {
+		_release(s, l);
+	}
+	return (_rw_unlock(l));
+}
+
+
+/*
+ * A wait on a condition variable always blocks: it is accounted as a
+ * wait of the call site, not of the mutex.
+ */
+
+static int
+_locks_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+	LOCK_SHARD *s;
+	uint64_t t0, t1;
+	int r;
+
+	if (_busy || (s = _get()) == NULL) {
+		return (_cond_wait(c, m));
+	}
+	s->calls[LOCK_COND]++;
+	t0 = module_tsc();
+	r = _cond_wait(c, m);
+	t1 = module_tsc();
+	_wait(s, LOCK_COND, NULL, 0, __builtin_return_address(0), t0, t1);
+	return (r);
+}
+
+
+static int
+_locks_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+    const struct timespec *ts)
+{
+	LOCK_SHARD *s;
+	uint64_t t0, t1;
+	int r;
+
+	if (_busy || (s = _get()) == NULL) {
+		return (_cond_timedwait(c, m, ts));
+	}
+	s->calls[LOCK_TIMEDCOND]++;
+	t0 = module_tsc();
+	r = _cond_timedwait(c, m, ts);
+	t1 = module_tsc();
+	_wait(s, LOCK_TIMEDCOND, NULL, 0, __builtin_return_address(0), t0,
+	    t1);
+	return (r);
+}
+
+
+/**
+ * Install the hooks.
+ * A lock function is hooked only if its try-lock is found.
+ */
+__attribute__((constructor))
+static void
+_locks_init(void)
+{
+
+	if (module_init("khook-locks") < 0) {
+		return;
+	}
+	_mutex_trylock = (int (*)(pthread_mutex_t *))
+	    module_sym("pthread_mutex_trylock");
+	_tryrdlock = (int (*)(pthread_rwlock_t *))
+	    module_sym("pthread_rwlock_tryrdlock");
+	_trywrlock = (int (*)(pthread_rwlock_t *))
+	    module_sym("pthread_rwlock_trywrlock");
+
+	if (_mutex_trylock != NULL) {
+		_fn[LOCK_MUTEX] = module_hook(_name[LOCK_MUTEX],
+		    (void *)_locks_mutex_lock, (void **)&_mutex_lock);
+		_fn[LOCK_MUTEX_UNLOCK] = module_hook(_name[LOCK_MUTEX_UNLOCK],
+		    (void *)_locks_mutex_unlock, (void **)&_mutex_unlock);
+	}
+	if (_tryrdlock != NULL) {
+		_fn[LOCK_RDLOCK] = module_hook(_name[LOCK_RDLOCK],
+		    (void *)_locks_rdlock, (void **)&_rdlock);
+	}
+	if (_trywrlock != NULL) {
+		_fn[LOCK_WRLOCK] = module_hook(_name[LOCK_WRLOCK],
+		    (void *)_locks_wrlock, (void **)&_wrlock);
+	}
+	if (_tryrdlock != NULL || _trywrlock != NULL) {
+		_fn[LOCK_RW_UNLOCK] = module_hook(_name[LOCK_RW_UNLOCK],
+		    (void *)_locks_rw_unlock, (void **)&_rw_unlock);
+	}
+	_fn[LOCK_COND] = module_hook(_name[LOCK_COND],
+	    (void *)_locks_cond_wait, (void **)&_cond_wait);
+	_fn[LOCK_TIMEDCOND] = module_hook(_name[LOCK_TIMEDCOND],
+	    (void *)_locks_cond_timedwait, (void **)&_cond_timedwait);
+	module_commit();
+}
+
+
+/**
+ * Merge a shard.
+ * @param dst Sum;
+ * @param src Shard.
+ */
+static void
+_merge(void *dst, const void *src)
+{
+	const LOCK_SHARD *s;
+	LOCK_SHARD *sum;
+	int i;
+
+	sum = dst;
+	s = src;
+	for (i = 0; i < LOCK_NOPS; i++) {
+		sum->calls[i] += s->calls[i];
+		sum->contended[i] += s->contended[i];
+		sum->cycles[i] += s->cycles[i];
+		module_sites_merge(&sum->site[i], &s->site[i]);
+	}
+	module_sites_merge(&sum->lock, &s->lock);
+	sum->overhead += s->overhead;
+}
+
+
+/**
+ * Export the call sites that waited.
+ * @param x Exporter.
+ */
+static void
+_export(KHOOK_EXPORT *x)
+{
+	int i;
+
+	for (i = 0; i < LOCK_NOPS; i++) {
+		if (_fn[i] != NULL) {
+			module_export_sites(x, _name[i], _fn[i],
+			    &_sum->site[i]);
+		}
+	}
+}
+
+
+/**
+ * Report the collected data on stderr (and export it, see
+ * <code>module_export()</code>).
+ */
+__attribute__((destructor))
+static void
+_locks_fini(void)
+{
+	MODULE_SITE top[LOCK_TOP];
+	char buf[128];
+	uint64_t calls;
+	size_t j, n;
+	int i, threads;
+
+	_busy = 1;
+	if ((_sum = module_merge(&_shards, sizeof(LOCK_SHARD), _merge,
+	    &threads)) == NULL) {
+		return;
+	}
+
+	calls = 0;
+	for (i = 0; i < LOCK_NOPS; i++) {
+		calls += _sum->calls[i];
+	}
+	fprintf(stderr, "khook-locks: %d threads, %llu calls, overhead %llu "
+	    "cycles/call\n", threads, (unsigned long long)calls,
+	    (unsigned long long)(calls == 0 ? 0 : _sum->overhead / calls));
+	for (i = 0; i < LOCK_NOPS; i++) {
+		if (_sum->calls[i] == 0) {
+			continue;
+		}
+		fprintf(stderr, "khook-locks: %s: %llu calls, %llu waited, "
+		    "%llu cycles waiting\n", _name[i],
+		    (unsigned long long)_sum->calls[i],
+		    (unsigned long long)_sum->contended[i],
+		    (unsigned long long)_sum->cycles[i]);
+		n = module_sites_top(&_sum->site[i], top, LOCK_TOP);
+		for (j = 0; j < n; j++) {
+			fprintf(stderr, "khook-locks:   from %s: %llu waits, "
+			    "%llu cycles\n",
+			    module_addr(top[j].ra, buf, sizeof(buf)),
+			    (unsigned long long)top[j].calls,
+			    (unsigned long long)top[j].cycles);
+		}
+	}
+
+	n = module_sites_top(&_sum->lock, top, LOCK_TOP);
+	for (j = 0; j < n; j++) {
+		fprintf(stderr, "khook-locks: lock %s: %llu waits, %llu cycles "
+		    "waiting, %llu cycles held\n",
+		    module_addr(top[j].ra, buf, sizeof(buf)),
+		    (unsigned long long)top[j].calls,
+		    (unsigned long long)top[j].cycles,
+		    (unsigned long long)top[j].value);
+	}
+
+	module_export(_export);
+}
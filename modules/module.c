@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Support for the modules: symbol lookup, hook installation, per-thread
+ * shards and reports.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <err.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <khook.h>
+
+#include "module.h"
+
+
+static const char *_module;
+static KHOOK_ARENA _arena;
+static KHOOK_TXN _txn;
+static void *_fn[MODULE_MAXHOOKS];
+static int _nfn;
+static struct timespec _t0;
+static uint64_t _tsc0;
+static const uint8_t *_exe;
+static size_t _exesize;
+static const Elf32_Sym *_syms;
+static size_t _nsyms;
+static const char *_strtab;
+static size_t _strsize;
+static uintptr_t _exebias;
+
+
+/**
+ * Get the load address of the executable.
+ */
+static int
+_bias(struct dl_phdr_info *info, size_t size, void *arg)
+{
+
+	(void)size;
+	*(uintptr_t *)arg = info->dlpi_addr;
+	return (1);
+}
+
+
+/**
+ * Check that a range lies in a file.
+ * @param off Offset of the range;
+ * @param len Its length;
+ * @param size Size of the file.
+ * @return Non zero if the range is in the file.
+ */
+static inline int
+_inside(size_t off, size_t len, size_t size)
+{
+
+	return (off <= size && len <= size - off);
+}
+
+
+/**
+ * Map the symbol table of the executable.
+ * It is kept until <code>module_commit()</code>.
+ * @return <code>0</code> on success; <code>-1</code> if the executable
+ * can't be read or has no symbol table.
+ */
+static int
+_exe_open(void)
+{
+	const Elf32_Shdr *shdr, *sh, *strsh;
+	const Elf32_Ehdr *eh;
+	const uint8_t *map;
+	struct stat st;
+	size_t size;
+	int fd, k;
+
+	if ((fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC)) < 0) {
+		return (-1);
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*eh)) {
+		close(fd);
+		return (-1);
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return (-1);
+	}
+
+	eh = (const Elf32_Ehdr *)map;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh->e_shoff > size ||
+	    eh->e_shnum > (size - eh->e_shoff) / sizeof(Elf32_Shdr)) {
+		goto fail;
+	}
+	shdr = (const Elf32_Shdr *)(map + eh->e_shoff);
+	sh = NULL;
+	for (k = 0; k < eh->e_shnum; k++) {
+		if (shdr[k].sh_type == SHT_SYMTAB) {
+			sh = &shdr[k];
+			break;
+		}
+		if (shdr[k].sh_type == SHT_DYNSYM) {
+			sh = &shdr[k];
+		}
+	}
+	if (sh == NULL || sh->sh_link >= eh->e_shnum ||
+	    !_inside(sh->sh_offset, sh->sh_size, size)) {
+		goto fail;
+	}
+	strsh = &shdr[sh->sh_link];
+	if (!_inside(strsh->sh_offset, strsh->sh_size, size)) {
+		goto fail;
+	}
+
+	_exe = map;
+	_exesize = size;
+	_syms = (const Elf32_Sym *)(map + sh->sh_offset);
+	_nsyms = sh->sh_size / sizeof(Elf32_Sym);
+	_strtab = (const char *)map + strsh->sh_offset;
+	_strsize = strsh->sh_size;
+	dl_iterate_phdr(_bias, &_exebias);
+	return (0);
+
+fail:
+	munmap((void *)map, size);
+	return (-1);
+}
+
+
+/**
+ * Unmap the symbol table of the executable.
+ */
+static void
+_exe_close(void)
+{
+
+	if (_exe != NULL) {
+		munmap((void *)_exe, _exesize);
+		_exe = NULL;
+	}
+}
+
+
+/**
+ * Look a function up in the symbol table of the executable.
+ * Unlike dlsym(3) it finds the functions that are not exported, like
+ * those of an allocator linked statically; the local symbols (static
+ * functions) are skipped.
+ * @param name Symbol.
+ * @return The address of the function; <code>NULL</code> if not found.
+ */
+static void *
+_exe_sym(const char *name)
+{
+	const Elf32_Sym *sym;
+	size_t i, len;
+
+	if (_exe == NULL) {
+		return (NULL);
+	}
+	len = strlen(name);
+	for (i = 0, sym = _syms; i < _nsyms; i++, sym++) {
+		if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC ||
+		    (ELF32_ST_BIND(sym->st_info) != STB_GLOBAL &&
+		    ELF32_ST_BIND(sym->st_info) != STB_WEAK) ||
+		    sym->st_shndx == SHN_UNDEF ||
+		    sym->st_name >= _strsize ||
+		    len >= _strsize - sym->st_name ||
+		    memcmp(_strtab + sym->st_name, name, len + 1) != 0) {
+			continue;
+		}
+		return ((void *)(_exebias + sym->st_value));
+	}
+	return (NULL);
+}
+
+
+/**
+ * Prepare a module.
+ * The hooks are installed by <code>module_commit()</code>, all at once.
+ * @param name Module name (for the messages).
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+int
+module_init(const char *name)
+{
+
+	_module = name;
+	clock_gettime(CLOCK_MONOTONIC, &_t0);
+	_tsc0 = module_tsc();
+	_exe_open();
+
+	/*
+	 * W^X where available: the hooked functions are patched without
+	 * changing their protection.
+	 */
+	if (khook_arena_init_wx(&_arena,
+	    MODULE_MAXHOOKS * KHOOK_SIZEOF_MAXCODE) < 0 &&
+	    khook_arena_init(&_arena,
+	    MODULE_MAXHOOKS * KHOOK_SIZEOF_MAXCODE) < 0) {
+		warn("%s: can't allocate the hooking code", _module);
+		_exe_close();
+		return (-1);
+	}
+	if (khook_txn_begin(&_txn) < 0) {
+		_exe_close();
+		return (-1);
+	}
+	return (0);
+}
+
+
+/**
+ * Find a function.
+ * The symbol table of the executable is searched first (until
+ * <code>module_commit()</code>), then the dynamic symbols of the
+ * process.
+ * @param name Symbol.
+ * @return The address of the function; <code>NULL</code> if not found.
+ */
+void *
+module_sym(const char *name)
+{
+	void *fn;
+
+	if ((fn = _exe_sym(name)) == NULL) {
+		fn = dlsym(RTLD_DEFAULT, name);
+	}
+	return (fn);
+}
+
+
+/**
+ * Prepare the detour of a function.
+ * @param name Symbol;
+ * @param target Replacement (of the same type);
+ * @param orig Receives the address of the original function.
+ * @return The address of the function; <code>NULL</code> if it is not
+ * found or it can't be hooked.
+ * @see khook_detour()
+ */
+void *
+module_hook(const char *name, void *target, void **orig)
+{
+	size_t r;
+	void *fn;
+
+	if ((fn = module_sym(name)) == NULL) {
+		return (NULL);
+	}
+	if (_nfn == MODULE_MAXHOOKS) {
+		warnx("%s: %s: too many hooks", _module, name);
+		return (NULL);
+	}
+	r = khook_detour(fn, _arena.hcode, &_arena.hsize, target, orig);
+	if (r == 0) {
+		warnx("%s: %s: can't hook", _module, name);
+		return (NULL);
+	}
+	_arena.hcode += r;
+	_fn[_nfn++] = fn;
+	return (fn);
+}
+
+
+/**
+ * Change the protection of the pages patched by the hooks.
+ * @param prot Protection.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_protect(int prot)
+{
+	uintptr_t start, end, pgsiz;
+	int i;
+
+	pgsiz = (uintptr_t)sysconf(_SC_PAGESIZE);
+	for (i = 0; i < _nfn; i++) {
+		start = (uintptr_t)_fn[i] & ~(pgsiz - 1);
+		end = ((uintptr_t)_fn[i] + KHOOK_SIZEOF_MAXPATCH + pgsiz - 1) &
+		    ~(pgsiz - 1);
+		if (mprotect((void *)start, end - start, prot) < 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * Install the prepared hooks.
+ * The other threads are stopped while the functions are patched; the
+ * pause is reported on stderr.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+int
+module_commit(void)
+{
+	KHOOK_STW stw;
+	int r;
+
+	/*
+	 * The functions are all looked up.
+	 */
+	_exe_close();
+
+	if (_nfn == 0) {
+		khook_txn_rollback(&_txn);
+		warnx("%s: nothing to hook", _module);
+		return (-1);
+	}
+	if (_arena.wbase == NULL &&
+	    _protect(PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+		khook_txn_rollback(&_txn);
+		warn("%s", _module);
+		return (-1);
+	}
+	r = khook_txn_commit_stw(&_txn, &stw);
+	if (_arena.wbase == NULL) {
+		_protect(PROT_READ | PROT_EXEC);
+	}
+	if (r < 0) {
+		warnx("%s: can't install the hooks", _module);
+		return (-1);
+	}
+	fprintf(stderr, "%s: %d hooks installed, %d threads stopped for %ld "
+	    "us\n", _module, _nfn, stw.threads + 1, stw.pause / 1000);
+	return (0);
+}
+
+
+/**
+ * Get the shard of the calling thread.
+ * A new shard is allocated (with mmap(2), never with the allocator
+ * that may be hooked) and linked to the list on the first call of a
+ * thread; the caller keeps it in a thread local variable.
+ * @param list List of the shards;
+ * @param size Size of a shard (a <code>MODULE_SHARD</code> first).
+ * @return The shard; <code>NULL</code> if it can't be allocated.
+ */
+void *
+module_shard(MODULE_SHARD **list, size_t size)
+{
+	MODULE_SHARD *s;
+
+	s = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+	if (s == MAP_FAILED) {
+		return (NULL);
+	}
+	s->tid = syscall(SYS_gettid);
+	s->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(list, &s->next, s, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return (s);
+}
+
+
+/**
+ * Merge the shards of a module.
+ * The shards are merged into a new, zeroed one. The detours of the
+ * calling thread must not account anymore: the report calls the hooked
+ * functions.
+ * @param list Shard list;
+ * @param size Size of a shard;
+ * @param merge Merges a shard (second argument) into the sum;
+ * @param threads Receives the number of shards (threads).
+ * @return The sum; <code>NULL</code> if it can't be allocated.
+ */
+void *
+module_merge(MODULE_SHARD *const *list, size_t size,
+    void (*merge)(void *, const void *), int *threads)
+{
+	MODULE_SHARD *s, *sum;
+
+	sum = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (sum == MAP_FAILED) {
+		return (NULL);
+	}
+	*threads = 0;
+	s = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+	for (; s != NULL; s = s->next) {
+		merge(sum, s);
+		(*threads)++;
+	}
+	return (sum);
+}
+
+
+/**
+ * Merge a site table into another.
+ * The calls of the sites that don't fit are counted as dropped.
+ * @param dst Destination;
+ * @param src Source (it may be being updated by its thread).
+ */
+void
+module_sites_merge(MODULE_SITES *dst, const MODULE_SITES *src)
+{
+	const MODULE_SITE *s;
+	MODULE_SITE *d;
+	uint32_t i, j, n;
+
+	for (j = 0; j < (1U << MODULE_SITES_BITS); j++) {
+		s = &src->slot[j];
+		if (s->ra == NULL) {
+			continue;
+		}
+		i = ((uint32_t)(uintptr_t)s->ra * 0x9E3779B1U) >>
+		    (32 - MODULE_SITES_BITS);
+		for (n = 0; n < (1U << MODULE_SITES_BITS); n++) {
+			d = &dst->slot[i];
+			if (d->ra == s->ra || d->ra == NULL) {
+				d->ra = s->ra;
+				d->calls += s->calls;
+				d->cycles += s->cycles;
+				d->value += s->value;
+				break;
+			}
+			i = (i + 1) & ((1U << MODULE_SITES_BITS) - 1);
+		}
+		if (n == (1U << MODULE_SITES_BITS)) {
+			dst->dropped += s->calls;
+		}
+	}
+	dst->dropped += src->dropped;
+}
+
+
+/**
+ * Get the call sites that spent most cycles.
+ * @param t Site table;
+ * @param dst Destination array (sorted by decreasing cycles);
+ * @param n Number of elements of <code>dst</code>.
+ * @return The number of sites stored.
+ */
+size_t
+module_sites_top(const MODULE_SITES *t, MODULE_SITE *dst, size_t n)
+{
+	size_t i, k, m;
+
+	m = 0;
+	for (i = 0; i < (1U << MODULE_SITES_BITS); i++) {
+		if (t->slot[i].ra == NULL) {
+			continue;
+		}
+		for (k = m; k > 0 && dst[k - 1].cycles < t->slot[i].cycles;
+		    k--) {
+			if (k < n) {
+				dst[k] = dst[k - 1];
+			}
+		}
+		if (k < n) {
+			dst[k] = t->slot[i];
+			if (m < n) {
+				m++;
+			}
+		}
+	}
+	return (m);
+}
+
+
+/**
+ * Name a code address.
+ * @param addr Address;
+ * @param buf Destination buffer;
+ * @param len Its size.
+ * @return <code>buf</code>, holding "symbol+offset" or the address.
+ */
+const char *
+module_addr(const void *addr, char *buf, size_t len)
+{
+	Dl_info dli;
+
+	if (dladdr(addr, &dli) != 0 && dli.dli_sname != NULL) {
+		snprintf(buf, len, "%s+%#lx", dli.dli_sname,
+		    (unsigned long)((uintptr_t)addr -
+		    (uintptr_t)dli.dli_saddr));
+	} else {
+		snprintf(buf, len, "%p", addr);
+	}
+	return (buf);
+}
+
+
+/**
+ * Get the rate of the time stamp counter.
+ * It is measured from <code>module_init()</code>.
+ * @return Cycles per second; <code>0</code> if unknown.
+ */
+uint64_t
+module_hz(void)
+{
+	struct timespec t1;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (uint64_t)(t1.tv_sec - _t0.tv_sec) * 1000000000 +
+	    t1.tv_nsec - _t0.tv_nsec;
+	return (ns == 0 ? 0 :
+	    (uint64_t)((double)(module_tsc() - _tsc0) * 1e9 / ns));
+}
+
+
+/**
+ * Symbolizer of the exported call sites.
+ */
+static int
+_sym(void *ctx, const void *addr, char *buf, size_t len)
+{
+	Dl_info dli;
+
+	(void)ctx;
+	if (dladdr(addr, &dli) == 0 || dli.dli_sname == NULL) {
+		return (-1);
+	}
+	snprintf(buf, len, "%s", dli.dli_sname);
+	return (0);
+}
+
+
+/**
+ * Export the data of a module to the file named by
+ * <code>KHOOK_PROFILE</code>, in the format named by
+ * <code>KHOOK_PROFILE_FORMAT</code> (see the preload agent).
+ * Nothing is done if <code>KHOOK_PROFILE</code> is not set.
+ * @param fn Exporter of the module's data.
+ */
+void
+module_export(void (*fn)(KHOOK_EXPORT *))
+{
+	static KHOOK_EXPORT x;
+	const char *path, *fmt;
+	int format, fd;
+
+	if ((path = getenv("KHOOK_PROFILE")) == NULL) {
+		return;
+	}
+	fmt = getenv("KHOOK_PROFILE_FORMAT");
+	if ((format = khook_export_format(fmt)) < 0) {
+		warnx("%s: %s: unknown profile format", _module, fmt);
+		return;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn("%s: %s", _module, path);
+		return;
+	}
+	khook_export_begin(&x, fd, format, module_hz(), _sym, NULL);
+	fn(&x);
+	if (khook_export_end(&x) < 0) {
+		warn("%s: %s", _module, path);
+	}
+	close(fd);
+}
+
+
+/**
+ * Export the calls of a site table as callers of a function.
+ * @param x Exporter;
+ * @param name Name of the function;
+ * @param fn Its address;
+ * @param t Site table.
+ */
+void
+module_export_sites(KHOOK_EXPORT *x, const char *name, const void *fn,
+    const MODULE_SITES *t)
+{
+	KHOOK_CALLER site[64];
+	const MODULE_SITE *s;
+	size_t i, n;
+
+	n = 0;
+	for (i = 0; i < (1U << MODULE_SITES_BITS); i++) {
+		s = &t->slot[i];
+		if (s->ra == NULL) {
+			continue;
+		}
+		site[n].ra = s->ra;
+		site[n].calls = s->calls;
+		site[n].cycles = s->cycles;
+		if (++n == sizeof(site) / sizeof(site[0])) {
+			khook_export_callers(x, name, fn, site, n);
+			n = 0;
+		}
+	}
+	khook_export_callers(x, name, fn, site, n);
+}
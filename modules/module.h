@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef MODULE_H
+#define MODULE_H
+
+
+/**
+ * log2 of the number of call sites of a site table.
+ */
+#define MODULE_SITES_BITS	9
+
+/**
+ * Max. number of functions hooked by a module.
+ */
+#define MODULE_MAXHOOKS		16
+
+
+/**
+ * Storage class of the per-thread variables of the detours.
+ * initial-exec: the first access of a thread does not go through
+ * __tls_get_addr(), which may call the allocator or take the locks of
+ * the dynamic linker, i.e. run the detours again.
+ */
+#define MODULE_TLS	__thread __attribute__((tls_model("initial-exec")))
+
+
+/*
+ * Per-thread data of the modules are shards of this size, allocated by
+ * module_shard() and linked in a list that is only walked (merged) when
+ * the data is reported.
+ */
+
+/**
+ * Shard header (first member of the shard of a module).
+ */
+typedef struct _module_shard {
+	struct _module_shard *next;		/**< Next shard		*/
+	uint64_t	 tid;			/**< Owner thread	*/
+} MODULE_SHARD;
+
+/**
+ * Calls from a call site.
+ */
+typedef struct _module_site {
+	const void	*ra;			/**< Return address	*/
+	uint64_t	 calls;			/**< Calls		*/
+	uint64_t	 cycles;		/**< Cycles in the call	*/
+	uint64_t	 value;			/**< Module defined	*/
+} MODULE_SITE;
+
+/**
+ * Site table.
+ * It is written by one thread only: no atomic operation is needed.
+ */
+typedef struct _module_sites {
+	MODULE_SITE	 slot[1 << MODULE_SITES_BITS];
+	uint64_t	 dropped;		/**< Calls not recorded	*/
+} MODULE_SITES;
+
+
+/**
+ * Find or insert a site in a site table.
+ * @param t Site table;
+ * @param ra Return address.
+ * @return The site; <code>NULL</code> if the table is full.
+ */
+static inline MODULE_SITE *
+module_site_get(MODULE_SITES *t, const void *ra)
+{
+	MODULE_SITE *s;
+	uint32_t i, n;
+
+	i = ((uint32_t)(uintptr_t)ra * 0x9E3779B1U) >>
+	    (32 - MODULE_SITES_BITS);
+	for (n = 0; n < (1U << MODULE_SITES_BITS); n++) {
+		s = &t->slot[i];
+		if (s->ra == ra || s->ra == NULL) {
+			s->ra = ra;
+			return (s);
+		}
+		i = (i + 1) & ((1U << MODULE_SITES_BITS) - 1);
+	}
+	return (NULL);
+}
+
+
+/**
+ * Account a call in a site table.
+ * @param t Site table;
+ * @param ra Return address;
+ * @param cycles Cycles spent in the call;
+ * @param value Value to add to the call site.
+ */
+static inline void
+module_site_add(MODULE_SITES *t, const void *ra, uint64_t cycles,
+    uint64_t value)
+{
+	MODULE_SITE *s;
+
+	if ((s = module_site_get(t, ra)) == NULL) {
+		t->dropped++;
+		return;
+	}
+	s->calls++;
+	s->cycles += cycles;
+	s->value += value;
+}
+
+
+/**
+ * Read the time stamp counter.
+ * @return Time stamp cycles.
+ */
+static inline uint64_t
+module_tsc(void)
+{
+
+	return (__builtin_ia32_rdtsc());
+}
+
+
+/*
+ * Prototypes.
+ */
+int	module_init(const char *);
+void	*module_sym(const char *);
+void	*module_hook(const char *, void *, void **);
+int	module_commit(void);
+void	*module_shard(MODULE_SHARD **, size_t);
+void	*module_merge(MODULE_SHARD *const *, size_t,
+	    void (*)(void *, const void *), int *);
+void	module_sites_merge(MODULE_SITES *, const MODULE_SITES *);
+size_t	module_sites_top(const MODULE_SITES *, MODULE_SITE *, size_t);
+const char *module_addr(const void *, char *, size_t);
+uint64_t module_hz(void);
+void	module_export(void (*)(KHOOK_EXPORT *));
+void	module_export_sites(KHOOK_EXPORT *, const char *, const void *,
+	    const MODULE_SITES *);
+
+
+#endif	/* MODULE_H */
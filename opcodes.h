@@ -27,6 +27,12 @@
 #ifndef OPCODES_H
 #define OPCODES_H
 
+/*
+ * Human readable opcode maps.
+ * These maps are not used at run time: mktables translates them into
+ * the packed decoding tables (tables.h) used by the disassembler.
+ */
+
 
 #define _M		0x0001	/**< Instruction with MODRM		*/
 #define _R		0x0002	/**< Instruction with a relative value	*/
@@ -37,6 +43,11 @@
 #define _v		0x0040	/**< Immediate data is word o dword	*/
 #define _p		0x0080	/**< Immediate data is dword o offsel	*/
 #define _s		0x0100	/**< Immediate data is 24 bits		*/
+#define _X		0x0200	/**< VEX/EVEX escape if MODRM mod is 11	*/
+#define _G		0x0400	/**< Immediate only if MODRM reg is 0/1	*/
+#define _P		0x0800	/**< Instruction prefix			*/
+#define _A		0x1000	/**< Immediate data is a memory offset	*/
+#define _U		0x2000	/**< Undefined opcode			*/
 #define _E		0x4000	/**< 2 bytes opcode escape		*/
 #define _C		0x8000	/**< Coprocessor escape			*/
 
@@ -49,7 +60,7 @@
  * Instruction Set Reference
  * @see opcode2_map
  */
-static uint32_t opcode1_map[256] = {
+static const uint16_t opcode1_map[256] = {
 /* 00 */
 	_M,		/* ADD  Eb,  Gb			*/
 	_M,		/* ADD  Ev,  Gv			*/
@@ -97,7 +108,7 @@ static uint32_t opcode1_map[256] = {
 	_M,		/* AND  Gv,  Ev			*/
 	_b,		/* AND  AL,  Ib			*/
 	_v,		/* AND  eAX, Iv			*/
-	0,		/* PREFIX ES			*/
+	_P,		/* PREFIX ES			*/
 	0,		/* DAA				*/
 
 /* 28 */
@@ -107,7 +118,7 @@ static uint32_t opcode1_map[256] = {
 	_M,		/* SUB  Gv,  Ev			*/
 	_b,		/* SUB  AL,  Ib			*/
 	_v,		/* SUB  eAX, Iv			*/
-	0,		/* PREFIX CS			*/
+	_P,		/* PREFIX CS			*/
 	0,		/* DAS				*/
 
 /* 30 */
@@ -117,18 +128,18 @@ static uint32_t opcode1_map[256] = {
 	_M,		/* XOR  Gv,  Ev			*/
 	_b,		/* XOR  AL,  Ib			*/
 	_v,		/* XOR  eAX, Iv			*/
-	0,		/* PREFIX SS			*/
+	_P,		/* PREFIX SS			*/
 	0,		/* AAA				*/
 
 /* 38 */
 	_M,		/* CMP  Eb,  Gb			*/
-	_M,		/* SEG  Ev,  Gv			*/
-	_M,		/* AAS  Eb,  Gb			*/
-	_M,		/*      Ev,  Gv			*/
-	_b,		/*      AL,  Ib			*/
-	_v,		/*      eAX, Iv			*/
-	0,		/* PREFIX DS			*/
-	0,		/*				*/
+	_M,		/* CMP  Ev,  Gv			*/
+	_M,		/* CMP  Gb,  Eb			*/
+	_M,		/* CMP  Gv,  Ev			*/
+	_b,		/* CMP  AL,  Ib			*/
+	_v,		/* CMP  eAX, Iv			*/
+	_P,		/* PREFIX DS			*/
+	0,		/* AAS				*/
 
 /* 40 */
 	0,		/* INC  eAX			*/
@@ -173,22 +184,22 @@ static uint32_t opcode1_map[256] = {
 /* 60 */
 	0,		/* PUSHA			*/
 	0,		/* POPA				*/
-	_M,		/* BOUND Gv, Ma			*/
+	_M | _X,	/* BOUND Gv, Ma / EVEX		*/
 	_M,		/* ARPL  Ew, Gw			*/
-	0,		/* PREFIX FS			*/
-	0,		/* PREFIX GS			*/
-	0,		/* PREFIX OPSIZ			*/
-	0,		/* PREFIX ADSIZ			*/
+	_P,		/* PREFIX FS			*/
+	_P,		/* PREFIX GS			*/
+	_P,		/* PREFIX OPSIZ			*/
+	_P,		/* PREFIX ADSIZ			*/
 
 /* 68 */
 	_v,		/* PUSH  Iv			*/
 	_M | _v,	/* IMUL Gv, Ev, Iv		*/
 	_b,		/* PUSH  Ib			*/
 	_M | _b,	/* IMUL Gv, Ev, Ib		*/
-	0,		/* INSB  Yb,  DX	XXX	*/
-	0,		/* INSW/D Yv, DX	XXX	*/
-	0,		/* OUTSB  DX, Xb	XXX	*/
-	0,		/* OUTSW/D Dx, Xv	XXX	*/
+	0,		/* INSB  Yb,  DX		*/
+	0,		/* INSW/D Yv, DX		*/
+	0,		/* OUTSB  DX, Xb		*/
+	0,		/* OUTSW/D DX, Xv		*/
 
 /* 70 */
 	_R | _b,	/* JO   rel8			*/
@@ -243,7 +254,7 @@ static uint32_t opcode1_map[256] = {
 /* 98 */
 	0,		/* CBW				*/
 	0,		/* CWD/CDQ			*/
-	0,		/* CALL Ap			*/
+	_p,		/* CALL Ap			*/
 	0,		/* WAIT				*/
 	0,		/* PUSHF			*/
 	0,		/* POPF				*/
@@ -251,24 +262,24 @@ static uint32_t opcode1_map[256] = {
 	0,		/* LAHF				*/
 
 /* A0 */
-	_v,		/* MOV  AL,  Ob		XXX	*/
-	_d,		/* MOV  eAX, Ov			*/
-	_v,		/* MOV  Ob,  AL		XXX	*/
-	_v,		/* MOV  Ov,  eAX	XXX	*/
-	_M,		/* MOVSB Xb, Yb		XXX	*/
-	_M,		/* MOVSW Xv, Yv		XXX	*/
-	_M,		/* CMPSB Xb, Yb		XXX	*/
-	_M,		/* CMPSW Xv, Yv		XXX	*/
+	_A,		/* MOV  AL,  Ob			*/
+	_A,		/* MOV  eAX, Ov			*/
+	_A,		/* MOV  Ob,  AL			*/
+	_A,		/* MOV  Ov,  eAX		*/
+	0,		/* MOVSB Xb, Yb			*/
+	0,		/* MOVSW Xv, Yv			*/
+	0,		/* CMPSB Xb, Yb			*/
+	0,		/* CMPSW Xv, Yv			*/
 
 /* A8 */
 	_b,		/* TEST AL, Ib			*/
 	_v,		/* TEST eAX, Iv			*/
-	_M,		/* STOSB Yb, AL		XXX	*/
-	_M,		/* STOSW/D Yv, eAX	XXX	*/
-	_M,		/* LODSB AL, Xb		XXX	*/
-	_M,		/* LODSW/D eAX, Xv	XXX	*/
-	_M,		/* SCASB AL, Yb		XXX	*/
-	_M,		/* SCASW/D AL, Yb	XXX	*/
+	0,		/* STOSB Yb, AL			*/
+	0,		/* STOSW/D Yv, eAX		*/
+	0,		/* LODSB AL, Xb			*/
+	0,		/* LODSW/D eAX, Xv		*/
+	0,		/* SCASB AL, Yb			*/
+	0,		/* SCASW/D eAX, Yv		*/
 
 /* B0 */
 	_b,		/* MOV  AL,  b			*/
@@ -295,8 +306,8 @@ static uint32_t opcode1_map[256] = {
 	_M | _b,	/* Shift Group 2a		*/
 	_w,		/* RET  near			*/
 	0,		/* RET  near			*/
-	_M,		/* LES  Gv, Mp			*/
-	_M,		/* LDS  Gv, Mp			*/
+	_M | _X,	/* LES  Gv, Mp / VEX3		*/
+	_M | _X,	/* LDS  Gv, Mp / VEX2		*/
 	_M | _b,	/* MOV  Eb, Ib			*/
 	_M | _v,	/* MOV  Ev, Iv			*/
 
@@ -315,20 +326,20 @@ static uint32_t opcode1_map[256] = {
 	_M,		/* Shift Group 2		*/
 	_M,		/* Shift Group 2		*/
 	_M,		/* Shift Group 2		*/
-	0,		/* AAM				*/
-	0,		/* AAM				*/
+	_b,		/* AAM  Ib			*/
+	_b,		/* AAD  Ib			*/
 	0,		/*				*/
 	0,		/* XLAT				*/
 
 /* D8 */
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
-	_C,		/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
+	_M | _C,	/* Escape Copro			*/
 
 /* E0 */
 	_R | _b,	/* LOOPN Jb			*/
@@ -351,14 +362,14 @@ static uint32_t opcode1_map[256] = {
 	0,		/* OUT DX,  eAX			*/
 
 /* F0 */
-	0,		/* PREFIX LOCK			*/
-	0,		/*				*/
-	0,		/* PREFIX REPNE			*/
-	0,		/* PREFIX REP/REPE		*/
+	_P,		/* PREFIX LOCK			*/
+	0,		/* INT1				*/
+	_P,		/* PREFIX REPNE			*/
+	_P,		/* PREFIX REP/REPE		*/
 	0,		/* HLT				*/
 	0,		/* CMC				*/
-	_M,		/* Group 3			*/
-	_M,		/* Group 3			*/
+	_M | _b | _G,	/* Group 3 (TEST Eb, Ib)	*/
+	_M | _v | _G,	/* Group 3 (TEST Ev, Iv)	*/
 
 /* F8 */
 	0,		/* CLC				*/
@@ -367,8 +378,8 @@ static uint32_t opcode1_map[256] = {
 	0,		/* STI				*/
 	0,		/* CLD				*/
 	0,		/* STD				*/
-	_M,		/* INC/DEC Group 4 XXX		*/
-	_M		/* INC/DEC Group 5 XXX		*/
+	_M,		/* INC/DEC Group 4		*/
+	_M		/* INC/DEC Group 5		*/
 };
 
 
@@ -379,165 +390,167 @@ static uint32_t opcode1_map[256] = {
  * @see Intel Architecture Software Developer's Manual Volume 2:
  * Instruction Set Reference
  * @see opcode1_map
+ * @see opcode3_38_map
+ * @see opcode3_3a_map
  */
-static uint32_t opcode2_map[256] = {
+static const uint16_t opcode2_map[256] = {
 /* 00 */
 	_M,		/* Group 6			*/
-	0,
+	_M,		/* Group 7			*/
 	_M,		/* LAR  Gv, Ew			*/
 	_M,		/* LSL  Gv, Ew			*/
-	0,
-	0,
+	_U,
+	0,		/* SYSCALL			*/
 	0,		/* CLTS				*/
-	0,
+	0,		/* SYSRET			*/
 
 /* 08 */
 	0,		/* INVD				*/
 	0,		/* WBINVD			*/
-	0,
-	0,		/* UD2			XXX	*/
-	0,
-	0,
-	0,
-	0,
+	_U,
+	0,		/* UD2				*/
+	_U,
+	_M,		/* PREFETCHW Ev			*/
+	0,		/* FEMMS			*/
+	_M | _b,	/* 3DNow! Pq, Qq, Ib		*/
 
 /* 10 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_M,		/* MOVUPS Vps, Wps		*/
+	_M,		/* MOVUPS Wps, Vps		*/
+	_M,		/* MOVLPS Vq, Mq		*/
+	_M,		/* MOVLPS Mq, Vq		*/
+	_M,		/* UNPCKLPS Vps, Wq		*/
+	_M,		/* UNPCKHPS Vps, Wq		*/
+	_M,		/* MOVHPS Vq, Mq		*/
+	_M,		/* MOVHPS Mq, Vq		*/
 
 /* 18 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_M,		/* Group 16 (PREFETCH)		*/
+	_M,		/* NOP  Ev			*/
+	_M,		/* BNDLDX/BNDMOV		*/
+	_M,		/* BNDSTX/BNDMOV		*/
+	_M,		/* NOP  Ev			*/
+	_M,		/* NOP  Ev			*/
+	_M,		/* NOP  Ev / ENDBR32		*/
+	_M,		/* NOP  Ev			*/
 
 /* 20 */
 	_M,		/* MOV  Rd, Cd			*/
 	_M,		/* MOV  Rd, Dd			*/
 	_M,		/* MOV  Cd, Rd			*/
 	_M,		/* MOV  Dd, Rd			*/
-	0,
-	0,
-	0,
-	0,
+	_U,
+	_U,
+	_U,
+	_U,
 
 /* 28 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_M,		/* MOVAPS Vps, Wps		*/
+	_M,		/* MOVAPS Wps, Vps		*/
+	_M,		/* CVTPI2PS Vps, Qq		*/
+	_M,		/* MOVNTPS Mps, Vps		*/
+	_M,		/* CVTTPS2PI Pq, Wq		*/
+	_M,		/* CVTPS2PI Pq, Wq		*/
+	_M,		/* UCOMISS Vss, Wss		*/
+	_M,		/* COMISS Vss, Wss		*/
 
 /* 30 */
 	0,		/* WRMSR			*/
 	0,		/* RDTSC			*/
 	0,		/* RDMSR			*/
 	0,		/* RDPMC			*/
-	0,
-	0,
-	0,
-	0,
+	0,		/* SYSENTER			*/
+	0,		/* SYSEXIT			*/
+	_U,
+	0,		/* GETSEC			*/
 
 /* 38 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_E,		/* Escape. 3 bytes opcode	*/
+	_U,
+	_E,		/* Escape. 3 bytes opcode	*/
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
 
 /* 40 */
 	_M,		/* CMOVO Gv, Ev			*/
-	_M,		/* CMOVO Ev, Gv			*/
-	_M,		/* CMOVB/CMOVC/CMOVNAE Gv, Ev	*/
-	_M,		/* CMOVB/CMOVC/CMOVNAE Gv, Ev	*/
-	_M,		/* CMOVE/CMOVZ Gv, Ev		*/
-	_M,		/* CMOVNE/CMOVNZ Gv, Ev		*/
-	_M,		/* CMOVBE/CMOVNA Gv, Ev		*/
-	_M,		/* CMOVCA/CMOVNBE Gv, Ev	*/
+	_M,		/* CMOVNO Gv, Ev		*/
+	_M,		/* CMOVB Gv, Ev			*/
+	_M,		/* CMOVNB Gv, Ev		*/
+	_M,		/* CMOVZ Gv, Ev			*/
+	_M,		/* CMOVNZ Gv, Ev		*/
+	_M,		/* CMOVBE Gv, Ev		*/
+	_M,		/* CMOVNBE Gv, Ev		*/
 
 /* 48 */
 	_M,		/* CMOVS Gv, Ev			*/
 	_M,		/* CMOVNS Gv, Ev		*/
-	_M,		/* CMOVP/CMOVPE Gv, Ev		*/
-	_M,		/* CMPVNP/CMOVPO Gv, Ev		*/
-	_M,		/* CMOVGE/CMOVNL Gv, Ev		*/
-	_M,		/* CMOVGE/CMOVNL Gv, Ev		*/
-	_M,		/* CMOVLE/CMOVNG Gv, Ev		*/
-	_M,		/* CMOVG/CMOVNLE Gv, Ev		*/
+	_M,		/* CMOVP Gv, Ev			*/
+	_M,		/* CMOVNP Gv, Ev		*/
+	_M,		/* CMOVL Gv, Ev			*/
+	_M,		/* CMOVNL Gv, Ev		*/
+	_M,		/* CMOVLE Gv, Ev		*/
+	_M,		/* CMOVNLE Gv, Ev		*/
 
 /* 50 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_M,		/* MOVMSKPS Gd, Ups		*/
+	_M,		/* SQRTPS Vps, Wps		*/
+	_M,		/* RSQRTPS Vps, Wps		*/
+	_M,		/* RCPPS Vps, Wps		*/
+	_M,		/* ANDPS Vps, Wps		*/
+	_M,		/* ANDNPS Vps, Wps		*/
+	_M,		/* ORPS Vps, Wps		*/
+	_M,		/* XORPS Vps, Wps		*/
 
 /* 58 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_M,		/* ADDPS Vps, Wps		*/
+	_M,		/* MULPS Vps, Wps		*/
+	_M,		/* CVTPS2PD Vpd, Wps		*/
+	_M,		/* CVTDQ2PS Vps, Wdq		*/
+	_M,		/* SUBPS Vps, Wps		*/
+	_M,		/* MINPS Vps, Wps		*/
+	_M,		/* DIVPS Vps, Wps		*/
+	_M,		/* MAXPS Vps, Wps		*/
 
 /* 60 */
 	_M,		/* PUNPCKLBW Pq, Qd		*/
 	_M,		/* PUNPCKLWD Pq, Qd		*/
-	_M,		/* PUNOCKLDQ Pq, Qd		*/
-	_M,		/* PACKUSDW Pq, Qd		*/
-	_M,		/* PCMPGTB Pq, Qd		*/
-	_M,		/* PCMPGTW Pq, Qd		*/
-	_M,		/* PCMPGTD Pq, Qd		*/
-	_M,		/* PACKSSWB Pq, Qd		*/
+	_M,		/* PUNPCKLDQ Pq, Qd		*/
+	_M,		/* PACKSSWB Pq, Qq		*/
+	_M,		/* PCMPGTB Pq, Qq		*/
+	_M,		/* PCMPGTW Pq, Qq		*/
+	_M,		/* PCMPGTD Pq, Qq		*/
+	_M,		/* PACKUSWB Pq, Qq		*/
 
 /* 68 */
 	_M,		/* PUNPCKHBW Pq, Qd		*/
 	_M,		/* PUNPCKHWD Pq, Qd		*/
 	_M,		/* PUNPCKHDQ Pq, Qd		*/
 	_M,		/* PACKSSDW Pq, Qd		*/
-	0,
-	0,
+	_M,		/* PUNPCKLQDQ Vx, Wx		*/
+	_M,		/* PUNPCKHQDQ Vx, Wx		*/
 	_M,		/* MOVD Pd, Ed			*/
 	_M,		/* MOVQ Pq, Qq			*/
 
 /* 70 */
-	0,
-	0,		/* PSHIMW			*/
-	0,		/* PSHIMD			*/
-	0,		/* PSHIMQ			*/
-	_M,		/* PCMPEQB Pq, Qd		*/
-	_M,		/* PCMPEQW Pq, Qd		*/
-	_M,		/* PCMPEQD Pq, Qd		*/
-	0,		/* EMMS				*/
+	_M | _b,	/* PSHUFW Pq, Qq, Ib		*/
+	_M | _b,	/* Group 12			*/
+	_M | _b,	/* Group 13			*/
+	_M | _b,	/* Group 14			*/
+	_M,		/* PCMPEQB Pq, Qq		*/
+	_M,		/* PCMPEQW Pq, Qq		*/
+	_M,		/* PCMPEQD Pq, Qq		*/
+	0,		/* EMMS / VZEROUPPER		*/
 
 /* 78 */
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
+	_M,		/* VMREAD Ed, Gd		*/
+	_M,		/* VMWRITE Gd, Ed		*/
+	_U,
+	_U,
+	_M,		/* HADDPD Vpd, Wpd		*/
+	_M,		/* HSUBPD Vpd, Wpd		*/
 	_M,		/* MOVD Ed, Pd			*/
 	_M,		/* MOVQ Qq, Pq			*/
 
@@ -562,24 +575,24 @@ static uint32_t opcode2_map[256] = {
 	_R | _v,	/* JNLE rel32			*/
 
 /* 90 */
-	0,		/* SETO				*/
-	0,		/* SETNO			*/
-	0,		/* SETB				*/
-	0,		/* SETNB			*/
-	0,		/* SETZ				*/
-	0,		/* SETNZ			*/
-	0,		/* SETBE			*/
-	0,		/* SETNBE			*/
+	_M,		/* SETO Eb			*/
+	_M,		/* SETNO Eb			*/
+	_M,		/* SETB Eb			*/
+	_M,		/* SETNB Eb			*/
+	_M,		/* SETZ Eb			*/
+	_M,		/* SETNZ Eb			*/
+	_M,		/* SETBE Eb			*/
+	_M,		/* SETNBE Eb			*/
 
 /* 98 */
-	0,		/* SETS				*/
-	0,		/* SETNS			*/
-	0,		/* SETP				*/
-	0,		/* SETNP			*/
-	0,		/* SETL				*/
-	0,		/* SETNL			*/
-	0,		/* SETLE			*/
-	0,		/* SETNLE			*/
+	_M,		/* SETS Eb			*/
+	_M,		/* SETNS Eb			*/
+	_M,		/* SETP Eb			*/
+	_M,		/* SETNP Eb			*/
+	_M,		/* SETL Eb			*/
+	_M,		/* SETNL Eb			*/
+	_M,		/* SETLE Eb			*/
+	_M,		/* SETNLE Eb			*/
 
 /* A0 */
 	0,		/* PUSH FS			*/
@@ -588,8 +601,8 @@ static uint32_t opcode2_map[256] = {
 	_M,		/* BT Ev, Gv			*/
 	_M | _b,	/* SHLD Ev, Gv, Ib		*/
 	_M,		/* SHLD Ev, Gv, CL		*/
-	0,
-	0,
+	_U,
+	_U,
 
 /* A8 */
 	0,		/* PUSH GS			*/
@@ -598,7 +611,7 @@ static uint32_t opcode2_map[256] = {
 	_M,		/* BTS Ev, Gv			*/
 	_M | _b,	/* SHRD Ev, Gv, Ib		*/
 	_M,		/* SHRD Ev, Gv, CL		*/
-	0,
+	_M,		/* Group 15			*/
 	_M,		/* IMUL Gv, Ev			*/
 
 /* B0 */
@@ -612,24 +625,24 @@ static uint32_t opcode2_map[256] = {
 	_M,		/* MOVZX Gv, Ew			*/
 
 /* B8 */
-	0,
-	0,		/* Invalid code			*/
-	_M | _b,	/* Group 8(Ev, Ib)		*/
+	_M,		/* POPCNT Gv, Ev		*/
+	_M,		/* UD1  Gv, Ev			*/
+	_M | _b,	/* Group 8 (Ev, Ib)		*/
 	_M,		/* BTC Ev, Gv			*/
-	_M,		/* BSF Gv, Ev			*/
-	_M,		/* BSR Gv, Ev			*/
+	_M,		/* BSF/TZCNT Gv, Ev		*/
+	_M,		/* BSR/LZCNT Gv, Ev		*/
 	_M,		/* MOVSX Gv, Eb			*/
 	_M,		/* MOVSX Gv, Ew			*/
 
 /* C0 */
 	_M,		/* XADD Eb, Gb			*/
 	_M,		/* XADD Ev, Gv			*/
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,		/* Group 9			*/
+	_M | _b,	/* CMPPS Vps, Wps, Ib		*/
+	_M,		/* MOVNTI Md, Gd		*/
+	_M | _b,	/* PINSRW Pq, Ed, Ib		*/
+	_M | _b,	/* PEXTRW Gd, Nq, Ib		*/
+	_M | _b,	/* SHUFPS Vps, Wps, Ib		*/
+	_M,		/* Group 9			*/
 
 /* C8 */
 	0,		/* BSWAP EAX			*/
@@ -642,64 +655,853 @@ static uint32_t opcode2_map[256] = {
 	0,		/* BSWAP EDI			*/
 
 /* D0 */
-	0,
-	_M,		/* PSRLW Pq, Qd			*/
-	_M,		/* PSRLD Pq, Qd			*/
-	_M,		/* PSRLQ Pq, Qd			*/
-	0,
-	_M,		/* PMULLW Pq, Qd		*/
-	0,
-	0,
+	_M,		/* ADDSUBPD Vpd, Wpd		*/
+	_M,		/* PSRLW Pq, Qq			*/
+	_M,		/* PSRLD Pq, Qq			*/
+	_M,		/* PSRLQ Pq, Qq			*/
+	_M,		/* PADDQ Pq, Qq			*/
+	_M,		/* PMULLW Pq, Qq		*/
+	_M,		/* MOVQ Wq, Vq			*/
+	_M,		/* PMOVMSKB Gd, Nq		*/
 
 /* D8 */
 	_M,		/* PSUBUSB Pq, Qq		*/
 	_M,		/* PSUBUSW Pq, Qq		*/
-	0,
+	_M,		/* PMINUB Pq, Qq		*/
 	_M,		/* PAND Pq, Qq			*/
-	_M,		/* PADDUSD Pq, Qq		*/
+	_M,		/* PADDUSB Pq, Qq		*/
 	_M,		/* PADDUSW Pq, Qq		*/
-	0,
+	_M,		/* PMAXUB Pq, Qq		*/
 	_M,		/* PANDN Pq, Qq			*/
 
 /* E0 */
-	0,
-	_M,		/* PSRAW Pq, Qd			*/
-	_M,		/* PSRAD Pq, Qd			*/
-	0,
-	0,
-	_M,		/* PMULHW Pq, Qd		*/
-	0,
-	0,
+	_M,		/* PAVGB Pq, Qq			*/
+	_M,		/* PSRAW Pq, Qq			*/
+	_M,		/* PSRAD Pq, Qq			*/
+	_M,		/* PAVGW Pq, Qq			*/
+	_M,		/* PMULHUW Pq, Qq		*/
+	_M,		/* PMULHW Pq, Qq		*/
+	_M,		/* CVTTPD2DQ Vx, Wpd		*/
+	_M,		/* MOVNTQ Mq, Pq		*/
+
+/* E8 */
+	_M,		/* PSUBSB Pq, Qq		*/
+	_M,		/* PSUBSW Pq, Qq		*/
+	_M,		/* PMINSW Pq, Qq		*/
+	_M,		/* POR Pq, Qq			*/
+	_M,		/* PADDSB Pq, Qq		*/
+	_M,		/* PADDSW Pq, Qq		*/
+	_M,		/* PMAXSW Pq, Qq		*/
+	_M,		/* PXOR Pq, Qq			*/
+
+/* F0 */
+	_M,		/* LDDQU Vx, Mx			*/
+	_M,		/* PSLLW Pq, Qq			*/
+	_M,		/* PSLLD Pq, Qq			*/
+	_M,		/* PSLLQ Pq, Qq			*/
+	_M,		/* PMULUDQ Pq, Qq		*/
+	_M,		/* PMADDWD Pq, Qq		*/
+	_M,		/* PSADBW Pq, Qq		*/
+	_M,		/* MASKMOVQ Pq, Nq		*/
+
+/* F8 */
+	_M,		/* PSUBB Pq, Qq			*/
+	_M,		/* PSUBW Pq, Qq			*/
+	_M,		/* PSUBD Pq, Qq			*/
+	_M,		/* PSUBQ Pq, Qq			*/
+	_M,		/* PADDB Pq, Qq			*/
+	_M,		/* PADDW Pq, Qq			*/
+	_M,		/* PADDD Pq, Qq			*/
+	_M		/* UD0  Gv, Ev			*/
+};
+
+
+/**
+ * @var opcode3_38_map[256]
+ * 3 bytes length opcodes map (<code>0F 38 xx</code>, VEX/EVEX map 2);
+ * each element contains flags specifying type and arguments for the
+ * instruction.
+ * @see Intel Architecture Software Developer's Manual Volume 2:
+ * Instruction Set Reference
+ * @see opcode2_map
+ */
+static const uint16_t opcode3_38_map[256] = {
+/* 00 */
+	_M,		/* PSHUFB			*/
+	_M,		/* PHADDW			*/
+	_M,		/* PHADDD			*/
+	_M,		/* PHADDSW			*/
+	_M,		/* PMADDUBSW			*/
+	_M,		/* PHSUBW			*/
+	_M,		/* PHSUBD			*/
+	_M,		/* PHSUBSW			*/
+
+/* 08 */
+	_M,		/* PSIGNB			*/
+	_M,		/* PSIGNW			*/
+	_M,		/* PSIGND			*/
+	_M,		/* PMULHRSW			*/
+	_M,		/* VPERMILPS			*/
+	_M,		/* VPERMILPD			*/
+	_M,		/* VTESTPS			*/
+	_M,		/* VTESTPD			*/
+
+/* 10 */
+	_M,		/* PBLENDVB			*/
+	_M,		/* VPSRAVW			*/
+	_M,		/* VPSLLVW			*/
+	_M,		/* VCVTPH2PS			*/
+	_M,		/* BLENDVPS			*/
+	_M,		/* BLENDVPD			*/
+	_M,		/* VPERMPS			*/
+	_M,		/* PTEST			*/
+
+/* 18 */
+	_M,		/* VBROADCASTSS			*/
+	_M,		/* VBROADCASTSD			*/
+	_M,		/* VBROADCASTF128		*/
+	_M,		/* VBROADCASTF32X8		*/
+	_M,		/* PABSB			*/
+	_M,		/* PABSW			*/
+	_M,		/* PABSD			*/
+	_M,		/* VPABSQ			*/
+
+/* 20 */
+	_M,		/* PMOVSXBW			*/
+	_M,		/* PMOVSXBD			*/
+	_M,		/* PMOVSXBQ			*/
+	_M,		/* PMOVSXWD			*/
+	_M,		/* PMOVSXWQ			*/
+	_M,		/* PMOVSXDQ			*/
+	_M,		/* VPTESTMB			*/
+	_M,		/* VPTESTMD			*/
+
+/* 28 */
+	_M,		/* PMULDQ			*/
+	_M,		/* PCMPEQQ			*/
+	_M,		/* MOVNTDQA			*/
+	_M,		/* PACKUSDW			*/
+	_M,		/* VMASKMOVPS			*/
+	_M,		/* VMASKMOVPD			*/
+	_M,		/* VMASKMOVPS			*/
+	_M,		/* VMASKMOVPD			*/
+
+/* 30 */
+	_M,		/* PMOVZXBW			*/
+	_M,		/* PMOVZXBD			*/
+	_M,		/* PMOVZXBQ			*/
+	_M,		/* PMOVZXWD			*/
+	_M,		/* PMOVZXWQ			*/
+	_M,		/* PMOVZXDQ			*/
+	_M,		/* VPERMD			*/
+	_M,		/* PCMPGTQ			*/
+
+/* 38 */
+	_M,		/* PMINSB			*/
+	_M,		/* PMINSD			*/
+	_M,		/* PMINUW			*/
+	_M,		/* PMINUD			*/
+	_M,		/* PMAXSB			*/
+	_M,		/* PMAXSD			*/
+	_M,		/* PMAXUW			*/
+	_M,		/* PMAXUD			*/
+
+/* 40 */
+	_M,		/* PMULLD			*/
+	_M,		/* PHMINPOSUW			*/
+	_M,		/* VGETEXPPS			*/
+	_M,		/* VGETEXPSS			*/
+	_M,		/* VPLZCNTD			*/
+	_M,		/* VPSRLVD			*/
+	_M,		/* VPSRAVD			*/
+	_M,		/* VPSLLVD			*/
+
+/* 48 */
+	_U,
+	_M,		/* LDTILECFG			*/
+	_U,
+	_M,		/* TILELOADD			*/
+	_M,		/* VRCP14PS			*/
+	_M,		/* VRCP14SS			*/
+	_M,		/* VRSQRT14PS			*/
+	_M,		/* VRSQRT14SS			*/
+
+/* 50 */
+	_M,		/* VPDPBUSD			*/
+	_M,		/* VPDPBUSDS			*/
+	_M,		/* VPDPWSSD			*/
+	_M,		/* VPDPWSSDS			*/
+	_M,		/* VPOPCNTB			*/
+	_M,		/* VPOPCNTD			*/
+	_U,
+	_U,
+
+/* 58 */
+	_M,		/* VPBROADCASTD			*/
+	_M,		/* VPBROADCASTQ			*/
+	_M,		/* VBROADCASTI128		*/
+	_M,		/* VBROADCASTI32X8		*/
+	_M,		/* TDPBF16PS			*/
+	_U,
+	_M,		/* TDPBSSD			*/
+	_U,
+
+/* 60 */
+	_U,
+	_U,
+	_M,		/* VPEXPANDB			*/
+	_M,		/* VPCOMPRESSB			*/
+	_M,		/* VPBLENDMD			*/
+	_M,		/* VBLENDMPS			*/
+	_M,		/* VPBLENDMB			*/
+	_U,
+
+/* 68 */
+	_M,		/* VP2INTERSECTD		*/
+	_U,
+	_U,
+	_U,
+	_M,		/* TCMMIMFP16PS			*/
+	_U,
+	_U,
+	_U,
+
+/* 70 */
+	_M,		/* VPSHLDVW			*/
+	_M,		/* VPSHLDVD			*/
+	_M,		/* VPSHRDVW			*/
+	_M,		/* VPSHRDVD			*/
+	_U,
+	_M,		/* VPERMI2B			*/
+	_M,		/* VPERMI2D			*/
+	_M,		/* VPERMI2PS			*/
+
+/* 78 */
+	_M,		/* VPBROADCASTB			*/
+	_M,		/* VPBROADCASTW			*/
+	_M,		/* VPBROADCASTB Gd		*/
+	_M,		/* VPBROADCASTW Gd		*/
+	_M,		/* VPBROADCASTD Gd		*/
+	_M,		/* VPERMT2B			*/
+	_M,		/* VPERMT2D			*/
+	_M,		/* VPERMT2PS			*/
+
+/* 80 */
+	_M,		/* INVEPT			*/
+	_M,		/* INVVPID			*/
+	_M,		/* INVPCID			*/
+	_M,		/* VPMULTISHIFTQB		*/
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 88 */
+	_M,		/* VEXPANDPS			*/
+	_M,		/* VPEXPANDD			*/
+	_M,		/* VCOMPRESSPS			*/
+	_M,		/* VPCOMPRESSD			*/
+	_M,		/* VPMASKMOVD			*/
+	_M,		/* VPERMB			*/
+	_M,		/* VPMASKMOVD			*/
+	_M,		/* VPSHUFBITQMB			*/
+
+/* 90 */
+	_M,		/* VPGATHERDD			*/
+	_M,		/* VPGATHERQD			*/
+	_M,		/* VGATHERDPS			*/
+	_M,		/* VGATHERQPS			*/
+	_U,
+	_U,
+	_M,		/* VFMADDSUB132PS		*/
+	_M,		/* VFMSUBADD132PS		*/
+
+/* 98 */
+	_M,		/* VFMADD132PS			*/
+	_M,		/* VFMADD132SS			*/
+	_M,		/* VFMSUB132PS			*/
+	_M,		/* VFMSUB132SS			*/
+	_M,		/* VFNMADD132PS			*/
+	_M,		/* VFNMADD132SS			*/
+	_M,		/* VFNMSUB132PS			*/
+	_M,		/* VFNMSUB132SS			*/
+
+/* A0 */
+	_M,		/* VPSCATTERDD			*/
+	_M,		/* VPSCATTERQD			*/
+	_M,		/* VSCATTERDPS			*/
+	_M,		/* VSCATTERQPS			*/
+	_U,
+	_U,
+	_M,		/* VFMADDSUB213PS		*/
+	_M,		/* VFMSUBADD213PS		*/
+
+/* A8 */
+	_M,		/* VFMADD213PS			*/
+	_M,		/* VFMADD213SS			*/
+	_M,		/* VFMSUB213PS			*/
+	_M,		/* VFMSUB213SS			*/
+	_M,		/* VFNMADD213PS			*/
+	_M,		/* VFNMADD213SS			*/
+	_M,		/* VFNMSUB213PS			*/
+	_M,		/* VFNMSUB213SS			*/
+
+/* B0 */
+	_M,		/* VCVTNEEPH2PS			*/
+	_M,		/* VBCSTNESH2PS			*/
+	_U,
+	_U,
+	_M,		/* VPMADD52LUQ			*/
+	_M,		/* VPMADD52HUQ			*/
+	_M,		/* VFMADDSUB231PS		*/
+	_M,		/* VFMSUBADD231PS		*/
+
+/* B8 */
+	_M,		/* VFMADD231PS			*/
+	_M,		/* VFMADD231SS			*/
+	_M,		/* VFMSUB231PS			*/
+	_M,		/* VFMSUB231SS			*/
+	_M,		/* VFNMADD231PS			*/
+	_M,		/* VFNMADD231SS			*/
+	_M,		/* VFNMSUB231PS			*/
+	_M,		/* VFNMSUB231SS			*/
+
+/* C0 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_M,		/* VPCONFLICTD			*/
+	_U,
+	_M,		/* Group 18 (gather pref.)	*/
+	_M,		/* Group 19 (scatter pref.)	*/
+
+/* C8 */
+	_M,		/* SHA1NEXTE			*/
+	_M,		/* SHA1MSG1			*/
+	_M,		/* SHA1MSG2			*/
+	_M,		/* SHA256RNDS2			*/
+	_M,		/* SHA256MSG1			*/
+	_M,		/* SHA256MSG2			*/
+	_U,
+	_M,		/* GF2P8MULB			*/
+
+/* D0 */
+	_U,
+	_U,
+	_M,		/* VPDPWSUD			*/
+	_M,		/* VPDPWSUDS			*/
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* D8 */
+	_M,		/* AESENCWIDE128KL		*/
+	_U,
+	_M,		/* SM3MSG1			*/
+	_M,		/* AESIMC			*/
+	_M,		/* AESENC			*/
+	_M,		/* AESENCLAST			*/
+	_M,		/* AESDEC			*/
+	_M,		/* AESDECLAST			*/
+
+/* E0 */
+	_M,		/* CMPOXADD			*/
+	_M,		/* CMPNOXADD			*/
+	_M,		/* CMPBXADD			*/
+	_M,		/* CMPNBXADD			*/
+	_M,		/* CMPZXADD			*/
+	_M,		/* CMPNZXADD			*/
+	_M,		/* CMPBEXADD			*/
+	_M,		/* CMPNBEXADD			*/
+
+/* E8 */
+	_M,		/* CMPSXADD			*/
+	_M,		/* CMPNSXADD			*/
+	_M,		/* CMPPXADD			*/
+	_M,		/* CMPNPXADD			*/
+	_M,		/* CMPLXADD			*/
+	_M,		/* CMPNLXADD			*/
+	_M,		/* CMPLEXADD			*/
+	_M,		/* CMPNLEXADD			*/
+
+/* F0 */
+	_M,		/* MOVBE/CRC32 Gv, Ev		*/
+	_M,		/* MOVBE/CRC32 Ev, Gv		*/
+	_M,		/* ANDN Gy, By, Ey		*/
+	_M,		/* Group 17 (BLSR ...)		*/
+	_U,
+	_M,		/* BZHI/PDEP/PEXT		*/
+	_M,		/* MULX/ADCX/ADOX		*/
+	_M,		/* BEXTR/SHLX/SARX/SHRX		*/
+
+/* F8 */
+	_M,		/* MOVDIR64B/ENQCMD		*/
+	_M,		/* MOVDIRI My, Gy		*/
+	_U,
+	_U,
+	_M,		/* AADD My, Gy			*/
+	_U,
+	_U,
+	_U
+};
+
+
+/**
+ * @var opcode3_3a_map[256]
+ * 3 bytes length opcodes map (<code>0F 3A xx</code>, VEX/EVEX map 3);
+ * each element contains flags specifying type and arguments for the
+ * instruction.
+ * @see Intel Architecture Software Developer's Manual Volume 2:
+ * Instruction Set Reference
+ * @see opcode2_map
+ */
+static const uint16_t opcode3_3a_map[256] = {
+/* 00 */
+	_M | _b,	/* VPERMQ			*/
+	_M | _b,	/* VPERMPD			*/
+	_M | _b,	/* VPBLENDD			*/
+	_M | _b,	/* VALIGND			*/
+	_M | _b,	/* VPERMILPS			*/
+	_M | _b,	/* VPERMILPD			*/
+	_M | _b,	/* VPERM2F128			*/
+	_U,
+
+/* 08 */
+	_M | _b,	/* ROUNDPS			*/
+	_M | _b,	/* ROUNDPD			*/
+	_M | _b,	/* ROUNDSS			*/
+	_M | _b,	/* ROUNDSD			*/
+	_M | _b,	/* BLENDPS			*/
+	_M | _b,	/* BLENDPD			*/
+	_M | _b,	/* PBLENDW			*/
+	_M | _b,	/* PALIGNR			*/
+
+/* 10 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_M | _b,	/* PEXTRB			*/
+	_M | _b,	/* PEXTRW			*/
+	_M | _b,	/* PEXTRD			*/
+	_M | _b,	/* EXTRACTPS			*/
+
+/* 18 */
+	_M | _b,	/* VINSERTF128			*/
+	_M | _b,	/* VEXTRACTF128			*/
+	_M | _b,	/* VINSERTF32X8			*/
+	_M | _b,	/* VEXTRACTF32X8		*/
+	_U,
+	_M | _b,	/* VCVTPS2PH			*/
+	_M | _b,	/* VPCMPUD			*/
+	_M | _b,	/* VPCMPD			*/
+
+/* 20 */
+	_M | _b,	/* PINSRB			*/
+	_M | _b,	/* INSERTPS			*/
+	_M | _b,	/* PINSRD			*/
+	_M | _b,	/* VSHUFF32X4			*/
+	_U,
+	_M | _b,	/* VPTERNLOGD			*/
+	_M | _b,	/* VGETMANTPS			*/
+	_M | _b,	/* VGETMANTSS			*/
+
+/* 28 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 30 */
+	_M | _b,	/* KSHIFTRB			*/
+	_M | _b,	/* KSHIFTRD			*/
+	_M | _b,	/* KSHIFTLB			*/
+	_M | _b,	/* KSHIFTLD			*/
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 38 */
+	_M | _b,	/* VINSERTI128			*/
+	_M | _b,	/* VEXTRACTI128			*/
+	_M | _b,	/* VINSERTI32X8			*/
+	_M | _b,	/* VEXTRACTI32X8		*/
+	_U,
+	_U,
+	_M | _b,	/* VPCMPUB			*/
+	_M | _b,	/* VPCMPB			*/
+
+/* 40 */
+	_M | _b,	/* DPPS				*/
+	_M | _b,	/* DPPD				*/
+	_M | _b,	/* MPSADBW			*/
+	_M | _b,	/* VSHUFI32X4			*/
+	_M | _b,	/* PCLMULQDQ			*/
+	_U,
+	_M | _b,	/* VPERM2I128			*/
+	_U,
+
+/* 48 */
+	_M | _b,	/* VPERMIL2PS			*/
+	_M | _b,	/* VPERMIL2PD			*/
+	_M | _b,	/* VBLENDVPS			*/
+	_M | _b,	/* VBLENDVPD			*/
+	_M | _b,	/* VPBLENDVB			*/
+	_U,
+	_U,
+	_U,
+
+/* 50 */
+	_M | _b,	/* VRANGEPS			*/
+	_M | _b,	/* VRANGESS			*/
+	_U,
+	_U,
+	_M | _b,	/* VFIXUPIMMPS			*/
+	_M | _b,	/* VFIXUPIMMSS			*/
+	_M | _b,	/* VREDUCEPS			*/
+	_M | _b,	/* VREDUCESS			*/
+
+/* 58 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_M | _b,	/* VFMADDSUBPS			*/
+	_M | _b,	/* VFMADDSUBPD			*/
+	_M | _b,	/* VFMSUBADDPS			*/
+	_M | _b,	/* VFMSUBADDPD			*/
+
+/* 60 */
+	_M | _b,	/* PCMPESTRM			*/
+	_M | _b,	/* PCMPESTRI			*/
+	_M | _b,	/* PCMPISTRM			*/
+	_M | _b,	/* PCMPISTRI			*/
+	_U,
+	_U,
+	_M | _b,	/* VFPCLASSPS			*/
+	_M | _b,	/* VFPCLASSSS			*/
+
+/* 68 */
+	_M | _b,	/* VFMADDPS			*/
+	_M | _b,	/* VFMADDPD			*/
+	_M | _b,	/* VFMADDSS			*/
+	_M | _b,	/* VFMADDSD			*/
+	_M | _b,	/* VFMSUBPS			*/
+	_M | _b,	/* VFMSUBPD			*/
+	_M | _b,	/* VFMSUBSS			*/
+	_M | _b,	/* VFMSUBSD			*/
+
+/* 70 */
+	_M | _b,	/* VPSHLDW			*/
+	_M | _b,	/* VPSHLDD			*/
+	_M | _b,	/* VPSHRDW			*/
+	_M | _b,	/* VPSHRDD			*/
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 78 */
+	_M | _b,	/* VFNMADDPS			*/
+	_M | _b,	/* VFNMADDPD			*/
+	_M | _b,	/* VFNMADDSS			*/
+	_M | _b,	/* VFNMADDSD			*/
+	_M | _b,	/* VFNMSUBPS			*/
+	_M | _b,	/* VFNMSUBPD			*/
+	_M | _b,	/* VFNMSUBSS			*/
+	_M | _b,	/* VFNMSUBSD			*/
+
+/* 80 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 88 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 90 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* 98 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* A0 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* A8 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* B0 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* B8 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* C0 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* C8 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_M | _b,	/* SHA1RNDS4			*/
+	_U,
+	_M | _b,	/* GF2P8AFFINEQB		*/
+	_M | _b,	/* GF2P8AFFINEINVQB		*/
+
+/* D0 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+
+/* D8 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_M | _b,	/* SM3RNDS2			*/
+	_M | _b,	/* AESKEYGENASSIST		*/
+
+/* E0 */
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
 
 /* E8 */
-	_M,		/* PSUBSB Pq, Qd		*/
-	_M,		/* PSUBSW Pq, Qd		*/
-	0,
-	_M,		/* POR Pq, Qd			*/
-	_M,		/* PADDSB Pq, Qd		*/
-	_M,		/* PADDSW Pq, Qd		*/
-	0,
-	_M,		/* PXOR Pq, Qd			*/
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
 
 /* F0 */
-	0,
-	_M,		/* PSLLW Pq, Qd			*/
-	_M,		/* PSLLD Pq, Qd			*/
-	_M,		/* PSLLQ Pq, Qd			*/
-	0,
-	_M,		/* PMADDWD Pq, Qd		*/
-	0,
-	0,
+	_M | _b,	/* RORX Gy, Ey, Ib		*/
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
 
 /* F8 */
-	_M,		/* PSUBB Pq, Qd			*/
-	_M,		/* PSUBW Pq, Qd			*/
-	_M,		/* PSUBD Pq, Qd			*/
-	0,
-	_M,		/* PADDB Pq, Qd			*/
-	_M,		/* PADDW Pq, Qd			*/
-	_M,		/* PADDD Pq, Qd			*/
-	0
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U,
+	_U
+};
+
+
+/**
+ * @var copro_mem_map[8]
+ * Coprocessor opcodes with a memory operand (MODRM mod field not 11);
+ * indexed by the escape opcode (D8-DF), each element is a bitmap of
+ * the valid MODRM reg fields.
+ * @see copro_reg_map
+ */
+static const uint8_t copro_mem_map[8] = {
+	0xFF,		/* D8 FADD FMUL FCOM FCOMP FSUB FSUBR FDIV FDIVR  */
+	0xFD,		/* D9 FLD - FST FSTP FLDENV FLDCW FNSTENV FNSTCW  */
+	0xFF,		/* DA FIADD FIMUL FICOM FICOMP FISUB ... FIDIVR   */
+	0xAF,		/* DB FILD FISTTP FIST FISTP - FLD - FSTP	  */
+	0xFF,		/* DC FADD FMUL FCOM FCOMP FSUB FSUBR FDIV FDIVR  */
+	0xDF,		/* DD FLD FISTTP FST FSTP FRSTOR - FNSAVE FNSTSW  */
+	0xFF,		/* DE FIADD FIMUL FICOM FICOMP FISUB ... FIDIVR   */
+	0xFF		/* DF FILD FISTTP FIST FISTP FBLD FILD FBSTP FISTP */
+};
+
+
+/**
+ * @var copro_reg_map[8][8]
+ * Coprocessor opcodes with a register operand (MODRM mod field is 11);
+ * indexed by the escape opcode (D8-DF) and the MODRM reg field, each
+ * element is a bitmap of the valid MODRM rm fields.
+ * @see copro_mem_map
+ */
+static const uint8_t copro_reg_map[8][8] = {
+/* D8 */
+	{
+	0xFF,		/* FADD  ST, ST(i)		*/
+	0xFF,		/* FMUL  ST, ST(i)		*/
+	0xFF,		/* FCOM  ST(i)			*/
+	0xFF,		/* FCOMP ST(i)			*/
+	0xFF,		/* FSUB  ST, ST(i)		*/
+	0xFF,		/* FSUBR ST, ST(i)		*/
+	0xFF,		/* FDIV  ST, ST(i)		*/
+	0xFF		/* FDIVR ST, ST(i)		*/
+	},
+
+/* D9 */
+	{
+	0xFF,		/* FLD   ST(i)			*/
+	0xFF,		/* FXCH  ST(i)			*/
+	0x01,		/* FNOP				*/
+	0x00,
+	0x33,		/* FCHS FABS - - FTST FXAM	*/
+	0x7F,		/* FLD1 FLDL2T ... FLDZ		*/
+	0xFF,		/* F2XM1 FYL2X ... FINCSTP	*/
+	0xFF		/* FPREM FYL2XP1 ... FCOS	*/
+	},
+
+/* DA */
+	{
+	0xFF,		/* FCMOVB  ST, ST(i)		*/
+	0xFF,		/* FCMOVE  ST, ST(i)		*/
+	0xFF,		/* FCMOVBE ST, ST(i)		*/
+	0xFF,		/* FCMOVU  ST, ST(i)		*/
+	0x00,
+	0x02,		/* FUCOMPP			*/
+	0x00,
+	0x00
+	},
+
+/* DB */
+	{
+	0xFF,		/* FCMOVNB  ST, ST(i)		*/
+	0xFF,		/* FCMOVNE  ST, ST(i)		*/
+	0xFF,		/* FCMOVNBE ST, ST(i)		*/
+	0xFF,		/* FCMOVNU  ST, ST(i)		*/
+	0x0C,		/* FNCLEX FNINIT		*/
+	0xFF,		/* FUCOMI ST, ST(i)		*/
+	0xFF,		/* FCOMI  ST, ST(i)		*/
+	0x00
+	},
+
+/* DC */
+	{
+	0xFF,		/* FADD  ST(i), ST		*/
+	0xFF,		/* FMUL  ST(i), ST		*/
+	0x00,
+	0x00,
+	0xFF,		/* FSUBR ST(i), ST		*/
+	0xFF,		/* FSUB  ST(i), ST		*/
+	0xFF,		/* FDIVR ST(i), ST		*/
+	0xFF		/* FDIV  ST(i), ST		*/
+	},
+
+/* DD */
+	{
+	0xFF,		/* FFREE  ST(i)			*/
+	0x00,
+	0xFF,		/* FST    ST(i)			*/
+	0xFF,		/* FSTP   ST(i)			*/
+	0xFF,		/* FUCOM  ST(i)			*/
+	0xFF,		/* FUCOMP ST(i)			*/
+	0x00,
+	0x00
+	},
+
+/* DE */
+	{
+	0xFF,		/* FADDP  ST(i), ST		*/
+	0xFF,		/* FMULP  ST(i), ST		*/
+	0x00,
+	0x02,		/* FCOMPP			*/
+	0xFF,		/* FSUBRP ST(i), ST		*/
+	0xFF,		/* FSUBP  ST(i), ST		*/
+	0xFF,		/* FDIVRP ST(i), ST		*/
+	0xFF		/* FDIVP  ST(i), ST		*/
+	},
+
+/* DF */
+	{
+	0xFF,		/* FFREEP ST(i)		XXX	*/
+	0x00,
+	0x00,
+	0x00,
+	0x01,		/* FNSTSW AX			*/
+	0xFF,		/* FUCOMIP ST, ST(i)		*/
+	0xFF,		/* FCOMIP  ST, ST(i)		*/
+	0x00
+	}
 };
 
 
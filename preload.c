@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "khook.h"
+
+
+/**
+ * Max. number of hooks in a spec file.
+ */
+#define PRELOAD_MAXHOOKS	256
+
+/**
+ * Max. length of a symbol name.
+ */
+#define PRELOAD_MAXNAME		64
+
+/**
+ * Number of records of the trace ring (power of 2).
+ */
+#define PRELOAD_TRACE		4096
+
+/*
+ * Hook types.
+ */
+#define PRELOAD_COUNT		0	/**< Count the calls		*/
+#define PRELOAD_TRACE_CALLS	1	/**< Trace the calls		*/
+#define PRELOAD_LATENCY		2	/**< Cycles per call site	*/
+
+
+/**
+ * Hook read from the spec file.
+ */
+typedef struct _hook {
+	char		 name[PRELOAD_MAXNAME];	/**< Symbol		*/
+	int		 type;			/**< PRELOAD_*		*/
+	unsigned long	 rate;			/**< Sampling rate	*/
+	unsigned long	 seen;			/**< Calls seen (trace)	*/
+	void		*fn;			/**< Hooked address	*/
+	KHOOK_COUNTER	*counter;		/**< Call counter	*/
+	KHOOK_CALLERS	*callers;		/**< Call sites		*/
+} HOOK;
+
+
+/**
+ * Trace record.
+ */
+typedef struct _trace {
+	uint64_t	 tsc;			/**< Time stamp		*/
+	const HOOK	*hook;			/**< Hook		*/
+	long		 ra;			/**< Return address	*/
+	long		 arg;			/**< First argument	*/
+	long		 tid;			/**< Thread id		*/
+} TRACE;
+
+
+static HOOK _hooks[PRELOAD_MAXHOOKS];
+static int _nhooks;
+static TRACE _trace[PRELOAD_TRACE];
+static unsigned long _tracepos;
+static struct timespec _t0;
+static uint64_t _tsc0;
+static __thread long _tid;
+
+
+/**
+ * Get the id of the calling thread.
+ * It is read once per thread.
+ * @return Thread id.
+ */
+static long
+_gettid(void)
+{
+
+	if (_tid == 0) {
+		_tid = syscall(SYS_gettid);
+	}
+	return (_tid);
+}
+
+
+/**
+ * Trace callback.
+ * It records 1 call out of <code>hook->rate</code> in the trace ring.
+ * @param arg Hook;
+ * @param ra Return address of the traced call;
+ * @param ... Arguments of the traced call.
+ */
+static void
+_trace_call(long arg, long ra, ...)
+{
+	HOOK *hook;
+	TRACE *rec;
+	va_list ap;
+
+	hook = (HOOK *)arg;
+	if (__atomic_fetch_add(&hook->seen, 1, __ATOMIC_RELAXED) %
+	    hook->rate != 0) {
+		return;
+	}
+	rec = &_trace[__atomic_fetch_add(&_tracepos, 1, __ATOMIC_RELAXED) &
+	    (PRELOAD_TRACE - 1)];
+	rec->tsc = __builtin_ia32_rdtsc();
+	rec->hook = hook;
+	rec->ra = ra;
+	rec->tid = _gettid();
+	va_start(ap, ra);
+	rec->arg = va_arg(ap, long);
+	va_end(ap);
+}
+
+
+/**
+ * Read the spec file.
+ * Every line is "<symbol> <count|trace|latency> [rate]" (count takes
+ * no rate); empty lines and lines starting with '#' are ignored.
+ * @param path Spec file path.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_read_spec(const char *path)
+{
+	FILE *fp;
+	HOOK *hook;
+	char line[256], type[16];
+	int lineno, n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		warn("khook: %s", path);
+		return (-1);
+	}
+	for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+		if (line[strspn(line, " \t\n")] == '\0' ||
+		    line[strspn(line, " \t")] == '#') {
+			continue;
+		}
+		if (_nhooks == PRELOAD_MAXHOOKS) {
+			warnx("khook: %s:%d: too many hooks", path, lineno);
+			break;
+		}
+		hook = &_hooks[_nhooks];
+		hook->rate = 1;
+		n = sscanf(line, "%63s %15s %lu", hook->name, type,
+		    &hook->rate);
+		if (n < 2 || hook->rate == 0) {
+			warnx("khook: %s:%d: syntax error", path, lineno);
+			continue;
+		}
+		if (strcmp(type, "count") == 0) {
+			if (n == 3) {
+				warnx("khook: %s:%d: count takes no rate",
+				    path, lineno);
+				continue;
+			}
+			hook->type = PRELOAD_COUNT;
+		} else if (strcmp(type, "trace") == 0) {
+			hook->type = PRELOAD_TRACE_CALLS;
+		} else if (strcmp(type, "latency") == 0) {
+			hook->type = PRELOAD_LATENCY;
+		} else {
+			warnx("khook: %s:%d: unknown hook type %s", path,
+			    lineno, type);
+			continue;
+		}
+		_nhooks++;
+	}
+	fclose(fp);
+	return (0);
+}
+
+
+/**
+ * Change the protection of the pages patched by the hooks.
+ * @param prot Protection.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_protect(int prot)
+{
+	uintptr_t start, end, pgsiz;
+	int i;
+
+	pgsiz = (uintptr_t)sysconf(_SC_PAGESIZE);
+	for (i = 0; i < _nhooks; i++) {
+		if (_hooks[i].fn == NULL) {
+			continue;
+		}
+		start = (uintptr_t)_hooks[i].fn & ~(pgsiz - 1);
+		end = ((uintptr_t)_hooks[i].fn + KHOOK_SIZEOF_MAXPATCH +
+		    pgsiz - 1) & ~(pgsiz - 1);
+		if (mprotect((void *)start, end - start, prot) < 0) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * Install a hook.
+ * @param hook Hook;
+ * @param hcode Destination address for the hooking code;
+ * @param hsize Available size in the <code>hcode</code> buffer.
+ * @return The size of the hooking code; <code>0</code> on error.
+ */
+static size_t
+_install(HOOK *hook, void *hcode, size_t *hsize)
+{
+	size_t r;
+
+	switch (hook->type) {
+	case PRELOAD_COUNT:
+		hook->counter = mmap(NULL, sizeof(KHOOK_COUNTER),
+		    PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (hook->counter == MAP_FAILED) {
+			return (0);
+		}
+		r = khook_count(hook->fn, hcode, hsize, hook->counter);
+		break;
+	case PRELOAD_LATENCY:
+		hook->callers = mmap(NULL, sizeof(KHOOK_CALLERS),
+		    PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (hook->callers == MAP_FAILED) {
+			return (0);
+		}
+		hook->callers->rate = hook->rate;
+		r = khook_callers(hook->fn, hcode, hsize, hook->callers);
+		break;
+	default:
+		r = khook(hook->fn, hcode, hsize, (long)hook, _trace_call);
+		break;
+	}
+	return (r);
+}
+
+
+/**
+ * Install the hooks listed in the file named by <code>KHOOK_SPEC</code>.
+ * It runs before main(); the time spent is reported on stderr.
+ */
+__attribute__((constructor))
+static void
+_preload_init(void)
+{
+	struct timespec t0, t1;
+	KHOOK_ARENA arena;
+	KHOOK_TXN txn;
+	const char *path;
+	uint8_t *hcode;
+	size_t hsize, r;
+	int i, installed;
+
+	path = getenv("KHOOK_SPEC");
+	if (path == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	_t0 = t0;
+	_tsc0 = __builtin_ia32_rdtsc();
+	if (_read_spec(path) < 0 || _nhooks == 0) {
+		return;
+	}
+
+	/*
+	 * One arena for the code of all the hooks, W^X where available:
+	 * the hooked functions are patched without changing their
+	 * protection.
+	 */
+	if (khook_arena_init_wx(&arena, _nhooks * KHOOK_SIZEOF_MAXCODE) < 0 &&
+	    khook_arena_init(&arena, _nhooks * KHOOK_SIZEOF_MAXCODE) < 0) {
+		warn("khook: can't allocate the hooking code");
+		return;
+	}
+	hcode = arena.hcode;
+	hsize = arena.hsize;
+
+	/*
+	 * All the hooks are installed at once, or none is.
+	 */
+	if (khook_txn_begin(&txn) < 0) {
+		warnx("khook: can't hook");
+		return;
+	}
+	installed = 0;
+	for (i = 0; i < _nhooks; i++) {
+		_hooks[i].fn = dlsym(RTLD_DEFAULT, _hooks[i].name);
+		if (_hooks[i].fn == NULL) {
+			warnx("khook: %s: symbol not found", _hooks[i].name);
+			continue;
+		}
+		r = _install(&_hooks[i], hcode, &hsize);
+		if (r == 0) {
+			warnx("khook: %s: can't hook", _hooks[i].name);
+			_hooks[i].fn = NULL;
+			continue;
+		}
+		hcode += r;
+		installed++;
+	}
+	if (installed == 0) {
+		khook_txn_rollback(&txn);
+	} else if (arena.wbase == NULL &&
+	    _protect(PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+		warn("khook");
+		khook_txn_rollback(&txn);
+		installed = 0;
+	} else {
+		if (khook_txn_commit_stw(&txn, NULL) < 0) {
+			warnx("khook: can't install the hooks");
+			installed = 0;
+		}
+		if (arena.wbase == NULL) {
+			_protect(PROT_READ | PROT_EXEC);
+		}
+	}
+	if (installed == 0) {
+		for (i = 0; i < _nhooks; i++) {
+			_hooks[i].fn = NULL;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "khook: %d/%d hooks installed in %ld us%s\n",
+	    installed, _nhooks, (long)(t1.tv_sec - t0.tv_sec) * 1000000 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000,
+	    arena.huge ? " (huge pages)" : "");
+}
+
+
+/**
+ * Symbolizer of the call sites.
+ * @param ctx Unused;
+ * @param addr Code address;
+ * @param buf Destination buffer;
+ * @param len Its size.
+ * @return <code>0</code> if <code>addr</code> belongs to a known
+ * symbol; <code>-1</code> otherwise.
+ */
+static int
+_sym(void *ctx, const void *addr, char *buf, size_t len)
+{
+	Dl_info dli;
+
+	(void)ctx;
+	if (dladdr(addr, &dli) == 0 || dli.dli_sname == NULL) {
+		return (-1);
+	}
+	snprintf(buf, len, "%s", dli.dli_sname);
+	return (0);
+}
+
+
+/**
+ * Write the collected data to the file named by
+ * <code>KHOOK_PROFILE</code>, in the format named by
+ * <code>KHOOK_PROFILE_FORMAT</code>.
+ * @param path Output file.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_export(const char *path)
+{
+	static KHOOK_EXPORT x;
+	KHOOK_CALLER sites[64];
+	KHOOK_EVENT ev;
+	struct timespec t1;
+	const char *fmt;
+	TRACE *rec;
+	HOOK *hook;
+	unsigned long pos, i;
+	uint64_t hz, ns;
+	size_t n;
+	int h, format, fd, r;
+
+	fmt = getenv("KHOOK_PROFILE_FORMAT");
+	if ((format = khook_export_format(fmt)) < 0) {
+		warnx("khook: %s: unknown profile format", fmt);
+		return (-1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (uint64_t)(t1.tv_sec - _t0.tv_sec) * 1000000000 +
+	    t1.tv_nsec - _t0.tv_nsec;
+	hz = ns == 0 ? 0 : (uint64_t)((double)(__builtin_ia32_rdtsc() - _tsc0) *
+	    1e9 / ns);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn("khook: %s", path);
+		return (-1);
+	}
+	khook_export_begin(&x, fd, format, hz, _sym, NULL);
+	for (h = 0; h < _nhooks; h++) {
+		hook = &_hooks[h];
+		if (hook->fn == NULL) {
+			continue;
+		}
+		switch (hook->type) {
+		case PRELOAD_COUNT:
+			khook_export_count(&x, hook->name, hook->fn,
+			    khook_count_get(hook->counter));
+			break;
+		case PRELOAD_LATENCY:
+			n = khook_callers_snapshot(hook->callers, sites, 64);
+			khook_export_callers(&x, hook->name, hook->fn, sites,
+			    n < 64 ? n : 64);
+			break;
+		}
+	}
+
+	pos = _tracepos;
+	i = pos > PRELOAD_TRACE ? pos - PRELOAD_TRACE : 0;
+	for (; i < pos; i++) {
+		rec = &_trace[i & (PRELOAD_TRACE - 1)];
+		if (rec->hook == NULL) {
+			continue;
+		}
+		ev.tsc = rec->tsc - _tsc0;
+		ev.ra = (const void *)rec->ra;
+		ev.arg = rec->arg;
+		ev.tid = rec->tid;
+		khook_export_event(&x, rec->hook->name, rec->hook->fn, &ev);
+	}
+
+	r = khook_export_end(&x);
+	if (r < 0) {
+		warn("khook: %s", path);
+	}
+	close(fd);
+	return (r);
+}
+
+
+/**
+ * Report the collected data on stderr (or export it, see _export()).
+ */
+__attribute__((destructor))
+static void
+_preload_fini(void)
+{
+	KHOOK_CALLER sites[64];
+	TRACE *rec;
+	HOOK *hook;
+	unsigned long pos, i;
+	const char *path;
+	size_t n, j;
+	int h;
+
+	path = getenv("KHOOK_PROFILE");
+	if (path != NULL && _nhooks > 0) {
+		_export(path);
+		return;
+	}
+
+	for (h = 0; h < _nhooks; h++) {
+		hook = &_hooks[h];
+		if (hook->fn == NULL) {
+			continue;
+		}
+		switch (hook->type) {
+		case PRELOAD_COUNT:
+			fprintf(stderr, "khook: %s: %llu calls\n", hook->name,
+			    (unsigned long long)khook_count_get(hook->counter));
+			break;
+		case PRELOAD_LATENCY:
+			n = khook_callers_snapshot(hook->callers, sites, 64);
+			for (j = 0; j < n && j < 64; j++) {
+				fprintf(stderr, "khook: %s: from %p: %llu calls,"
+				    " %llu cycles/call\n", hook->name,
+				    sites[j].ra,
+				    (unsigned long long)sites[j].calls,
+				    (unsigned long long)(sites[j].calls == 0 ?
+				    0 : sites[j].cycles / sites[j].calls));
+			}
+			break;
+		default:
+			fprintf(stderr, "khook: %s: %lu calls\n", hook->name,
+			    hook->seen);
+			break;
+		}
+	}
+
+	pos = _tracepos;
+	i = pos > PRELOAD_TRACE ? pos - PRELOAD_TRACE : 0;
+	for (; i < pos; i++) {
+		rec = &_trace[i & (PRELOAD_TRACE - 1)];
+		if (rec->hook == NULL) {
+			continue;
+		}
+		fprintf(stderr, "khook: trace %llu %s from %#lx arg %#lx\n",
+		    (unsigned long long)rec->tsc, rec->hook->name, rec->ra,
+		    rec->arg);
+	}
+}
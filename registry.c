@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "khook.h"
+#include "registry.h"
+
+
+/**
+ * log2 of the initial number of slots of the registry.
+ */
+#define REGISTRY_MINBITS	6
+
+/**
+ * Slot of a removed hook.
+ */
+#define REGISTRY_TOMBSTONE	((KHOOK_INFO *)-1)
+
+
+/**
+ * Registry of the installed hooks.
+ * Open addressing hash table (linear probing) keyed by hooked address.
+ * Readers never lock: a table is never modified once it is replaced and
+ * a slot only changes from empty to a record and from a record to a
+ * tombstone. Writers are serialized by a spin lock.
+ * Replaced tables and removed records are never released since a reader
+ * could still be using them.
+ */
+typedef struct _registry {
+	uint32_t	  bits;		/**< log2 of the no. of slots	*/
+	uint32_t	  used;		/**< Used slots (and tombstones)*/
+	uint32_t	  live;		/**< Registered hooks		*/
+	struct _registry *prev;		/**< Replaced table		*/
+	KHOOK_INFO	 *slot[1];	/**< Slots			*/
+} REGISTRY;
+
+
+static REGISTRY *_registry;
+static int _registry_lock;
+
+
+/**
+ * Hash an address.
+ * @param addr Address;
+ * @param bits log2 of the number of slots.
+ * @return Slot index.
+ */
+static inline uint32_t
+_hash(const void *addr, uint32_t bits)
+{
+	return (((uint32_t)(uintptr_t)addr * 0x9E3779B1U) >> (32 - bits));
+}
+
+
+/**
+ * Acquire the writers lock.
+ */
+static void
+_lock(void)
+{
+	while (__atomic_test_and_set(&_registry_lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&_registry_lock, __ATOMIC_RELAXED)) {
+			__builtin_ia32_pause();
+		}
+	}
+}
+
+
+/**
+ * Release the writers lock.
+ */
+static void
+_unlock(void)
+{
+	__atomic_clear(&_registry_lock, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Find the slot of an address.
+ * @param reg Registry;
+ * @param addr Address to find.
+ * @return The slot containing the record of <code>addr</code> or the
+ * empty slot where it should be inserted.
+ */
+static KHOOK_INFO **
+_find(REGISTRY *reg, const void *addr)
+{
+	KHOOK_INFO *info;
+	uint32_t i, mask;
+
+	mask = (1U << reg->bits) - 1;
+	for (i = _hash(addr, reg->bits); ; i = (i + 1) & mask) {
+		info = __atomic_load_n(&reg->slot[i], __ATOMIC_ACQUIRE);
+		if (info == NULL ||
+		    (info != REGISTRY_TOMBSTONE && info->fn == addr)) {
+			return (&reg->slot[i]);
+		}
+	}
+}
+
+
+/**
+ * Allocate a new registry and move into it the records of the
+ * current one.
+ * It is called with the writers lock held.
+ * @param bits log2 of the number of slots.
+ * @return The new registry; <code>NULL</code> on error.
+ */
+static REGISTRY *
+_grow(uint32_t bits)
+{
+	REGISTRY *reg, *old;
+	KHOOK_INFO *info;
+	uint32_t i;
+
+	reg = calloc(1, sizeof(REGISTRY) + sizeof(KHOOK_INFO *) *
+	    ((1U << bits) - 1));
+	if (reg == NULL) {
+		return (NULL);
+	}
+	reg->bits = bits;
+	old = _registry;
+	if (old != NULL) {
+		for (i = 0; i < (1U << old->bits); i++) {
+			info = old->slot[i];
+			if (info != NULL && info != REGISTRY_TOMBSTONE) {
+				*_find(reg, info->fn) = info;
+				reg->used++;
+				reg->live++;
+			}
+		}
+	}
+	reg->prev = old;
+	__atomic_store_n(&_registry, reg, __ATOMIC_RELEASE);
+	return (reg);
+}
+
+
+/**
+ * Add a hook to the registry.
+ * @param info Hook to add (it is copied).
+ * @return The registered record; <code>NULL</code> if the address
+ * is already hooked or on error.
+ * @see registry_del()
+ */
+const KHOOK_INFO *
+registry_add(const KHOOK_INFO *info)
+{
+	REGISTRY *reg;
+	KHOOK_INFO **slot, *rec;
+
+	rec = malloc(sizeof(KHOOK_INFO));
+	if (rec == NULL) {
+		return (NULL);
+	}
+	memcpy(rec, info, sizeof(KHOOK_INFO));
+
+	_lock();
+	reg = _registry;
+	if (reg == NULL) {
+		reg = _grow(REGISTRY_MINBITS);
+	} else if ((reg->used + 1) * 4 > (3U << reg->bits)) {
+		/*
+		 * Keep the load factor (tombstones included) under 3/4:
+		 * double the slots if more than half are in use, otherwise
+		 * just drop the tombstones.
+		 */
+		reg = _grow((reg->live + 1) * 2 > (1U << reg->bits) ?
+		    reg->bits + 1 : reg->bits);
+	}
+	if (reg == NULL) {
+		_unlock();
+		free(rec);
+		return (NULL);
+	}
+	slot = _find(reg, info->fn);
+	if (*slot != NULL) {
+		/*
+		 * Already hooked.
+		 */
+		_unlock();
+		free(rec);
+		return (NULL);
+	}
+	__atomic_store_n(slot, rec, __ATOMIC_RELEASE);
+	reg->used++;
+	reg->live++;
+	_unlock();
+	return (rec);
+}
+
+
+/**
+ * Replace the record of a hook.
+ * The old record is not freed: lock-free readers may still use it.
+ * @param info New record (<code>info->fn</code> must be hooked).
+ * @return The new record; <code>NULL</code> if <code>info->fn</code> is
+ * not hooked or on memory exhaustion.
+ * @see registry_add()
+ */
+const KHOOK_INFO *
+registry_set(const KHOOK_INFO *info)
+{
+	KHOOK_INFO **slot, *rec;
+
+	rec = malloc(sizeof(KHOOK_INFO));
+	if (rec == NULL) {
+		return (NULL);
+	}
+	memcpy(rec, info, sizeof(KHOOK_INFO));
+
+	_lock();
+	if (_registry == NULL || *(slot = _find(_registry, info->fn)) == NULL) {
+		_unlock();
+		free(rec);
+		return (NULL);
+	}
+	__atomic_store_n(slot, rec, __ATOMIC_RELEASE);
+	_unlock();
+	return (rec);
+}
+
+
+/**
+ * Remove a hook from the registry.
+ * @param fn Hooked address.
+ * @return <code>0</code> on success; <code>-1</code> if the address
+ * is not hooked.
+ * @see registry_add()
+ */
+int
+registry_del(const void *fn)
+{
+	KHOOK_INFO **slot;
+	int rc;
+
+	rc = -1;
+	_lock();
+	if (_registry != NULL) {
+		slot = _find(_registry, fn);
+		if (*slot != NULL) {
+			__atomic_store_n(slot, REGISTRY_TOMBSTONE,
+			    __ATOMIC_RELEASE);
+			_registry->live--;
+			rc = 0;
+		}
+	}
+	_unlock();
+	return (rc);
+}
+
+
+/**
+ * Look up a hook.
+ * This function never locks: it can be called from any thread
+ * and from signal handlers.
+ * @param fn Address to look up.
+ * @return The record of the hook installed at <code>fn</code>;
+ * <code>NULL</code> if <code>fn</code> is not hooked.
+ * @see khook()
+ */
+const KHOOK_INFO *
+khook_lookup(const void *fn)
+{
+	REGISTRY *reg;
+
+	reg = __atomic_load_n(&_registry, __ATOMIC_ACQUIRE);
+	if (reg == NULL) {
+		return (NULL);
+	}
+	return (__atomic_load_n(_find(reg, fn), __ATOMIC_ACQUIRE));
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * khook-scan: report which functions of an i386 ELF file can be hooked.
+ *
+ * The file is mapped and every function listed in its symbol table is
+ * analyzed in place, as khook() would do, by a pool of threads.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <elf.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disass.h"
+#include "khook.h"
+
+
+/**
+ * Max. number of threads.
+ */
+#define SCAN_MAXTHREADS		64
+
+/**
+ * Distance of the hypothetical hooking code from the functions: far
+ * enough to need the longest encoding of every relative branch.
+ */
+#define SCAN_HCODE_DISTANCE	0x40000000
+
+
+/**
+ * Mapped ELF file.
+ */
+typedef struct _image {
+	const uint8_t	*map;		/**< File mapping		*/
+	size_t		 size;		/**< File size			*/
+	const Elf32_Ehdr *ehdr;		/**< ELF header			*/
+	const Elf32_Phdr *phdr;		/**< Program headers		*/
+	const Elf32_Shdr *shdr;		/**< Section headers		*/
+} IMAGE;
+
+/**
+ * Function to analyze.
+ */
+typedef struct _func {
+	const char	*name;		/**< Symbol			*/
+	uint32_t	 addr;		/**< Virtual address		*/
+	const uint8_t	*code;		/**< Code in the mapping	*/
+	const uint8_t	*end;		/**< End of the code		*/
+	int		 status;	/**< 0 or KHOOK_E*		*/
+	int		 replaced;	/**< Bytes replaced by the hook	*/
+	int		 recoded;	/**< Size of the re-encoded code */
+} FUNC;
+
+/**
+ * Worker thread.
+ */
+typedef struct _worker {
+	pthread_t	 thread;	/**< Thread			*/
+	const IMAGE	*img;		/**< File			*/
+	FUNC		*func;		/**< First function		*/
+	int		 n;		/**< Number of functions	*/
+} WORKER;
+
+
+/**
+ * Check that a range lies in a file.
+ * The bounds are compared without adding them, which could wrap.
+ * @param off Offset of the range;
+ * @param len Its length;
+ * @param size Size of the file.
+ * @return Non zero if the range is in the file.
+ */
+static inline int
+_inside(size_t off, size_t len, size_t size)
+{
+
+	return (off <= size && len <= size - off);
+}
+
+
+/**
+ * Find the code at a virtual address.
+ * @param img File;
+ * @param addr Virtual address;
+ * @param end Updated with the end of the segment in the mapping.
+ * @return The address in the mapping; <code>NULL</code> if
+ * <code>addr</code> is not in a loaded segment.
+ */
+static const uint8_t *
+_code(const IMAGE *img, uint32_t addr, const uint8_t **end)
+{
+	const Elf32_Phdr *ph;
+	int i;
+
+	for (i = 0; i < img->ehdr->e_phnum; i++) {
+		ph = &img->phdr[i];
+		if (ph->p_type != PT_LOAD || addr < ph->p_vaddr ||
+		    addr - ph->p_vaddr >= ph->p_filesz ||
+		    !_inside(ph->p_offset, ph->p_filesz, img->size)) {
+			continue;
+		}
+		*end = img->map + ph->p_offset + ph->p_filesz;
+		return (img->map + ph->p_offset + (addr - ph->p_vaddr));
+	}
+	return (NULL);
+}
+
+
+/**
+ * Read the file at a virtual address.
+ * @param ctx File;
+ * @param dst Destination buffer;
+ * @param addr Virtual address;
+ * @param len Number of bytes.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ * @see KHOOK_PEEK
+ */
+static int
+_peek(void *ctx, void *dst, const void *addr, size_t len)
+{
+	const uint8_t *src, *end;
+
+	src = _code(ctx, (uint32_t)(uintptr_t)addr, &end);
+	if (src == NULL || (size_t)(end - src) < len) {
+		return (-1);
+	}
+	memcpy(dst, src, len);
+	return (0);
+}
+
+
+/**
+ * Map an i386 ELF file.
+ * @param img Updated with the mapping;
+ * @param path File name.
+ * @return <code>0</code> on success; <code>-1</code> on error.
+ */
+static int
+_load(IMAGE *img, const char *path)
+{
+	const Elf32_Ehdr *eh;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		warn("%s", path);
+		return (-1);
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*eh)) {
+		warnx("%s: not an ELF file", path);
+		close(fd);
+		return (-1);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("%s", path);
+		return (-1);
+	}
+
+	eh = map;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+	    eh->e_machine != EM_386 ||
+	    !_inside(eh->e_phoff, (size_t)eh->e_phnum * sizeof(Elf32_Phdr),
+	    st.st_size) ||
+	    !_inside(eh->e_shoff, (size_t)eh->e_shnum * sizeof(Elf32_Shdr),
+	    st.st_size)) {
+		warnx("%s: not an i386 ELF file", path);
+		munmap(map, st.st_size);
+		return (-1);
+	}
+	img->map = map;
+	img->size = st.st_size;
+	img->ehdr = eh;
+	img->phdr = (const Elf32_Phdr *)(img->map + eh->e_phoff);
+	img->shdr = (const Elf32_Shdr *)(img->map + eh->e_shoff);
+	return (0);
+}
+
+
+/**
+ * Sort functions by address.
+ */
+static int
+_cmp(const void *a, const void *b)
+{
+	const FUNC *fa = a, *fb = b;
+
+	if (fa->addr != fb->addr) {
+		return (fa->addr < fb->addr ? -1 : 1);
+	}
+	return (0);
+}
+
+
+/**
+ * Read the functions of the symbol table (the dynamic symbol table if
+ * the file is stripped).
+ * Aliases (functions at the same address) are listed once.
+ * @param img File;
+ * @param nfunc Updated with the number of functions.
+ * @return The functions sorted by address; <code>NULL</code> on error.
+ */
+static FUNC *
+_symbols(const IMAGE *img, int *nfunc)
+{
+	const Elf32_Shdr *sh, *strsh;
+	const Elf32_Sym *sym;
+	const uint8_t *end;
+	FUNC *func;
+	size_t i, nsyms;
+	int k, n;
+
+	sh = NULL;
+	for (k = 0; k < img->ehdr->e_shnum; k++) {
+		if (img->shdr[k].sh_type == SHT_SYMTAB) {
+			sh = &img->shdr[k];
+			break;
+		}
+		if (img->shdr[k].sh_type == SHT_DYNSYM) {
+			sh = &img->shdr[k];
+		}
+	}
+	if (sh == NULL || sh->sh_link >= img->ehdr->e_shnum ||
+	    !_inside(sh->sh_offset, sh->sh_size, img->size)) {
+		return (NULL);
+	}
+
+	/*
+	 * The names are used in place: the string table must end with a
+	 * NUL.
+	 */
+	strsh = &img->shdr[sh->sh_link];
+	if (!_inside(strsh->sh_offset, strsh->sh_size, img->size) ||
+	    strsh->sh_size == 0 ||
+	    img->map[strsh->sh_offset + strsh->sh_size - 1] != '\0') {
+		return (NULL);
+	}
+
+	nsyms = sh->sh_size / sizeof(Elf32_Sym);
+	sym = (const Elf32_Sym *)(img->map + sh->sh_offset);
+	if ((func = calloc(nsyms + 1, sizeof(FUNC))) == NULL) {
+		return (NULL);
+	}
+	n = 0;
+	for (i = 0; i < nsyms; i++, sym++) {
+		if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC ||
+		    sym->st_shndx == SHN_UNDEF ||
+		    sym->st_shndx >= SHN_LORESERVE ||
+		    sym->st_name >= strsh->sh_size) {
+			continue;
+		}
+		func[n].code = _code(img, sym->st_value, &end);
+		if (func[n].code == NULL) {
+			continue;
+		}
+		if (sym->st_size != 0 &&
+		    (size_t)(end - func[n].code) > sym->st_size) {
+			end = func[n].code + sym->st_size;
+		}
+		func[n].name = (const char *)img->map + strsh->sh_offset +
+		    sym->st_name;
+		func[n].addr = sym->st_value;
+		func[n].end = end;
+		n++;
+	}
+
+	qsort(func, n, sizeof(FUNC), _cmp);
+	for (i = k = 0; k < n; k++) {
+		if (i == 0 || func[k].addr != func[i - 1].addr) {
+			func[i++] = func[k];
+		}
+	}
+	*nfunc = i;
+	return (func);
+}
+
+
+/**
+ * Analyze a range of functions.
+ * @param arg Worker.
+ * @return <code>NULL</code>.
+ */
+static void *
+_scan(void *arg)
+{
+	uint8_t buf[KHOOK_SIZEOF_MAXRECODED + SIZEOF_JMP32];
+	KHOOK_INFO info;
+	WORKER *w = arg;
+	FUNC *f;
+	int i, r;
+
+	for (i = 0, f = w->func; i < w->n; i++, f++) {
+		bzero(&info, sizeof(info));
+		info.fn = (void *)(uintptr_t)f->addr;
+		info.hcode = (void *)(uintptr_t)(f->addr +
+		    SCAN_HCODE_DISTANCE);
+		r = khook_relocate_gen(&info, buf, f->code, f->end, _peek,
+		    (void *)w->img);
+		f->status = r < 0 ? r : 0;
+		f->replaced = info.size;
+		f->recoded = r < 0 ? 0 : r;
+	}
+	return (NULL);
+}
+
+
+/**
+ * Name of a status.
+ * @param status <code>0</code> or <code>KHOOK_E*</code>.
+ * @return The name.
+ */
+static const char *
+_status(int status)
+{
+
+	switch (status) {
+	case 0:
+		return ("ok");
+	case KHOOK_EUNDEF:
+		return ("undef");
+	case KHOOK_ETRUNC:
+		return ("short");
+	default: /* KHOOK_ERELOC */
+		return ("reloc");
+	}
+}
+
+
+static void
+_usage(void)
+{
+
+	fprintf(stderr, "usage: khook-scan [-j threads] file\n");
+	exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	static WORKER w[SCAN_MAXTHREADS];
+	struct timespec t0, t1;
+	IMAGE img;
+	FUNC *func;
+	int ch, i, n, nthreads, nok;
+
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	while ((ch = getopt(argc, argv, "j:")) != -1) {
+		switch (ch) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+		_usage();
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	} else if (nthreads > SCAN_MAXTHREADS) {
+		nthreads = SCAN_MAXTHREADS;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (_load(&img, argv[0]) < 0) {
+		return (1);
+	}
+	if ((func = _symbols(&img, &n)) == NULL) {
+		errx(1, "%s: no symbol table", argv[0]);
+	}
+
+	/*
+	 * Split the functions in contiguous ranges, one for each thread.
+	 */
+	if (nthreads > n) {
+		nthreads = n > 0 ? n : 1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		w[i].img = &img;
+		w[i].func = func + (long)n * i / nthreads;
+		w[i].n = (long)n * (i + 1) / nthreads - (long)n * i / nthreads;
+		if (pthread_create(&w[i].thread, NULL, _scan, &w[i]) != 0) {
+			/*
+			 * Scan this range in the main thread.
+			 */
+			_scan(&w[i]);
+			w[i].n = -1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (w[i].n >= 0) {
+			pthread_join(w[i].thread, NULL);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	nok = 0;
+	for (i = 0; i < n; i++) {
+		printf("%08x %-5s %2d %3d %s\n", func[i].addr,
+		    _status(func[i].status), func[i].replaced,
+		    func[i].recoded, func[i].name);
+		nok += func[i].status == 0;
+	}
+	fflush(stdout);
+	fprintf(stderr, "khook-scan: %d/%d functions hookable, %d threads, "
+	    "%ld us\n", nok, n, nthreads,
+	    (long)(t1.tv_sec - t0.tv_sec) * 1000000 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000);
+	free(func);
+	return (0);
+}
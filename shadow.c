@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "shadow.h"
+
+
+/*
+ * Stack of the thread: [_lo, _hi).
+ */
+static __thread uintptr_t _lo;
+static __thread uintptr_t _hi;
+static __thread int _known;
+
+
+/**
+ * Get the bounds of the stack of the calling thread.
+ * They are read once; the calls made meanwhile (they may be intercepted
+ * too) see no bounds.
+ * @return Non zero if the bounds are known.
+ */
+static int
+_bounds(void)
+{
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+
+	if (!_known) {
+		_known = 1;
+		if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+			if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+				_lo = (uintptr_t)addr;
+				_hi = _lo + size;
+			}
+			pthread_attr_destroy(&attr);
+		}
+	}
+	return (_hi != 0);
+}
+
+
+/**
+ * Get an entry of a shadow stack.
+ * @param shadow Shadow stack;
+ * @param size Size of an entry;
+ * @param i Index.
+ * @return The entry.
+ */
+static inline SHADOW *
+_entry(const void *shadow, size_t size, int i)
+{
+	return ((SHADOW *)((uintptr_t)shadow + i * size));
+}
+
+
+/**
+ * Drop the calls left by longjmp(3) & co.
+ * Only the calls provably dead are dropped: their frames lie below
+ * <code>sp</code> within the stack of the thread. Calls on another
+ * stack (sigaltstack(2), makecontext(3)) may be still running and are
+ * kept.
+ * @param shadow Shadow stack;
+ * @param size Size of an entry;
+ * @param depth Number of entries;
+ * @param sp Stack address of the current frame.
+ * @return The new number of entries.
+ */
+int
+shadow_trim(void *shadow, size_t size, int depth, uintptr_t sp)
+{
+	SHADOW *s;
+	int i, n;
+
+	if (depth == 0 || !_bounds() || sp < _lo || sp >= _hi) {
+		return (depth);
+	}
+	for (i = n = 0; i < depth; i++) {
+		s = _entry(shadow, size, i);
+		if (s->sp >= _lo && s->sp < sp) {
+			continue;
+		}
+		if (n < i) {
+			memcpy(_entry(shadow, size, n), s, size);
+		}
+		n++;
+	}
+	return (n);
+}
+
+
+/**
+ * Find the entry of a call.
+ * @param shadow Shadow stack;
+ * @param size Size of an entry;
+ * @param depth Number of entries;
+ * @param sp Address of the return address of the call.
+ * @return The index of the entry; <code>-1</code> if not found.
+ */
+int
+shadow_find(const void *shadow, size_t size, int depth, uintptr_t sp)
+{
+	int i;
+
+	for (i = depth - 1; i >= 0; i--) {
+		if (_entry(shadow, size, i)->sp == sp) {
+			break;
+		}
+	}
+	return (i);
+}
+
+
+/**
+ * Remove an entry.
+ * @param shadow Shadow stack;
+ * @param size Size of an entry;
+ * @param depth Number of entries;
+ * @param i Index of the entry.
+ * @return The new number of entries.
+ */
+int
+shadow_drop(void *shadow, size_t size, int depth, int i)
+{
+	memmove(_entry(shadow, size, i), _entry(shadow, size, i + 1),
+	    (depth - i - 1) * size);
+	return (depth - 1);
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2013 Claudio Castiglia <ccastiglia@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors
+ *       may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <ucontext.h>
+#endif
+
+#include "khook.h"
+#include "stw.h"
+
+
+/**
+ * Max. number of threads that can be stopped.
+ */
+#define STW_MAXTHREADS	1024
+
+/**
+ * Signal stopping the threads.
+ */
+#define STW_SIGNAL	(SIGRTMIN + 3)
+
+/**
+ * Spins before sleeping while waiting to be resumed.
+ */
+#define STW_SPINS	1000
+
+/**
+ * Max. time to wait for a thread to stop (ns).
+ */
+#define STW_TIMEOUT	100000000L
+
+/*
+ * Thread states.
+ */
+#define STW_SIGNALED	0	/**< Signal sent			*/
+#define STW_STOPPED	1	/**< Waiting in the signal handler	*/
+#define STW_GONE	2	/**< Exited or left the handler		*/
+
+
+/**
+ * Stopped thread.
+ */
+typedef struct _stw_thread {
+	pid_t		 tid;		/**< Thread id			*/
+	int		 state;		/**< STW_*			*/
+	uint32_t	*ip;		/**< Saved instruction pointer	*/
+} STW_THREAD;
+
+
+static STW_THREAD _thread[STW_MAXTHREADS];
+static int _nthreads;
+static int _release;
+static int _busy;
+static int _installed;
+
+
+#ifdef __linux__
+
+/**
+ * Directory entry returned by getdents64.
+ */
+struct _dirent64 {
+	uint64_t	 d_ino;
+	int64_t		 d_off;
+	unsigned short	 d_reclen;
+	unsigned char	 d_type;
+	char		 d_name[1];
+};
+
+
+/**
+ * Get the id of the calling thread.
+ * @return Thread id.
+ */
+static pid_t
+_gettid(void)
+{
+
+	return ((pid_t)syscall(SYS_gettid));
+}
+
+
+/**
+ * Signal handler: publish the instruction pointer of the interrupted
+ * thread and wait for the installer to resume it.
+ * It ignores the signals of a stop that has been aborted.
+ * @param sig Signal;
+ * @param si Signal information;
+ * @param ctx Context of the interrupted thread.
+ */
+static void
+_stw_handler(int sig, siginfo_t *si, void *ctx)
+{
+	STW_THREAD *t;
+	pid_t tid;
+	int i, n, saved;
+
+	saved = errno;
+	tid = _gettid();
+	n = __atomic_load_n(&_nthreads, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		t = &_thread[i];
+		if (t->tid != tid ||
+		    __atomic_load_n(&t->state, __ATOMIC_ACQUIRE) !=
+		    STW_SIGNALED) {
+			continue;
+		}
+		t->ip = (uint32_t *)
+		    &((ucontext_t *)ctx)->uc_mcontext.gregs[REG_EIP];
+		__atomic_store_n(&t->state, STW_STOPPED, __ATOMIC_RELEASE);
+		for (n = 0; !__atomic_load_n(&_release, __ATOMIC_ACQUIRE);
+		    n++) {
+			if (n < STW_SPINS) {
+				__builtin_ia32_pause();
+			} else {
+				syscall(SYS_futex, &_release,
+				    FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+			}
+		}
+		__atomic_store_n(&t->state, STW_GONE, __ATOMIC_RELEASE);
+		break;
+	}
+	errno = saved;
+}
+
+
+/**
+ * Signal the threads of the process not signaled yet.
+ * It uses no memory allocation: some of the threads may already be
+ * stopped holding the allocator lock.
+ * @param self Id of the calling thread.
+ * @return The number of threads signaled; <code>-1</code> on error.
+ */
+static int
+_stw_signal(pid_t self)
+{
+	struct _dirent64 *de;
+	char buf[1024];
+	pid_t tid;
+	long nread, off;
+	int fd, i, found;
+	const char *p;
+
+	fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return (-1);
+	}
+	found = 0;
+	while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < nread; off += de->d_reclen) {
+			de = (struct _dirent64 *)(buf + off);
+			tid = 0;
+			for (p = de->d_name; *p >= '0' && *p <= '9'; p++) {
+				tid = tid * 10 + (*p - '0');
+			}
+			if (tid == 0 || *p != '\0' || tid == self) {
+				continue;
+			}
+			for (i = 0; i < _nthreads; i++) {
+				if (_thread[i].tid == tid) {
+					break;
+				}
+			}
+			if (i < _nthreads) {
+				continue;
+			}
+			if (_nthreads == STW_MAXTHREADS) {
+				close(fd);
+				return (-1);
+			}
+			_thread[i].tid = tid;
+			_thread[i].state = STW_SIGNALED;
+			_thread[i].ip = NULL;
+			__atomic_store_n(&_nthreads, i + 1, __ATOMIC_RELEASE);
+			if (syscall(SYS_tgkill, getpid(), tid, STW_SIGNAL) < 0) {
+				_thread[i].state = STW_GONE;
+			}
+			found++;
+		}
+	}
+	close(fd);
+	return (nread < 0 ? -1 : found);
+}
+
+
+/**
+ * Stop all the other threads of the process.
+ * Every thread is interrupted by a signal and waits in the signal
+ * handler until <code>stw_resume()</code> is called. Threads created
+ * meanwhile are caught by scanning <code>/proc/self/task</code> until
+ * no new thread shows up.
+ * @return The number of stopped threads; <code>-1</code> on error (a
+ * thread does not stop within <code>STW_TIMEOUT</code>, another stop is
+ * in progress...).
+ * @see stw_ip()
+ * @see stw_resume()
+ */
+int
+stw_stop(void)
+{
+	struct sigaction act;
+	struct timespec t0, t;
+	pid_t self;
+	int i, n, waiting;
+
+	if (__atomic_test_and_set(&_busy, __ATOMIC_ACQUIRE)) {
+		return (-1);
+	}
+
+	/*
+	 * The handler is never removed: the signal of an aborted stop can
+	 * still be delivered later.
+	 */
+	if (!_installed) {
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = _stw_handler;
+		act.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigfillset(&act.sa_mask);
+		if (sigaction(STW_SIGNAL, &act, NULL) < 0) {
+			__atomic_clear(&_busy, __ATOMIC_RELEASE);
+			return (-1);
+		}
+		_installed = 1;
+	}
+
+	/*
+	 * Wait for the threads of the previous stop to leave the handler
+	 * before reusing their slots.
+	 */
+	for (i = 0; i < _nthreads; i++) {
+		while (__atomic_load_n(&_thread[i].state, __ATOMIC_ACQUIRE) ==
+		    STW_STOPPED) {
+			sched_yield();
+		}
+	}
+	__atomic_store_n(&_nthreads, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&_release, 0, __ATOMIC_RELEASE);
+	self = _gettid();
+	do {
+		n = _stw_signal(self);
+		if (n < 0) {
+			stw_resume();
+			return (-1);
+		}
+	} while (n > 0);
+
+	/*
+	 * Wait for every thread to reach the handler.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		waiting = 0;
+		for (i = 0; i < _nthreads; i++) {
+			if (__atomic_load_n(&_thread[i].state,
+			    __ATOMIC_ACQUIRE) != STW_SIGNALED) {
+				continue;
+			}
+			if (syscall(SYS_tgkill, getpid(), _thread[i].tid,
+			    0) < 0) {
+				/*
+				 * Exited.
+				 */
+				_thread[i].state = STW_GONE;
+				continue;
+			}
+			waiting++;
+		}
+		if (waiting > 0) {
+			sched_yield();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		if (waiting > 0 && (t.tv_sec - t0.tv_sec) * 1000000000L +
+		    t.tv_nsec - t0.tv_nsec > STW_TIMEOUT) {
+			stw_resume();
+			return (-1);
+		}
+	} while (waiting > 0);
+
+	return (_nthreads);
+}
+
+
+/**
+ * Get the saved instruction pointer of a stopped thread.
+ * @param i Thread index (<code>0</code> to the value returned by
+ * <code>stw_stop()</code> - 1).
+ * @return The address of the instruction pointer (it can be changed
+ * to move the thread); <code>NULL</code> if the thread has exited.
+ */
+uint32_t *
+stw_ip(int i)
+{
+
+	if (_thread[i].state != STW_STOPPED) {
+		return (NULL);
+	}
+	return (_thread[i].ip);
+}
+
+
+/**
+ * Resume the threads stopped by <code>stw_stop()</code>.
+ * It does not wait for them to leave the signal handler: the next
+ * <code>stw_stop()</code> does.
+ */
+void
+stw_resume(void)
+{
+
+	__atomic_store_n(&_release, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &_release, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+	    NULL, 0);
+	__atomic_clear(&_busy, __ATOMIC_RELEASE);
+}
+
+#else	/* !__linux__ */
+
+int
+stw_stop(void)
+{
+
+	return (-1);
+}
+
+
+uint32_t *
+stw_ip(int i)
+{
+
+	return (NULL);
+}
+
+
+void
+stw_resume(void)
+{
+}
+
+#endif	/* __linux__ */